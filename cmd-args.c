@@ -7,6 +7,58 @@
 const char *argp_program_version = "lnvm-manager 1.0";
 const char *argp_program_bug_address = "Ivan Picoli <ivpi@itu.dk>";
 
+/* CMD INFO */
+
+static struct argp_option opt_info[] = {
+    {"json", 'j', 0, 0, "Print as JSON"},
+    {"csv", 'c', 0, 0, "Print as CSV"},
+    {0}
+};
+
+static char doc_info[] =
+        "\n\vExamples:\n"
+        "  lnvm info\n"
+        "  lnvm info -j\n";
+
+static error_t parse_opt_fmt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'j':
+            args->out_fmt = FMT_JSON;
+            break;
+        case 'c':
+            args->out_fmt = FMT_CSV;
+            break;
+        case ARGP_KEY_ARG:
+            argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_info = { opt_info, parse_opt_fmt, 0, doc_info};
+
+/* END CMD INFO */
+
+/* CMD DEV */
+
+static char doc_dev[] =
+        "\nList the LightNVM devices with their geometry and the targets\n"
+        "created on them. Devices are queried in parallel.\n"
+        "\n\vExamples:\n"
+        "  lnvm dev\n"
+        "  lnvm dev -j (one JSON object)\n"
+        "  lnvm dev -c (one CSV line per device)\n";
+
+struct argp argp_dev = { opt_info, parse_opt_fmt, 0, doc_dev};
+
+/* END CMD DEV */
+
 /* CMD NEW */
 
 static struct argp_option opt_new[] = {
@@ -124,13 +176,16 @@ struct argp argp_rm = { opt_rm, parse_opt_rm, 0, doc_rm};
 
 static struct argp_option opt_tgt[] = {
     {"tgtname", 'n', "TGTNAME", 0, "Target name e.g. tgt0"},
+    {"json", 'j', 0, 0, "Print as JSON"},
+    {"csv", 'c', 0, 0, "Print as CSV"},
     {0}
 };
 
 static char doc_tgt[] =
         "\n\vExamples:\n"
         "  lnvm tgt -n tgt0\n"
-        "  lnvm tgt tgt0\n";
+        "  lnvm tgt tgt0\n"
+        "  lnvm tgt -j tgt0\n";
 
 static error_t parse_opt_tgt(int key, char *arg, struct argp_state *state)
 {
@@ -147,6 +202,12 @@ static error_t parse_opt_tgt(int key, char *arg, struct argp_state *state)
             args->tgt_name = arg;
             args->arg_num++;
             break;
+        case 'j':
+            args->out_fmt = FMT_JSON;
+            break;
+        case 'c':
+            args->out_fmt = FMT_CSV;
+            break;
         case ARGP_KEY_ARG:
             if (args->arg_num > 1)
                 argp_usage(state);
@@ -236,14 +297,19 @@ static struct argp_option opt_putblk[] = {
     {"lunid", 'l', "LUN_ID", 0, "LUN ID. <int>"},
     {"blockid", 'b', "BLOCK_ID", 0, "Block ID. <int>"},
     {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"dedup", 'd', "FILE", 0, "Keep the block if pages of other blocks are "
+                                                "deduplicated to it in FILE"},
     {0}
 };
 
 static char doc_putblk[] =
         "\nYou must use the same LUN and block you allocated by 'getblock'.\n"
+        "Use 'd' for a block written with 'write -d': it is only freed when\n"
+        "no other block maps pages to it, and its own mappings are dropped.\n"
         "\n\vExamples:\n"
         "  lnvm putblock -l 1 -b 1022 -n mydev\n"
-        "  lnvm putblock -l 0 -b 5 -n mydev\n";
+        "  lnvm putblock -l 0 -b 5 -n mydev\n"
+        "  lnvm putblock -l 0 -b 1001 -n mydev -d mydev.dd\n";
 
 static error_t parse_opt_putblk(int key, char *arg, struct argp_state *state)
 {
@@ -262,6 +328,9 @@ static error_t parse_opt_putblk(int key, char *arg, struct argp_state *state)
                 argp_usage(state);
             args->arg_num++;
             break;
+        case 'd':
+            args->putblk_dd = arg;
+            break;
         case 'n':
             strcpy(args->putblk_tgt,arg);
             args->arg_num++;
@@ -324,8 +393,29 @@ static error_t parse_opt_io(int key, char *arg, struct argp_state *state)
             args->arg_num++;
             args->io_flag |= IOARGV;
             break;
+        case 'c':
+            args->io_csum = arg;
+            args->arg_num++;
+            args->io_flag |= IOARGC;
+            break;
+        case 'z':
+            args->io_lz = arg;
+            args->arg_num++;
+            break;
+        case 'd':
+            args->io_dd = arg;
+            args->arg_num++;
+            break;
+        case 'e':
+            args->io_evl = 1;
+            args->arg_num++;
+            break;
+        case 'f':
+            args->io_file = arg;
+            args->arg_num++;
+            break;
         case ARGP_KEY_ARG:
-            if (args->arg_num > 5)
+            if (args->arg_num > 9)
                 argp_usage(state);
             break;
         case ARGP_KEY_END:
@@ -346,6 +436,14 @@ static struct argp_option opt_write[] = {
     {"nr_pages", 'p', "NUMBER_OF_PAGES", 0, "Number of pages to read"}, 
     {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
     {"verbose", 'v', 0, 0, "Print info and output to the screen"},    
+    {"checksum", 'c', "FILE", 0, "Store a CRC32C of each page in FILE"},
+    {"compress", 'z', "FILE", 0, "Compress pages with LZ4, index in FILE"},
+    {"dedup", 'd', "FILE", 0, "Skip pages already on the device, map in "
+                                                                    "FILE"},
+    {"event-loop", 'e', 0, 0, "Issue all requests at once through the event "
+                                                                    "loop"},
+    {"file", 'f', "FILE", 0, "Write the content of FILE instead of a test "
+                                                                "pattern"},
     {0}
 };
 
@@ -358,12 +456,31 @@ static char doc_write[] =
    "\n Full block: use only 'b' and 'n' keys\n"
    " Individual page: use only 'b', 'n' and 's' keys or 'p' = 1\n"
    " A range of pages: use all keys ('b','n','s' and 'p')\n"
+   "\n Use 'c' to keep a CRC32C of every page in a checksum table.\n"
+   " Use 'z' to compress the pages with LZ4 (built with 'make LZ4=1'). They\n"
+   " are packed into as few plane pages as they fit in, after the pages\n"
+   " already written to the block.\n"
+   " Use 'd' to skip the pages whose content is already on the device; the\n"
+   " dedup file maps them to the copy and the others are appended to the\n"
+   " block.\n"
+   " Use 'e' to have all the page requests in flight at once, completed\n"
+   " through an event loop.\n"
+   " Use 'f' to write the content of a file; past its end, pages are\n"
+   " zeroed.\n"
    "\n\vExamples:\n"
    "  lnvm write -b 1022 -n mydev (full block write)\n"
    "  lnvm write -b 100 -s 10 -n mydev (individual page write)\n"
    "  lnvm write -b 75 -n mydev -s 5 -p 10 (range page write. From page " 
                                                                 "5 to 14)\n"
-   "  lnvm write -b 1000 -n mydev -p 8 (range page write. From page 0 to 7)\n";
+   "  lnvm write -b 1000 -n mydev -p 8 (range page write. From page 0 to 7)\n"
+   "  lnvm write -b 1000 -n mydev -c mydev.crc (full block write with "
+                                                            "checksums)\n"
+   "  lnvm write -b 1000 -n mydev -p 64 -z mydev.lz (compressed write of "
+                                                        "pages 0 to 63)\n"
+   "  lnvm write -b 1001 -n mydev -d mydev.dd (full block write, duplicate "
+                                                        "pages skipped)\n"
+   "  lnvm write -b 1001 -n mydev -p 16 -f data.img -d mydev.dd (16 pages "
+                                                    "of data.img, deduped)\n";
 
 static struct argp_option opt_read[] = {
     {"blockid", 'b', "BLOCK_ID", 0, "Block ID. <int>"},
@@ -371,6 +488,11 @@ static struct argp_option opt_read[] = {
     {"nr_pages", 'p', "NUMBER_OF_PAGES", 0, "Number of pages to read"}, 
     {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},    
     {"verbose", 'v', 0, 0, "Print info and output to the screen"},
+    {"checksum", 'c', "FILE", 0, "Check each page against CRC32C in FILE"},
+    {"compress", 'z', "FILE", 0, "Decompress pages written with 'write -z'"},
+    {"dedup", 'd', "FILE", 0, "Read pages written with 'write -d'"},
+    {"event-loop", 'e', 0, 0, "Issue all requests at once through the event "
+                                                                    "loop"},
     {0}
 };
 
@@ -382,6 +504,12 @@ static char doc_read[] =
    "\n Full block: use only 'b' and 'n' keys\n"
    " Individual page: use only 'b', 'n' and 's' keys or 'p' = 1\n"
    " A range of pages: use all keys ('b','n','s' and 'p')\n" 
+   "\n Use 'c' to check every page against a checksum table written by\n"
+   " 'write -c'. Mismatching pages are reported.\n"
+   " Use 'z' to read pages written with 'write -z'.\n"
+   " Use 'd' to read pages written with 'write -d'.\n"
+   " Use 'e' to have all the page requests in flight at once, completed\n"
+   " through an event loop.\n"
    "\n\vExamples:\n"
    "  lnvm read -b 50 -n mydev (full block read)\n"
    "  lnvm read -b 50 -s 10 -n mydev (individual page read)\n"
@@ -389,13 +517,512 @@ static char doc_read[] =
                                                                     "file)\n"
    "  lnvm read -b 50 -n mydev -s 5 -p 10 (range page read. From page " 
                                                                 "5 to 14)\n"
-   "  lnvm read -b 50 -n mydev -p 8 (range page read. From page 0 to 7)\n";
+   "  lnvm read -b 50 -n mydev -p 8 (range page read. From page 0 to 7)\n"
+   "  lnvm read -b 50 -n mydev -c mydev.crc (full block read with checksum "
+                                                                "check)\n"
+   "  lnvm read -b 1000 -n mydev -p 64 -z mydev.lz (compressed read of "
+                                                        "pages 0 to 63)\n"
+   "  lnvm read -b 1001 -n mydev -d mydev.dd (full block read through the "
+                                                        "dedup map)\n";
 
 struct argp argp_write = { opt_write, parse_opt_io, 0, doc_write};
 struct argp argp_read = { opt_read, parse_opt_io, 0, doc_read};
 
 /* END CMD IO READ/WRITE */
 
+/* CMD SCRUB */
+
+static struct argp_option opt_scrub[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"checksum", 'c', "FILE", 0, "Checksum table written by 'write -c'"},
+    {"blockid", 'b', "BLOCK_ID", 0, "Scrub only this block. <int>"},
+    {"rate", 'r', "MB/s", 0, "Bandwidth cap (default 32, 0 = unlimited)"},
+    {"verbose", 'v', 0, 0, "Print rate changes"},
+    {0}
+};
+
+static char doc_scrub[] =
+   "\nRead every block recorded in a checksum table and verify each page.\n"
+   "Without a table, a single block ('b') is checked against the pattern\n"
+   "written by 'lnvm write'.\n"
+   "The scrub rate is halved while the read latency shows the device is\n"
+   "busy with other I/O.\n"
+   "\n\vExamples:\n"
+   "  lnvm scrub -n mydev -c mydev.crc\n"
+   "  lnvm scrub -n mydev -c mydev.crc -r 100\n"
+   "  lnvm scrub -n mydev -b 1000 (pattern check of block 1000)\n";
+
+static error_t parse_opt_scrub(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->scrub_tgt, arg);
+            args->arg_num++;
+            args->scrub_flag |= IOARGN;
+            break;
+        case 'c':
+            args->scrub_csum = arg;
+            args->arg_num++;
+            args->scrub_flag |= IOARGC;
+            break;
+        case 'b':
+            args->scrub_blkid = atoi(arg);
+            args->arg_num++;
+            args->scrub_flag |= IOARGB;
+            break;
+        case 'r':
+            args->scrub_rate = atoi(arg);
+            args->arg_num++;
+            args->scrub_flag |= IOARGR;
+            break;
+        case 'v':
+            args->arg_num++;
+            args->scrub_flag |= IOARGV;
+            break;
+        case ARGP_KEY_ARG:
+            if (args->arg_num > 5)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_END:
+            if (!(args->scrub_flag & IOARGN) ||
+                            !(args->scrub_flag & (IOARGC | IOARGB)))
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_scrub = { opt_scrub, parse_opt_scrub, 0, doc_scrub};
+
+/* END CMD SCRUB */
+
+/* CMD APPEND */
+
+static struct argp_option opt_append[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"blockid", 'b', "BLOCK_ID", 0, "Block ID. <int>"},
+    {"page_start", 's', "PAGE_START", 0, "First free page in the block"},
+    {"lun", 'l', "LUN", 0, "Continue on blocks pre-allocated from LUN"},
+    {"timeout", 't', "MS", 0, "Program a partial page after MS ms "
+                                                "(default 100, 0 = never)"},
+    {"file", 'f', "FILE", 0, "Read records from FILE instead of stdin"},
+    {"checksum", 'c', "FILE", 0, "Store a CRC32C of each page in FILE"},
+    {"checkpoint", 'k', "FILE", 0, "Keep the writer state in FILE and resume "
+                                                                "from it"},
+    {"verbose", 'v', 0, 0, "Print a summary to stderr"},
+    {0}
+};
+
+static char doc_append[] =
+   "\nEach input line is a record. Records are packed back to back into\n"
+   "plane pages of the block, and a page is programmed when it is full,\n"
+   "when its oldest record is older than the timeout, or at the end of\n"
+   "the input. The address of every record is printed as\n"
+   "'block page offset length'.\n"
+   "With 'l', a background thread keeps a few blocks of the LUN allocated\n"
+   "and the records continue on the next one when a block is full.\n"
+   "With 'k', the open block, its next page and the blocks taken are kept\n"
+   "in a checkpoint file; a later run with the same file and without 'b'\n"
+   "continues where the last one stopped, even if it crashed.\n"
+   "\n\vExamples:\n"
+   "  lnvm append -n mydev -b 1000 < records.log > records.map\n"
+   "  lnvm append -n mydev -l 2 < records.log > records.map\n"
+   "  tail -f app.log | lnvm append -n mydev -b 1000 -s 12 -t 50\n"
+   "  tail -f app.log | lnvm append -n mydev -l 2 -k app.ckpt\n";
+
+static error_t parse_opt_append(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->app_tgt, arg);
+            args->arg_num++;
+            args->app_flag |= IOARGN;
+            break;
+        case 'b':
+            args->app_blkid = atoi(arg);
+            args->arg_num++;
+            args->app_flag |= IOARGB;
+            break;
+        case 's':
+            args->app_pgstart = atoi(arg);
+            args->arg_num++;
+            args->app_flag |= IOARGS;
+            break;
+        case 'l':
+            args->app_lun = atoi(arg);
+            args->arg_num++;
+            args->app_flag |= IOARGL;
+            break;
+        case 't':
+            args->app_timeout = atoi(arg);
+            args->arg_num++;
+            break;
+        case 'f':
+            args->app_file = arg;
+            args->arg_num++;
+            break;
+        case 'c':
+            args->app_csum = arg;
+            args->arg_num++;
+            args->app_flag |= IOARGC;
+            break;
+        case 'k':
+            args->app_ckpt = arg;
+            args->arg_num++;
+            break;
+        case 'v':
+            args->arg_num++;
+            args->app_flag |= IOARGV;
+            break;
+        case ARGP_KEY_ARG:
+            if (args->arg_num > 9)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_END:
+            if (!(args->app_flag & IOARGN) ||
+                (!(args->app_flag & (IOARGB | IOARGL)) && !args->app_ckpt))
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_append = { opt_append, parse_opt_append, 0, doc_append};
+
+/* END CMD APPEND */
+
+/* CMD COPY */
+
+static struct argp_option opt_copy[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"page_start", 's', "PAGE_START", 0, "First page to copy"},
+    {"nr_pages", 'p', "NUMBER_OF_PAGES", 0, "Number of pages to copy"},
+    {"checksum", 'c', "FILE", 0, "Verify source pages and record the "
+                                                "copies in checksum FILE"},
+    {"verbose", 'v', 0, 0, "Print every copy"},
+    {0}
+};
+
+static char doc_copy[] =
+   "\nCopy the same page range (the full block by default) from each\n"
+   "source block to its destination block. Every copy is given as\n"
+   "SRC_LUN:SRC_BLOCK:DST_LUN:DST_BLOCK; the copies run in parallel.\n"
+   "The destination blocks must have been allocated by 'getblock'.\n"
+   "\n\vExamples:\n"
+   "  lnvm copy -n mydev 0:1000:2:1500 (full block)\n"
+   "  lnvm copy -n mydev -s 0 -p 64 0:1000:2:1500 1:1001:3:1501\n";
+
+static error_t parse_opt_copy(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+    struct nvm_copy *cp;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->cp_tgt, arg);
+            args->cp_flag |= IOARGN;
+            break;
+        case 's':
+            args->cp_pgstart = atoi(arg);
+            args->cp_flag |= IOARGS;
+            break;
+        case 'p':
+            args->cp_nrpages = atoi(arg);
+            args->cp_flag |= IOARGP;
+            break;
+        case 'c':
+            args->cp_csum = arg;
+            args->cp_flag |= IOARGC;
+            break;
+        case 'v':
+            args->cp_flag |= IOARGV;
+            break;
+        case ARGP_KEY_ARG:
+            if (args->cp_nr == COPY_MAX_JOBS) {
+                printf("Too many copies (max %d)\n", COPY_MAX_JOBS);
+                argp_usage(state);
+            }
+            cp = &args->cp[args->cp_nr];
+            if (sscanf(arg, "%u:%u:%u:%u", &cp->src_lun, &cp->src_blk,
+                                        &cp->dst_lun, &cp->dst_blk) != 4)
+                argp_usage(state);
+            args->cp_nr++;
+            break;
+        case ARGP_KEY_END:
+            if (!(args->cp_flag & IOARGN) || !args->cp_nr)
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_copy = { opt_copy, parse_opt_copy,
+                    "SRC_LUN:SRC_BLOCK:DST_LUN:DST_BLOCK...", doc_copy};
+
+/* END CMD COPY */
+
+/* CMD BENCH */
+
+static struct argp_option opt_bench[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"output", 'o', "FILE", 0, "Write the results to FILE (CSV)"},
+    {"baseline", 'b', "FILE", 0, "Compare with the results in FILE"},
+    {"threshold", 't', "PERCENT", 0, "Report results more than PERCENT "
+                    "below the baseline, and beyond their noise (default 10)"},
+    {"reps", 'r', "N", 0, "Samples of each benchmark, the median is kept "
+                                                        "(default 7, max 31)"},
+    {0}
+};
+
+static char doc_bench[] =
+   "\nTime pattern generation, the read/write page loop, block get/put\n"
+   "and page I/O at several sizes and queue depths. Blocks are allocated,\n"
+   "written and put back: run it on a test target or the simulated device\n"
+   "(LNVM_BACKEND=sim, see 'make bench').\n"
+   "Exits with status 2 when a result regressed against the baseline.\n"
+   "\n\vExamples:\n"
+   "  lnvm bench -n mydev -o bench.csv\n"
+   "  lnvm bench -n mydev -b bench.csv -t 5\n";
+
+static error_t parse_opt_bench(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->bench_tgt, arg);
+            args->arg_num++;
+            args->bench_flag |= IOARGN;
+            break;
+        case 'o':
+            args->bench_out = arg;
+            args->arg_num++;
+            break;
+        case 'b':
+            args->bench_base = arg;
+            args->arg_num++;
+            break;
+        case 't':
+            args->bench_thresh = atoi(arg);
+            args->arg_num++;
+            break;
+        case 'r':
+            args->bench_reps = atoi(arg);
+            args->arg_num++;
+            if (args->bench_reps < 1 || args->bench_reps > BENCH_MAX_REPS)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_ARG:
+            if (args->arg_num > 5)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_END:
+            if (!(args->bench_flag & IOARGN))
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_bench = { opt_bench, parse_opt_bench, 0, doc_bench};
+
+/* END CMD BENCH */
+
+/* CMD APPLY */
+
+static struct argp_option opt_apply[] = {
+    {"file", 'f', "FILE", 0, "Spec file, one 'device type name "
+                                        "lun_begin:lun_end' per line"},
+    {"dry-run", 'd', 0, 0, "Only print the changes"},
+    {0}
+};
+
+static char doc_apply[] =
+   "\nCreate and remove targets so the devices listed in the spec have\n"
+   "exactly the targets of the spec. Devices are changed in parallel; on\n"
+   "a failure, the targets created by this run are removed again.\n"
+   "\n\vExamples:\n"
+   "  lnvm apply -f /etc/lnvm/targets -d\n"
+   "  lnvm apply -f /etc/lnvm/targets\n";
+
+static error_t parse_opt_apply(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'f':
+            args->apply_file = arg;
+            args->arg_num++;
+            break;
+        case 'd':
+            args->apply_dry = 1;
+            args->arg_num++;
+            break;
+        case ARGP_KEY_ARG:
+            if (args->arg_num > 2)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_END:
+            if (!args->apply_file)
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_apply = { opt_apply, parse_opt_apply, 0, doc_apply};
+
+/* END CMD APPLY */
+
+/* CMD TUNE */
+
+static struct argp_option opt_tune[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev'"},
+    {"dry-run", 'd', 0, 0, "Only print the profile, do not save it"},
+    {0}
+};
+
+static char doc_tune[] =
+   "\nProbe request size, queue depth and number of LUNs on a target and\n"
+   "save the best settings of its device to the profile (LNVM_TUNE,\n"
+   "default /etc/lnvm/tune.conf), which all commands load. Blocks are\n"
+   "allocated, written and put back: run it on a test target.\n"
+   "\n\vExamples:\n"
+   "  lnvm tune -n mydev -d\n"
+   "  lnvm tune -n mydev\n";
+
+static error_t parse_opt_tune(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->tune_tgt, arg);
+            args->arg_num++;
+            break;
+        case 'd':
+            args->tune_dry = 1;
+            args->arg_num++;
+            break;
+        case ARGP_KEY_ARG:
+            if (args->arg_num > 2)
+                argp_usage(state);
+            break;
+        case ARGP_KEY_END:
+            if (!args->tune_tgt[0])
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_tune = { opt_tune, parse_opt_tune, 0, doc_tune};
+
+/* END CMD TUNE */
+
+/* CMD STATS */
+
+static struct argp_option opt_stats[] = {
+    {"target", 'n', "TARGET_NAME", 0, "Target name. e.g. 'mydev' "
+                                                    "(default: all targets)"},
+    {"interval", 'i', "SECS", 0, "Print again every SECS seconds"},
+    {"reset", 'r', 0, 0, "Reset the counters of the target"},
+    {"json", 'j', 0, 0, "Print as JSON"},
+    {"csv", 'c', 0, 0, "Print as CSV"},
+    {0}
+};
+
+static char doc_stats[] =
+   "\nShow the bytes written by users, programmed, padded and copied, the\n"
+   "bytes read and the blocks allocated and freed on each target, with\n"
+   "the write amplification factor (programmed / written by users).\n"
+   "Counters add up across runs, see LNVM_STATS.\n"
+   "\n\vExamples:\n"
+   "  lnvm stats\n"
+   "  lnvm stats -n mydev -i 1\n"
+   "  lnvm stats -n mydev -r\n";
+
+static error_t parse_opt_stats(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *args = state->input;
+
+    switch (key) {
+        case 'n':
+            if (strlen(arg) >= DISK_NAME_LEN) {
+                printf("Argument too long\n");
+                argp_usage(state);
+            }
+            strcpy(args->stats_tgt, arg);
+            break;
+        case 'i':
+            args->stats_interval = atoi(arg);
+            if (!args->stats_interval)
+                argp_usage(state);
+            break;
+        case 'r':
+            args->stats_reset = 1;
+            break;
+        case 'j':
+        case 'c':
+        case ARGP_KEY_ARG:
+            return parse_opt_fmt(key, arg, state);
+        case ARGP_KEY_END:
+            if (args->stats_reset && !args->stats_tgt[0])
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+struct argp argp_stats = { opt_stats, parse_opt_stats, 0, doc_stats};
+
+/* END CMD STATS */
+
 static void cmd_prepare(struct argp_state *state, struct arguments *args,
                                         char *cmd, struct argp *argp_cmd)
 {
@@ -423,10 +1050,14 @@ error_t parse_opt (int key, char *arg, struct argp_state *state)
     switch(key)
     {
         case ARGP_KEY_ARG:
-            if (strcmp(arg, "info") == 0)
+            if (strcmp(arg, "info") == 0){
                 args->cmdtype = LNVM_INFO;
-            else if (strcmp(arg, "dev") == 0)
+                cmd_prepare(state, args, "info", &argp_info);
+            }
+            else if (strcmp(arg, "dev") == 0){
                 args->cmdtype = LNVM_DEV;
+                cmd_prepare(state, args, "dev", &argp_dev);
+            }
             else if (strcmp(arg, "new") == 0){
                 args->cmdtype = LNVM_NEW;
                 cmd_prepare(state, args, "new", &argp_new);
@@ -455,6 +1086,34 @@ error_t parse_opt (int key, char *arg, struct argp_state *state)
                 args->cmdtype = LNVM_READ;
                 cmd_prepare(state, args, "read", &argp_read);
             }
+            else if (strcmp(arg, "scrub") == 0){
+                args->cmdtype = LNVM_SCRUB;
+                cmd_prepare(state, args, "scrub", &argp_scrub);
+            }
+            else if (strcmp(arg, "append") == 0){
+                args->cmdtype = LNVM_APPEND;
+                cmd_prepare(state, args, "append", &argp_append);
+            }
+            else if (strcmp(arg, "copy") == 0){
+                args->cmdtype = LNVM_COPY;
+                cmd_prepare(state, args, "copy", &argp_copy);
+            }
+            else if (strcmp(arg, "bench") == 0){
+                args->cmdtype = LNVM_BENCH;
+                cmd_prepare(state, args, "bench", &argp_bench);
+            }
+            else if (strcmp(arg, "apply") == 0){
+                args->cmdtype = LNVM_APPLY;
+                cmd_prepare(state, args, "apply", &argp_apply);
+            }
+            else if (strcmp(arg, "tune") == 0){
+                args->cmdtype = LNVM_TUNE;
+                cmd_prepare(state, args, "tune", &argp_tune);
+            }
+            else if (strcmp(arg, "stats") == 0){
+                args->cmdtype = LNVM_STATS;
+                cmd_prepare(state, args, "stats", &argp_stats);
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
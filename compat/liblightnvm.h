@@ -0,0 +1,14 @@
+/*  liblightnvm types used by lnvm-manager, for 'make SIM=1' builds on
+    machines without liblightnvm. The library calls themselves are not
+    available: all device access goes through the simulated backend.
+*/
+
+#ifndef __LIBLIGHTNVM_H
+#define __LIBLIGHTNVM_H
+
+#include <stdint.h>
+#include <linux/lightnvm.h>
+
+typedef struct nvm_ioctl_vblock NVM_VBLOCK;
+
+#endif
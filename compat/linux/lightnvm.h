@@ -0,0 +1,106 @@
+/*  Subset of the LightNVM ioctl interface (include/uapi/linux/lightnvm.h)
+    used by lnvm-manager, for builds against the simulated device on
+    kernels that no longer ship the header. Only used with 'make SIM=1'.
+*/
+
+#ifndef _UAPI_LINUX_LIGHTNVM_H
+#define _UAPI_LINUX_LIGHTNVM_H
+
+#include <linux/types.h>
+
+#define DISK_NAME_LEN 32
+
+#define NVM_TTYPE_NAME_MAX 48
+#define NVM_TTYPE_MAX 63
+#define NVM_MMTYPE_LEN 8
+
+#define NVM_PROV_SPEC_LUN 0x1
+#define NVM_PROV_RAND_LUN 0x2
+
+struct nvm_ioctl_info_tgt {
+    __u32 version[3];
+    __u32 reserved;
+    char tgtname[NVM_TTYPE_NAME_MAX];
+};
+
+struct nvm_ioctl_tgt {
+    char dev[DISK_NAME_LEN];
+    char tgttype[NVM_TTYPE_NAME_MAX];
+    char tgtname[DISK_NAME_LEN];
+};
+
+struct nvm_ioctl_tgt_info {
+    struct nvm_ioctl_tgt target;
+    __u32 version[3];
+    __u32 reserved;
+};
+
+struct nvm_ioctl_info {
+    __u32 version[3];
+    __u16 tgtsize;
+    __u16 reserved16;
+    __u32 reserved[12];
+    struct nvm_ioctl_tgt_info tgts[NVM_TTYPE_MAX];
+};
+
+struct nvm_ioctl_dev_prop {
+    __u32 page_size;
+    __u32 sec_size;
+    __u32 sec_per_page;
+    __u32 nr_planes;
+    __u32 nr_luns;
+    __u32 nr_channels;
+    __u32 plane_mode;
+    __u32 max_sec_io;
+    __u32 oob_size;
+};
+
+struct nvm_ioctl_dev_info {
+    char dev[DISK_NAME_LEN];
+    char bmname[NVM_MMTYPE_LEN];
+    __u32 bmversion[3];
+    __u32 flags;
+    struct nvm_ioctl_dev_prop prop;
+    __u32 reserved[8];
+};
+
+struct nvm_ioctl_get_devices {
+    __u32 nr_devices;
+    __u32 reserved[31];
+    struct nvm_ioctl_dev_info info[31];
+};
+
+struct nvm_ioctl_create_simple {
+    __u32 lun_begin;
+    __u32 lun_end;
+};
+
+struct nvm_ioctl_create_conf {
+    __u32 type;
+    union {
+        struct nvm_ioctl_create_simple s;
+    };
+};
+
+struct nvm_ioctl_tgt_create {
+    struct nvm_ioctl_tgt target;
+    __u32 flags;
+    struct nvm_ioctl_create_conf conf;
+};
+
+struct nvm_ioctl_tgt_remove {
+    char tgtname[DISK_NAME_LEN];
+    __u32 flags;
+};
+
+struct nvm_ioctl_vblock {
+    __u64 id;
+    __u64 bppa;
+    __u32 vlun_id;
+    __u32 nppas;
+    __u16 ppa_bitmap;
+    __u16 flags;
+    __u16 owner_id;
+};
+
+#endif
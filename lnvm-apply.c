@@ -0,0 +1,376 @@
+/*  Declarative target provisioning for lnvm-manager.
+
+    'lnvm apply' reads the targets a host should have, one per line:
+
+        # device  type    name    luns
+        nvme0n1   rrpc    tgt0    0:3
+        nvme0n1   dflash  tgt1    4:7
+        nvme1n1   rrpc    logs    0:15
+
+    and compares them with the targets online. Every target gives its
+    LUN range as begin:end, both included. Devices listed in the
+    spec are fully managed: their targets missing from the spec are
+    removed, new ones are created, and a target whose device or type
+    changed is removed and created again. Targets whose name, device and
+    type match are left alone (the kernel does not report LUN ranges).
+
+    The spec is checked as a whole before anything changes: two targets
+    on one device cannot share a LUN.
+
+    Devices are worked on in parallel, one thread each, in two rounds:
+    every removal ends before any creation starts, so a target moved to
+    another device finds the LUNs freed there. If any operation fails,
+    the others stop and every target created by this run is removed
+    again. Removed targets cannot be brought back.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <argp.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct apply_op {
+    int create;
+    struct nvm_ioctl_tgt_create c;
+    int done;
+};
+
+struct apply_ctx {
+    struct apply_op *ops;
+    int nr_ops;
+    char (*devs)[DISK_NAME_LEN];
+    int nr_devs;
+    int create;                 /* round: removals (0) or creations (1) */
+    int next;
+    int failed;
+};
+
+/* Parses a 'begin:end' LUN range; no sign, blank or trailing text */
+static int apply_parse_luns(const char *s, struct nvm_ioctl_tgt_create *c)
+{
+    unsigned long begin, end;
+    char *p;
+
+    if (*s < '0' || *s > '9')
+        return -1;
+    errno = 0;
+    begin = strtoul(s, &p, 10);
+    if (errno || *p != ':' || p[1] < '0' || p[1] > '9')
+        return -1;
+    end = strtoul(p + 1, &p, 10);
+    if (errno || *p != '\0' || begin > end || end > UINT32_MAX)
+        return -1;
+
+    c->conf.s.lun_begin = begin;
+    c->conf.s.lun_end = end;
+
+    return 0;
+}
+
+static int apply_parse(const char *path, struct nvm_ioctl_tgt_create *spec,
+                                                                    int max)
+{
+    char line[256], *tok, *save, *f[4];
+    FILE *fp;
+    int i, nr = 0, lineno = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        printf("Could not open %s.\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        struct nvm_ioctl_tgt_create *c = &spec[nr];
+
+        lineno++;
+        tok = strchr(line, '#');
+        if (tok)
+            *tok = '\0';
+
+        for (i = 0, tok = strtok_r(line, " \t\n", &save); tok && i < 4;
+                                    tok = strtok_r(NULL, " \t\n", &save))
+            f[i++] = tok;
+        if (!i)
+            continue;
+
+        if (i < 4 || tok || strlen(f[0]) >= DISK_NAME_LEN ||
+                                    strlen(f[1]) >= NVM_TTYPE_NAME_MAX ||
+                                    strlen(f[2]) >= DISK_NAME_LEN)
+            goto bad;
+        if (nr == APPLY_MAX_TGTS) {
+            printf("%s line %d: too many targets (max %d).\n", path, lineno,
+                                                            APPLY_MAX_TGTS);
+            goto err;
+        }
+
+        memset(c, 0, sizeof(*c));
+        strcpy(c->target.dev, f[0]);
+        strcpy(c->target.tgttype, f[1]);
+        strcpy(c->target.tgtname, f[2]);
+        if (apply_parse_luns(f[3], c))
+            goto bad;
+
+        for (i = 0; i < nr; i++) {
+            if (strcmp(spec[i].target.tgtname, c->target.tgtname) == 0) {
+                printf("%s line %d: target %s listed twice.\n", path, lineno,
+                                                        c->target.tgtname);
+                goto err;
+            }
+            if (strcmp(spec[i].target.dev, c->target.dev) == 0 &&
+                        c->conf.s.lun_begin <= spec[i].conf.s.lun_end &&
+                        spec[i].conf.s.lun_begin <= c->conf.s.lun_end) {
+                printf("%s line %d: LUNs %u:%u of %s overlap those of %s.\n",
+                        path, lineno, c->conf.s.lun_begin, c->conf.s.lun_end,
+                        c->target.tgtname, spec[i].target.tgtname);
+                goto err;
+            }
+        }
+        nr++;
+    }
+    fclose(fp);
+
+    return nr;
+
+bad:
+    printf("%s line %d: expected 'device type name lun_begin:lun_end'.\n",
+                                                                path, lineno);
+err:
+    fclose(fp);
+    return -1;
+}
+
+static int apply_has_dev(struct apply_ctx *ctx, const char *dev)
+{
+    int i;
+
+    for (i = 0; i < ctx->nr_devs; i++)
+        if (strcmp(ctx->devs[i], dev) == 0)
+            return 1;
+
+    return 0;
+}
+
+static void apply_add_dev(struct apply_ctx *ctx, const char *dev)
+{
+    if (!apply_has_dev(ctx, dev))
+        strcpy(ctx->devs[ctx->nr_devs++], dev);
+}
+
+static void apply_add(struct apply_ctx *ctx, int create,
+                                            struct nvm_ioctl_tgt_create *c)
+{
+    struct apply_op *op = &ctx->ops[ctx->nr_ops];
+
+    op->create = create;
+    op->c = *c;
+    op->done = 0;
+    ctx->nr_ops++;
+}
+
+static void apply_print(struct apply_op *op, const char *status)
+{
+    if (op->create)
+        printf(" create %-12s on %s, %s, LUNs %u:%u%s\n",
+                op->c.target.tgtname, op->c.target.dev, op->c.target.tgttype,
+                op->c.conf.s.lun_begin, op->c.conf.s.lun_end, status);
+    else
+        printf(" remove %-12s on %s%s\n", op->c.target.tgtname,
+                                                op->c.target.dev, status);
+}
+
+static int apply_run(struct apply_op *op)
+{
+    struct nvm_ioctl_tgt_remove rm;
+
+    if (op->create)
+        return nvm_be->create_target(&op->c);
+
+    memset(&rm, 0, sizeof(rm));
+    strcpy(rm.tgtname, op->c.target.tgtname);
+    return nvm_be->remove_target(&rm);
+}
+
+/* Work through the operations of the round on one device at a time, in
+ * order */
+static void *apply_worker(void *arg)
+{
+    struct apply_ctx *ctx = arg;
+    struct apply_op *op;
+    int d, i;
+
+    while ((d = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+                                                            ctx->nr_devs) {
+        for (i = 0; i < ctx->nr_ops; i++) {
+            op = &ctx->ops[i];
+            if (op->create != ctx->create ||
+                                    strcmp(op->c.target.dev, ctx->devs[d]))
+                continue;
+            if (__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED))
+                return NULL;
+
+            if (apply_run(op)) {
+                apply_print(op, ": FAILED");
+                __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            op->done = 1;
+        }
+    }
+
+    return NULL;
+}
+
+/* One round on every device in parallel, the caller being one thread */
+static void apply_round(struct apply_ctx *ctx, int create)
+{
+    pthread_t workers[DEV_WORKERS];
+    int i, nr_workers;
+
+    ctx->create = create;
+    ctx->next = 0;
+
+    nr_workers = (ctx->nr_devs - 1 < DEV_WORKERS) ? ctx->nr_devs - 1 :
+                                                                DEV_WORKERS;
+    for (i = 0; i < nr_workers; i++)
+        if (pthread_create(&workers[i], NULL, apply_worker, ctx))
+            break;
+    nr_workers = i;
+    apply_worker(ctx);
+    for (i = 0; i < nr_workers; i++)
+        pthread_join(workers[i], NULL);
+}
+
+/* Returns 0 when the targets match the spec (or would, with '-d') */
+int lnvm_apply(struct arguments *args)
+{
+    struct nvm_ioctl_tgt_create *spec = NULL, c;
+    struct nvm_ioctl_tgt_info *cur = NULL;
+    struct apply_ctx ctx;
+    uint8_t kept[APPLY_MAX_TGTS] = { 0 };
+    int nr_spec, nr_cur, i, j, keep = 0;
+    int created = 0, removed = 0, ret = 1;
+
+    printf("\n### LNVM APPLY ###\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    spec = malloc(APPLY_MAX_TGTS * sizeof(*spec));
+    cur = malloc(DEV_MAX_TGTS * sizeof(*cur));
+    /* At worst a removal per online target and a creation per spec line */
+    ctx.ops = malloc((APPLY_MAX_TGTS + DEV_MAX_TGTS) * sizeof(*ctx.ops));
+    ctx.devs = malloc((APPLY_MAX_TGTS + DEV_MAX_TGTS) * DISK_NAME_LEN);
+    if (!spec || !cur || !ctx.ops || !ctx.devs) {
+        printf("Could not allocate memory.\n");
+        goto out;
+    }
+
+    nr_spec = apply_parse(args->apply_file, spec, APPLY_MAX_TGTS);
+    if (nr_spec < 0)
+        goto out;
+
+    nr_cur = nvm_be->get_targets(cur, DEV_MAX_TGTS);
+    if (nr_cur < 0)
+        nr_cur = 0;
+
+    for (i = 0; i < nr_spec; i++)
+        apply_add_dev(&ctx, spec[i].target.dev);
+
+    /* Removals first: unlisted targets on managed devices, and targets
+     * that moved to another device or type */
+    for (i = 0; i < nr_cur; i++) {
+        struct nvm_ioctl_tgt *t = &cur[i].target;
+
+        for (j = 0; j < nr_spec; j++)
+            if (strcmp(spec[j].target.tgtname, t->tgtname) == 0)
+                break;
+
+        if (j < nr_spec && strcmp(spec[j].target.dev, t->dev) == 0 &&
+                            strcmp(spec[j].target.tgttype, t->tgttype) == 0) {
+            kept[j] = 1;
+            keep++;
+            continue;
+        }
+        if (j == nr_spec && !apply_has_dev(&ctx, t->dev))
+            continue;
+
+        memset(&c, 0, sizeof(c));
+        c.target = *t;
+        apply_add(&ctx, 0, &c);
+        apply_add_dev(&ctx, t->dev);
+    }
+
+    for (i = 0; i < nr_spec; i++) {
+        if (!kept[i])
+            apply_add(&ctx, 1, &spec[i]);
+    }
+
+    for (i = 0; i < ctx.nr_ops; i++)
+        apply_print(&ctx.ops[i], "");
+
+    if (!ctx.nr_ops) {
+        printf(" Nothing to do, %d target(s) up to date.\n\n", keep);
+        ret = 0;
+        goto out;
+    }
+    if (args->apply_dry) {
+        printf("\n Dry run: %d operation(s), %d target(s) up to date.\n\n",
+                                                        ctx.nr_ops, keep);
+        ret = 0;
+        goto out;
+    }
+
+    apply_round(&ctx, 0);
+    if (!ctx.failed)
+        apply_round(&ctx, 1);
+
+    for (i = 0; i < ctx.nr_ops; i++) {
+        if (!ctx.ops[i].done)
+            continue;
+        if (ctx.ops[i].create)
+            created++;
+        else
+            removed++;
+    }
+
+    if (!ctx.failed) {
+        printf("\n %d target(s) created, %d removed, %d up to date.\n\n",
+                                                    created, removed, keep);
+        ret = 0;
+        goto out;
+    }
+
+    /* Roll back: remove what this run created */
+    printf("\n Rolling back.\n");
+    for (i = 0; i < ctx.nr_ops; i++) {
+        struct apply_op *op = &ctx.ops[i];
+
+        if (!op->done || !op->create)
+            continue;
+        op->create = 0;
+        if (apply_run(op)) {
+            apply_print(op, ": FAILED");
+            continue;
+        }
+        apply_print(op, "");
+        created--;
+    }
+    if (removed)
+        printf(" %d target(s) removed before the failure cannot be "
+                                                    "restored.\n", removed);
+    if (created)
+        printf(" %d created target(s) could not be removed.\n", created);
+    printf("\n");
+
+out:
+    free(spec);
+    free(cur);
+    free(ctx.ops);
+    free(ctx.devs);
+    return ret;
+}
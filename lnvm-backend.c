@@ -0,0 +1,106 @@
+/*  Device backends for lnvm-manager.
+
+    All device access (the liblightnvm management calls, block get/put
+    and page pread/pwrite on the target) goes through nvm_be. By default
+    it is liblightnvm on a real OpenChannel SSD. Setting LNVM_BACKEND
+    selects another one:
+
+        LNVM_BACKEND=sim                        simulated device, defaults
+        LNVM_BACKEND=sim:luns=8,prog=900        simulated device, see lnvm-sim.c
+
+    Builds without liblightnvm (make SIM=1) only have the simulator.
+    Whatever the backend, its traffic is counted per target (see
+    lnvm-stats.c).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <argp.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+#ifndef LNVM_NO_LIBLIGHTNVM
+/* Targets show up as block devices: keep those the kernel knows as one */
+static int lightnvm_get_targets(struct nvm_ioctl_tgt_info *tgts, int max)
+{
+    struct dirent *de;
+    DIR *dir;
+    int nr = 0;
+
+    dir = opendir("/sys/block");
+    if (!dir)
+        return 0;
+
+    while ((de = readdir(dir)) && nr < max) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= DISK_NAME_LEN)
+            continue;
+        memset(&tgts[nr], 0, sizeof(tgts[nr]));
+        strcpy(tgts[nr].target.tgtname, de->d_name);
+        if (nvm_get_target_info(&tgts[nr]) == 0)
+            nr++;
+    }
+    closedir(dir);
+
+    return nr;
+}
+
+static struct nvm_backend lightnvm_backend = {
+    .name               = "liblightnvm",
+    .get_info           = nvm_get_info,
+    .get_devices        = nvm_get_devices,
+    .get_device_info    = nvm_get_device_info,
+    .create_target      = nvm_create_target,
+    .remove_target      = nvm_remove_target,
+    .get_target_info    = nvm_get_target_info,
+    .target_open        = nvm_target_open,
+    .target_close       = nvm_target_close,
+    .get_block          = nvm_get_block,
+    .put_block          = nvm_put_block,
+    .pread              = pread,
+    .pwrite             = pwrite,
+    .pg_per_blk         = NULL,
+    .get_targets        = lightnvm_get_targets,
+};
+
+struct nvm_backend *nvm_be = &lightnvm_backend;
+#else
+struct nvm_backend *nvm_be = &sim_backend;
+#endif
+
+int backend_init(void)
+{
+    const char *conf = getenv("LNVM_BACKEND");
+
+    if (!conf || !*conf) {
+#ifdef LNVM_NO_LIBLIGHTNVM
+        conf = "sim";
+#else
+        goto out;
+#endif
+    }
+
+#ifndef LNVM_NO_LIBLIGHTNVM
+    if (strcmp(conf, "liblightnvm") == 0) {
+        nvm_be = &lightnvm_backend;
+        goto out;
+    }
+#endif
+
+    if (strcmp(conf, "sim") == 0 || strncmp(conf, "sim:", 4) == 0) {
+        if (sim_init((conf[3] == ':') ? conf + 4 : ""))
+            return -1;
+        nvm_be = &sim_backend;
+        goto out;
+    }
+
+    printf("Unknown backend '%s' in LNVM_BACKEND.\n", conf);
+    return -1;
+
+out:
+    stats_wrap();
+    return 0;
+}
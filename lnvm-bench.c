@@ -0,0 +1,655 @@
+/*  Benchmarks for lnvm-manager.
+
+    Times the hot paths of the tool on a target, normally the simulated
+    device (see 'make bench'):
+
+        write_prepare   pattern generation for a full block
+        io_write/read   the page loop of 'lnvm write'/'lnvm read'
+        io_read_cached  the same read again, from the page cache, when
+                        LNVM_CACHE turns it on
+        getput          block get + put pairs
+        write/read      raw page I/O of 'pages' pages per call from
+                        'depth' threads, each on its own block
+        evl_read        1-page reads from 'depth' clients through one
+                        event loop reactor, each client resubmitting
+                        from its completion
+
+    Every benchmark takes 'reps' samples, each repeating its work for at
+    least BENCH_MIN_MS, and reports their median along with their spread:
+    the median absolute deviation, in percent of the median. Results are
+    printed, and written as CSV (bench,pages,depth,unit,value,spread)
+    with '-o'. With '-b', they are compared with a previous CSV. A result
+    is a regression when it is below its baseline by more than both
+    'threshold' percent and BENCH_NOISE times the sum of the two spreads,
+    so a noisy benchmark needs a larger drop to be reported.
+
+    The I/O benchmarks write to blocks they allocate and put back.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct bench_res {
+    char name[BENCH_NAME_LEN];
+    int pages;
+    int depth;
+    char unit[8];
+    double value;
+    double spread;
+};
+
+struct bench_thr {
+    int tgt_fd;
+    struct nvm_dev_info *info;
+    NVM_VBLOCK vblk;
+    uint8_t dir;
+    int pages;
+    char *buf;
+    pthread_t thread;
+    int ret;
+};
+
+struct bench_evl {
+    struct nvm_evl *evl;
+    struct nvm_dev_info *info;
+    int submitted;
+    int completed;
+    int failed;
+    int efd;
+};
+
+static struct bench_res bench_res[BENCH_MAX_RES];
+static int bench_nr_res;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double median(double *v, int n)
+{
+    qsort(v, n, sizeof(double), cmp_double);
+    return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Add the median of n samples, with their spread */
+static void bench_add(const char *name, int pages, int depth,
+                                    const char *unit, double *v, int n)
+{
+    double dev[BENCH_MAX_REPS];
+    struct bench_res *r;
+    int i;
+
+    if (bench_nr_res == BENCH_MAX_RES)
+        return;
+    r = &bench_res[bench_nr_res++];
+    snprintf(r->name, BENCH_NAME_LEN, "%s", name);
+    r->pages = pages;
+    r->depth = depth;
+    snprintf(r->unit, sizeof(r->unit), "%s", unit);
+    r->value = median(v, n);
+
+    for (i = 0; i < n; i++)
+        dev[i] = (v[i] > r->value) ? v[i] - r->value : r->value - v[i];
+    r->spread = (r->value > 0) ? median(dev, n) * 100 / r->value : 0;
+}
+
+static double mbps(size_t bytes, double t)
+{
+    return (t > 0) ? bytes / t / 1048576 : 0;
+}
+
+/* Has a sample run long enough? */
+static int bench_long(double t)
+{
+    return t >= BENCH_MIN_MS / 1000.0;
+}
+
+static int bench_get(int tgt_fd, NVM_VBLOCK *vblk)
+{
+    memset(vblk, 0, sizeof(*vblk));
+    vblk->flags |= NVM_PROV_RAND_LUN;
+    vblk->owner_id = 101;
+
+    if (nvm_be->get_block(tgt_fd, 0, vblk)) {
+        printf("nvm_get_block error. 'dmesg' for further info.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void bench_write_prepare(struct nvm_dev_info *info, int reps)
+{
+    size_t bytes = (size_t) info->pln_pg_size * info->pg_per_blk;
+    struct nvm_io_info io;
+    double v[BENCH_MAX_REPS];
+    double t, start;
+    int i, n;
+
+    memset(&io, 0, sizeof(io));
+    io.nr_pages = info->pg_per_blk;
+    io.buf_data = malloc(bytes);
+    if (!io.buf_data)
+        return;
+
+    for (i = 0; i < reps; i++) {
+        start = now_sec();
+        n = 0;
+        do {
+            write_prepare(&io, info, 0);
+            n++;
+            t = now_sec() - start;
+        } while (!bench_long(t));
+        v[i] = mbps(bytes * n, t);
+    }
+    free(io.buf_data);
+
+    bench_add("write_prepare", io.nr_pages, 1, "MB/s", v, reps);
+}
+
+/* One lnvm_io() on a full block, timed */
+static int bench_io_once(struct arguments *io_args, uint8_t dir, double *t)
+{
+    struct nvm_io_info io;
+    struct nvm_dev_info io_info;
+    double start;
+    int ret;
+
+    memset(&io, 0, sizeof(io));
+    start = now_sec();
+    ret = lnvm_io(&io, &io_info, dir, io_args);
+    *t += now_sec() - start;
+    free(io.buf_data);
+
+    return ret;
+}
+
+/* The page loop of 'lnvm write' and 'lnvm read', on a full block */
+static int bench_lnvm_io(struct arguments *args, int tgt_fd,
+                                        struct nvm_dev_info *info, int reps)
+{
+    size_t bytes = (size_t) info->pln_pg_size * info->pg_per_blk;
+    double v_wr[BENCH_MAX_REPS], v_rd[BENCH_MAX_REPS], v_ca[BENCH_MAX_REPS];
+    double t_wr, t_rd, t_ca;
+    struct arguments io_args;
+    NVM_VBLOCK vblk;
+    int i, n, ret = 0;
+
+    for (i = 0; i < reps && !ret; i++) {
+        t_wr = t_rd = t_ca = 0;
+        n = 0;
+        /* Until every figure of the sample ran long enough */
+        while (!ret && (!bench_long(t_wr) || !bench_long(t_rd) ||
+                                        (page_cache && !bench_long(t_ca)))) {
+            if (bench_get(tgt_fd, &vblk))
+                return -1;
+
+            memset(&io_args, 0, sizeof(io_args));
+            strcpy(io_args.io_tgt, args->bench_tgt);
+            io_args.io_blkid = vblk.id;
+
+            ret = bench_io_once(&io_args, WRITE, &t_wr);
+            ret |= bench_io_once(&io_args, READ, &t_rd);
+            /* The same read again, from the page cache */
+            if (page_cache)
+                ret |= bench_io_once(&io_args, READ, &t_ca);
+            n++;
+
+            nvm_be->put_block(tgt_fd, &vblk);
+            if (page_cache)
+                cache_inval_blk(page_cache, tgt_fd, vblk.id);
+        }
+        v_wr[i] = mbps(bytes * n, t_wr);
+        v_rd[i] = mbps(bytes * n, t_rd);
+        v_ca[i] = mbps(bytes * n, t_ca);
+    }
+    if (ret) {
+        printf("  lnvm_io failed.\n");
+        return -1;
+    }
+
+    bench_add("io_write", info->pg_per_blk, 1, "MB/s", v_wr, reps);
+    bench_add("io_read", info->pg_per_blk, 1, "MB/s", v_rd, reps);
+    if (page_cache)
+        bench_add("io_read_cached", info->pg_per_blk, 1, "MB/s", v_ca, reps);
+
+    return 0;
+}
+
+static int bench_getput(int tgt_fd, int reps)
+{
+    NVM_VBLOCK vblk[BENCH_GETPUT];
+    double v[BENCH_MAX_REPS];
+    double t, start;
+    int i, j, n, rounds;
+
+    for (i = 0; i < reps; i++) {
+        start = now_sec();
+        rounds = 0;
+        do {
+            for (n = 0; n < BENCH_GETPUT; n++)
+                if (bench_get(tgt_fd, &vblk[n]))
+                    break;
+            for (j = 0; j < n; j++)
+                nvm_be->put_block(tgt_fd, &vblk[j]);
+            if (n < BENCH_GETPUT)
+                return -1;
+            rounds++;
+            t = now_sec() - start;
+        } while (!bench_long(t));
+        v[i] = (double) rounds * BENCH_GETPUT / t;
+    }
+
+    bench_add("getput", 1, 1, "ops/s", v, reps);
+
+    return 0;
+}
+
+/* Runs on the reactor: the client sends its next request */
+static void bench_evl_end_io(struct nvm_evl_req *rq)
+{
+    struct bench_evl *b = rq->priv;
+
+    if (rq->ret)
+        b->failed = 1;
+
+    if (__atomic_fetch_add(&b->submitted, 1, __ATOMIC_RELAXED) <
+                                                            BENCH_EVL_OPS) {
+        rq->pg = (rq->pg + BENCH_EVL_CLIENTS) % b->info->pg_per_blk;
+        evl_submit(b->evl, rq);
+    }
+
+    if (__atomic_add_fetch(&b->completed, 1, __ATOMIC_RELAXED) ==
+                                                            BENCH_EVL_OPS) {
+        uint64_t one = 1;
+
+        if (write(b->efd, &one, sizeof(one)) != sizeof(one))
+            b->failed = 1;
+    }
+}
+
+/* BENCH_EVL_OPS reads from BENCH_EVL_CLIENTS clients */
+static void bench_evl_round(struct bench_evl *b, struct nvm_evl_req *rqs,
+                                            char *bufs, uint32_t blk_id)
+{
+    struct nvm_dev_info *info = b->info;
+    uint64_t n;
+    int j;
+
+    b->submitted = BENCH_EVL_CLIENTS;
+    b->completed = 0;
+
+    for (j = 0; j < BENCH_EVL_CLIENTS; j++) {
+        memset(&rqs[j], 0, sizeof(rqs[j]));
+        rqs[j].dir = READ;
+        rqs[j].buf = bufs + (size_t) j * info->pln_pg_size;
+        rqs[j].blk_id = blk_id;
+        rqs[j].pg = j % info->pg_per_blk;
+        rqs[j].nr_pages = 1;
+        rqs[j].efd = -1;
+        rqs[j].end_io = bench_evl_end_io;
+        rqs[j].priv = b;
+        evl_submit(b->evl, &rqs[j]);
+    }
+    if (read(b->efd, &n, sizeof(n)) != sizeof(n))
+        b->failed = 1;
+}
+
+static int bench_evl(int tgt_fd, struct nvm_dev_info *info, int reps)
+{
+    struct nvm_evl_req rqs[BENCH_EVL_CLIENTS];
+    struct nvm_evl evl;
+    struct bench_evl b;
+    NVM_VBLOCK vblk;
+    double v[BENCH_MAX_REPS];
+    double t, start;
+    char *bufs;
+    int i, rounds, ret = -1;
+
+    if (posix_memalign((void **)&bufs, info->sec_size,
+                        (size_t) BENCH_EVL_CLIENTS * info->pln_pg_size)) {
+        printf("Could not allocate aligned memory (%d,%d)\n", info->sec_size,
+                                                        info->pln_pg_size);
+        return -1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.evl = &evl;
+    b.info = info;
+    b.efd = eventfd(0, EFD_CLOEXEC);
+    if (b.efd < 0 || bench_get(tgt_fd, &vblk))
+        goto out;
+    if (evl_init(&evl, tgt_fd, info, 1, 1))
+        goto put;
+
+    for (i = 0; i < reps && !b.failed; i++) {
+        start = now_sec();
+        rounds = 0;
+        do {
+            bench_evl_round(&b, rqs, bufs, vblk.id);
+            rounds++;
+            t = now_sec() - start;
+        } while (!b.failed && !bench_long(t));
+        v[i] = (double) rounds * BENCH_EVL_OPS / t;
+    }
+    evl_free(&evl);
+
+    if (b.failed) {
+        printf("  Event loop I/O failed.\n");
+    } else {
+        ret = 0;
+        bench_add("evl_read", 1, BENCH_EVL_CLIENTS, "ops/s", v, reps);
+    }
+
+put:
+    nvm_be->put_block(tgt_fd, &vblk);
+out:
+    if (b.efd >= 0)
+        close(b.efd);
+    free(bufs);
+    return ret;
+}
+
+static void *bench_rw_worker(void *arg)
+{
+    struct bench_thr *thr = arg;
+    struct nvm_dev_info *info = thr->info;
+    int pg, n;
+
+    for (pg = 0; pg < info->pg_per_blk; pg += n) {
+        n = (info->pg_per_blk - pg < thr->pages) ?
+                                    info->pg_per_blk - pg : thr->pages;
+        if (lnvm_page_io(thr->tgt_fd, info, thr->dir, thr->buf,
+                                                    thr->vblk.id, pg, n)) {
+            thr->ret = -1;
+            break;
+        }
+        if (thr->dir == WRITE)
+            stats_add(thr->tgt_fd, STATS_HOST, (size_t) n * info->pln_pg_size);
+    }
+
+    return NULL;
+}
+
+/* One pass of 'depth' threads, each over a full block */
+static double bench_rw_pass(struct bench_thr *thr, int depth, uint8_t dir)
+{
+    double t;
+    int i, n, ret = 0;
+
+    t = now_sec();
+    for (n = 0; n < depth; n++) {
+        thr[n].dir = dir;
+        thr[n].ret = 0;
+        if (pthread_create(&thr[n].thread, NULL, bench_rw_worker, &thr[n]))
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(thr[i].thread, NULL);
+        ret |= thr[i].ret;
+    }
+    t = now_sec() - t;
+
+    return (n < depth || ret) ? -1 : t;
+}
+
+/* Write then read a fresh block per thread, adding up the pass times */
+static int bench_rw_round(int tgt_fd, struct bench_thr *thr, int depth,
+                                                    double *t_wr, double *t_rd)
+{
+    double t;
+    int n, ret = -1;
+
+    for (n = 0; n < depth; n++)
+        if (bench_get(tgt_fd, &thr[n].vblk))
+            break;
+
+    if (n == depth) {
+        t = bench_rw_pass(thr, depth, WRITE);
+        if (t >= 0) {
+            *t_wr += t;
+            t = bench_rw_pass(thr, depth, READ);
+            if (t >= 0) {
+                *t_rd += t;
+                ret = 0;
+            }
+        }
+    }
+
+    while (n--)
+        nvm_be->put_block(tgt_fd, &thr[n].vblk);
+
+    return ret;
+}
+
+static int bench_rw(int tgt_fd, struct nvm_dev_info *info, int pages,
+                                                        int depth, int reps)
+{
+    struct bench_thr thr[BENCH_MAX_DEPTH];
+    size_t bytes = (size_t) depth * info->pg_per_blk * info->pln_pg_size;
+    double v_wr[BENCH_MAX_REPS], v_rd[BENCH_MAX_REPS];
+    double t_wr, t_rd;
+    int i, n, rounds, ret = 0;
+    char *bufs;
+
+    if (posix_memalign((void **)&bufs, info->sec_size,
+                        (size_t) depth * pages * info->pln_pg_size)) {
+        printf("Could not allocate aligned memory (%d,%d)\n", info->sec_size,
+                                                        info->pln_pg_size);
+        return -1;
+    }
+    memset(bufs, 0x5a, (size_t) depth * pages * info->pln_pg_size);
+
+    for (n = 0; n < depth; n++) {
+        thr[n].tgt_fd = tgt_fd;
+        thr[n].info = info;
+        thr[n].pages = pages;
+        thr[n].buf = bufs + (size_t) n * pages * info->pln_pg_size;
+    }
+
+    for (i = 0; i < reps && !ret; i++) {
+        t_wr = t_rd = 0;
+        rounds = 0;
+        while (!ret && (!bench_long(t_wr) || !bench_long(t_rd))) {
+            ret = bench_rw_round(tgt_fd, thr, depth, &t_wr, &t_rd);
+            rounds++;
+        }
+        v_wr[i] = mbps(bytes * rounds, t_wr);
+        v_rd[i] = mbps(bytes * rounds, t_rd);
+    }
+    free(bufs);
+
+    if (ret) {
+        printf("  Page I/O failed (%d pages, depth %d).\n", pages, depth);
+        return -1;
+    }
+
+    bench_add("write", pages, depth, "MB/s", v_wr, reps);
+    bench_add("read", pages, depth, "MB/s", v_rd, reps);
+
+    return 0;
+}
+
+static struct bench_res *bench_find(struct bench_res *base, int nr,
+                                                    struct bench_res *r)
+{
+    int i;
+
+    for (i = 0; i < nr; i++)
+        if (strcmp(base[i].name, r->name) == 0 && base[i].pages == r->pages
+                                            && base[i].depth == r->depth &&
+                                            strcmp(base[i].unit, r->unit) == 0)
+            return &base[i];
+
+    return NULL;
+}
+
+static int bench_load(const char *path, struct bench_res *base)
+{
+    char line[128];
+    FILE *fp;
+    int nr = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        printf("Could not open baseline %s.\n", path);
+        return -1;
+    }
+
+    while (nr < BENCH_MAX_RES && fgets(line, sizeof(line), fp)) {
+        struct bench_res *r = &base[nr];
+
+        /* Baselines without a spread column compare on the threshold */
+        r->spread = 0;
+        if (sscanf(line, "%31[^,],%d,%d,%7[^,],%lf,%lf", r->name, &r->pages,
+                            &r->depth, r->unit, &r->value, &r->spread) >= 5)
+            nr++;
+    }
+    fclose(fp);
+
+    return nr;
+}
+
+static int bench_save(const char *path)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        printf("Could not open %s.\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "bench,pages,depth,unit,value,spread\n");
+    for (i = 0; i < bench_nr_res; i++)
+        fprintf(fp, "%s,%d,%d,%s,%.2f,%.2f\n", bench_res[i].name,
+                bench_res[i].pages, bench_res[i].depth, bench_res[i].unit,
+                bench_res[i].value, bench_res[i].spread);
+    fclose(fp);
+
+    return 0;
+}
+
+/* Print the results, against the baseline if any. Returns the number of
+ * regressions. */
+static int bench_report(struct bench_res *base, int nr_base,
+                                                        uint32_t threshold)
+{
+    struct bench_res *r, *b;
+    double change, limit;
+    int i, regs = 0;
+
+    printf("\n %-14s %6s %6s %18s %7s %10s %8s %7s\n", "bench", "pages",
+                "depth", "value", "spread", "baseline", "change", "limit");
+
+    for (i = 0; i < bench_nr_res; i++) {
+        r = &bench_res[i];
+        b = (base) ? bench_find(base, nr_base, r) : NULL;
+
+        printf(" %-14s %6d %6d %12.1f %-5s %6.1f%%", r->name, r->pages,
+                                    r->depth, r->value, r->unit, r->spread);
+        if (!b || b->value <= 0) {
+            printf("\n");
+            continue;
+        }
+
+        /* A drop within the noise of either run is not a regression */
+        change = (r->value - b->value) * 100 / b->value;
+        limit = BENCH_NOISE * (r->spread + b->spread);
+        if (limit < threshold)
+            limit = threshold;
+        printf(" %10.1f %+7.1f%% %6.1f%%", b->value, change, limit);
+        if (change < -limit) {
+            printf("  REGRESSION");
+            regs++;
+        }
+        printf("\n");
+    }
+
+    return regs;
+}
+
+int lnvm_bench(struct arguments *args)
+{
+    static const int sizes[] = BENCH_SIZES;
+    static const int depths[] = BENCH_DEPTHS;
+    static struct bench_res base[BENCH_MAX_RES];
+    struct nvm_dev_info info;
+    int nr_base = 0, regs, tgt_fd, i, j;
+    int reps = args->bench_reps;
+    int ret = 1;
+
+    printf("\n### LNVM BENCHMARK (%s backend) ###\n", nvm_be->name);
+
+    if (args->bench_base) {
+        nr_base = bench_load(args->bench_base, base);
+        if (nr_base < 0)
+            return 1;
+    }
+
+    if (get_dev_info(args->bench_tgt, &info)) {
+        printf("nvm_dev_info error. Failed to get device info.\n");
+        return 1;
+    }
+
+    tgt_fd = nvm_be->target_open(args->bench_tgt, 0x0);
+    if (tgt_fd < 0) {
+        printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
+                                                            args->bench_tgt);
+        return 1;
+    }
+    qos_bind(tgt_fd, args->bench_tgt);
+    cache_bind(tgt_fd, args->bench_tgt, &info);
+
+    bench_write_prepare(&info, reps);
+
+    if (bench_lnvm_io(args, tgt_fd, &info, reps))
+        goto close;
+
+    if (bench_getput(tgt_fd, reps))
+        goto close;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        for (j = 0; j < sizeof(depths) / sizeof(depths[0]); j++)
+            if (bench_rw(tgt_fd, &info, sizes[i], depths[j], reps))
+                goto close;
+
+    if (bench_evl(tgt_fd, &info, reps))
+        goto close;
+
+    regs = bench_report((nr_base) ? base : NULL, nr_base, args->bench_thresh);
+
+    if (args->bench_out && bench_save(args->bench_out))
+        goto close;
+
+    if (nr_base)
+        printf("\n %d regression(s) beyond the limits against %s.\n", regs,
+                                                        args->bench_base);
+    printf("\n");
+    ret = (regs) ? 2 : 0;
+
+close:
+    nvm_be->target_close(tgt_fd);
+    return ret;
+}
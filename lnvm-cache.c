@@ -0,0 +1,386 @@
+/*  User-space read cache of plane pages for lnvm-manager.
+
+    Pages are kept in a slab of sector-aligned frames allocated once at
+    init. The index is split in shards, each with its own lock, hash
+    chains and CLOCK hand, so concurrent readers of different pages rarely
+    contend. A frame gets its reference bit set on every hit; the CLOCK
+    hand clears the bit on its way and evicts the first frame it finds
+    without it.
+
+    Entries are keyed by target, block and page. A target fd is tied to
+    its target with cache_bind(), which also sets the cache up on first
+    use when LNVM_CACHE gives its size in MB. I/O on an fd that was not
+    bound bypasses the cache.
+
+    Every hash bucket has a generation that cache_inval() bumps. A reader
+    takes the generation of a page before reading it from the device and
+    hands it to cache_put(), which drops the page if it was invalidated
+    in the meantime, so a read racing with a write cannot cache old data.
+
+    The cache is process wide ('page_cache'). Written pages and put blocks
+    are invalidated.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+#define CACHE_NONE      UINT32_MAX
+
+struct nvm_cache *page_cache;
+
+static struct nvm_cache cache_env;
+static pthread_mutex_t cache_env_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_env_done;
+
+/* Bound targets, and the target of each fd (index + 1, 0 if unbound) */
+static char cache_tgts[CACHE_MAX_TGTS][DISK_NAME_LEN];
+static int cache_nr_tgts;
+static uint16_t cache_fd_tgt[CACHE_MAX_FDS];
+
+static uint64_t cache_hash(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static inline uint64_t cache_key(int tgt, uint32_t blk_id, int pg)
+{
+    return ((uint64_t) tgt << 48) | ((uint64_t) blk_id << 16) |
+                                                    (uint16_t) pg;
+}
+
+/* Target of an fd, or 0 if it goes around the cache */
+static int cache_tgt(int tgt_fd)
+{
+    if (tgt_fd < 0 || tgt_fd >= CACHE_MAX_FDS)
+        return 0;
+    return __atomic_load_n(&cache_fd_tgt[tgt_fd], __ATOMIC_RELAXED);
+}
+
+static inline struct nvm_cache_shard *cache_shard(struct nvm_cache *c,
+                                                    uint64_t h)
+{
+    return &c->shards[h & (c->nr_shards - 1)];
+}
+
+static inline uint32_t *cache_bucket(struct nvm_cache_shard *sh, uint64_t h)
+{
+    return &sh->buckets[(h >> 32) & (sh->nr_buckets - 1)];
+}
+
+static inline uint32_t *cache_bucket_gen(struct nvm_cache_shard *sh,
+                                                                uint64_t h)
+{
+    return &sh->gens[(h >> 32) & (sh->nr_buckets - 1)];
+}
+
+static uint32_t cache_find(struct nvm_cache_shard *sh, uint64_t h,
+                                                                uint64_t key)
+{
+    uint32_t f = *cache_bucket(sh, h);
+
+    while (f != CACHE_NONE && sh->frames[f].key != key)
+        f = sh->frames[f].next;
+
+    return f;
+}
+
+static void cache_unlink(struct nvm_cache_shard *sh, uint32_t f)
+{
+    struct nvm_cache_frame *fr = &sh->frames[f];
+    uint32_t *p = cache_bucket(sh, cache_hash(fr->key));
+
+    while (*p != f)
+        p = &sh->frames[*p].next;
+    *p = fr->next;
+
+    fr->valid = 0;
+    fr->ref = 0;
+}
+
+/* Advance the CLOCK hand to a free or unreferenced frame */
+static uint32_t cache_evict(struct nvm_cache_shard *sh)
+{
+    struct nvm_cache_frame *fr;
+    uint32_t f;
+
+    for (;;) {
+        f = sh->hand;
+        sh->hand = (sh->hand + 1) % sh->nr_frames;
+        fr = &sh->frames[f];
+
+        if (!fr->valid)
+            return f;
+        if (fr->ref) {
+            fr->ref = 0;
+            continue;
+        }
+        cache_unlink(sh, f);
+        sh->evictions++;
+        return f;
+    }
+}
+
+int cache_init(struct nvm_cache *c, size_t bytes, uint32_t pg_size,
+                                                        uint16_t pg_per_blk)
+{
+    struct nvm_cache_shard *sh;
+    uint32_t per_shard, i, j;
+    size_t nr_frames;
+
+    memset(c, 0, sizeof(*c));
+    c->pg_size = pg_size;
+    c->pg_per_blk = pg_per_blk;
+    c->nr_shards = CACHE_SHARDS;
+
+    nr_frames = bytes / pg_size;
+    per_shard = nr_frames / c->nr_shards;
+    if (!per_shard) {
+        fprintf(stderr, "Page cache of %lu bytes is too small.\n",
+                                                    (unsigned long) bytes);
+        return -1;
+    }
+
+    if (posix_memalign((void **)&c->slab, 4096,
+                        (size_t) per_shard * c->nr_shards * pg_size))
+        goto nomem;
+
+    c->shards = calloc(c->nr_shards, sizeof(struct nvm_cache_shard));
+    if (!c->shards)
+        goto nomem;
+
+    for (i = 0; i < c->nr_shards; i++) {
+        sh = &c->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->nr_frames = per_shard;
+        sh->data = c->slab + (size_t) i * per_shard * pg_size;
+
+        for (sh->nr_buckets = 1; sh->nr_buckets < per_shard;
+                                                        sh->nr_buckets <<= 1);
+        sh->buckets = malloc(sh->nr_buckets * sizeof(uint32_t));
+        sh->gens = calloc(sh->nr_buckets, sizeof(uint32_t));
+        sh->frames = calloc(per_shard, sizeof(struct nvm_cache_frame));
+        if (!sh->buckets || !sh->gens || !sh->frames)
+            goto nomem;
+        for (j = 0; j < sh->nr_buckets; j++)
+            sh->buckets[j] = CACHE_NONE;
+    }
+
+    return 0;
+
+nomem:
+    fprintf(stderr, "Could not allocate page cache memory.\n");
+    cache_free(c);
+    return -1;
+}
+
+void cache_free(struct nvm_cache *c)
+{
+    uint32_t i;
+
+    if (c->shards) {
+        for (i = 0; i < c->nr_shards; i++) {
+            free(c->shards[i].buckets);
+            free(c->shards[i].gens);
+            free(c->shards[i].frames);
+            pthread_mutex_destroy(&c->shards[i].lock);
+        }
+    }
+    free(c->shards);
+    free(c->slab);
+    c->shards = NULL;
+    c->slab = NULL;
+}
+
+/* Set up the cache from LNVM_CACHE (in MB), once per process */
+static void cache_env_init(struct nvm_dev_info *info)
+{
+    const char *size = getenv("LNVM_CACHE");
+    unsigned long mb;
+
+    cache_env_done = 1;
+    if (!size || !*size || page_cache)
+        return;
+
+    mb = strtoul(size, NULL, 10);
+    if (!mb) {
+        fprintf(stderr, "LNVM_CACHE: '%s' is not a size in MB.\n", size);
+        return;
+    }
+    if (cache_init(&cache_env, (size_t) mb << 20, info->pln_pg_size,
+                                                        info->pg_per_blk))
+        return;
+
+    __atomic_store_n(&page_cache, &cache_env, __ATOMIC_RELEASE);
+}
+
+/* Cache the pages read on tgt_fd as pages of tgt_name. The cache is set up
+ * on the first bind with device info; an fd of a target with another page
+ * geometry than the cache is left out of it. */
+void cache_bind(int tgt_fd, const char *tgt_name, struct nvm_dev_info *info)
+{
+    struct nvm_cache *c;
+    int i, tgt = 0;
+
+    if (tgt_fd < 0 || tgt_fd >= CACHE_MAX_FDS)
+        return;
+
+    pthread_mutex_lock(&cache_env_lock);
+    if (info && !cache_env_done)
+        cache_env_init(info);
+
+    c = page_cache;
+    if (c && (!info || (info->pln_pg_size == c->pg_size &&
+                                    info->pg_per_blk == c->pg_per_blk))) {
+        for (i = 0; i < cache_nr_tgts; i++)
+            if (strcmp(cache_tgts[i], tgt_name) == 0)
+                break;
+        if (i == cache_nr_tgts && i < CACHE_MAX_TGTS &&
+                                        strlen(tgt_name) < DISK_NAME_LEN) {
+            strcpy(cache_tgts[i], tgt_name);
+            cache_nr_tgts++;
+        }
+        if (i < cache_nr_tgts)
+            tgt = i + 1;
+    }
+    __atomic_store_n(&cache_fd_tgt[tgt_fd], tgt, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_env_lock);
+}
+
+/* A closed fd: the next target to get it does not use this one's pages */
+void cache_unbind(int tgt_fd)
+{
+    if (tgt_fd >= 0 && tgt_fd < CACHE_MAX_FDS)
+        __atomic_store_n(&cache_fd_tgt[tgt_fd], 0, __ATOMIC_RELAXED);
+}
+
+/* Copy a cached page to dst. Returns 1 on hit, 0 on miss. */
+int cache_get(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                                                char *dst)
+{
+    int tgt = cache_tgt(tgt_fd);
+    uint64_t key = cache_key(tgt, blk_id, pg);
+    uint64_t h = cache_hash(key);
+    struct nvm_cache_shard *sh = cache_shard(c, h);
+    uint32_t f;
+
+    if (!tgt)
+        return 0;
+
+    pthread_mutex_lock(&sh->lock);
+    f = cache_find(sh, h, key);
+    if (f == CACHE_NONE) {
+        sh->misses++;
+        pthread_mutex_unlock(&sh->lock);
+        return 0;
+    }
+    sh->frames[f].ref = 1;
+    sh->hits++;
+    memcpy(dst, sh->data + (size_t) f * c->pg_size, c->pg_size);
+    pthread_mutex_unlock(&sh->lock);
+
+    return 1;
+}
+
+/* Generation of a page, to take before reading it for cache_put() */
+uint32_t cache_gen(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg)
+{
+    uint64_t h = cache_hash(cache_key(cache_tgt(tgt_fd), blk_id, pg));
+    struct nvm_cache_shard *sh = cache_shard(c, h);
+    uint32_t gen;
+
+    pthread_mutex_lock(&sh->lock);
+    gen = *cache_bucket_gen(sh, h);
+    pthread_mutex_unlock(&sh->lock);
+
+    return gen;
+}
+
+/* Cache a page read from the device, unless it was invalidated since its
+ * generation was taken */
+void cache_put(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                            const char *src, uint32_t gen)
+{
+    int tgt = cache_tgt(tgt_fd);
+    uint64_t key = cache_key(tgt, blk_id, pg);
+    uint64_t h = cache_hash(key);
+    struct nvm_cache_shard *sh = cache_shard(c, h);
+    uint32_t *b;
+    uint32_t f;
+
+    if (!tgt)
+        return;
+
+    pthread_mutex_lock(&sh->lock);
+    if (*cache_bucket_gen(sh, h) != gen) {
+        pthread_mutex_unlock(&sh->lock);
+        return;
+    }
+    f = cache_find(sh, h, key);
+    if (f == CACHE_NONE) {
+        f = cache_evict(sh);
+        b = cache_bucket(sh, h);
+        sh->frames[f].key = key;
+        sh->frames[f].next = *b;
+        sh->frames[f].valid = 1;
+        *b = f;
+    }
+    memcpy(sh->data + (size_t) f * c->pg_size, src, c->pg_size);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_inval(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                                                int nr_pages)
+{
+    int tgt = cache_tgt(tgt_fd);
+    struct nvm_cache_shard *sh;
+    uint64_t key, h;
+    uint32_t f;
+    int i;
+
+    if (!tgt)
+        return;
+
+    for (i = pg; i < pg + nr_pages; i++) {
+        key = cache_key(tgt, blk_id, i);
+        h = cache_hash(key);
+        sh = cache_shard(c, h);
+
+        pthread_mutex_lock(&sh->lock);
+        (*cache_bucket_gen(sh, h))++;
+        f = cache_find(sh, h, key);
+        if (f != CACHE_NONE)
+            cache_unlink(sh, f);
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void cache_inval_blk(struct nvm_cache *c, int tgt_fd, uint32_t blk_id)
+{
+    cache_inval(c, tgt_fd, blk_id, 0, c->pg_per_blk);
+}
+
+void cache_stats(struct nvm_cache *c, uint64_t *hits, uint64_t *misses,
+                                                        uint64_t *evictions)
+{
+    uint32_t i;
+
+    *hits = *misses = *evictions = 0;
+    for (i = 0; i < c->nr_shards; i++) {
+        pthread_mutex_lock(&c->shards[i].lock);
+        *hits += c->shards[i].hits;
+        *misses += c->shards[i].misses;
+        *evictions += c->shards[i].evictions;
+        pthread_mutex_unlock(&c->shards[i].lock);
+    }
+}
@@ -0,0 +1,444 @@
+/*  Checkpoint and redo log of the append writer state.
+
+    A long-running 'append' holds in memory the blocks it owns: blocks
+    pre-allocated in its pool, the open block and its write pointer, and
+    the blocks it filled (with their record and byte counts). With
+    '-k FILE' this state survives the process.
+
+    Every change is appended to a redo log (FILE.log) as a 40-byte
+    record with a CRC32C, written with O_DSYNC before the change is
+    acknowledged. A page is logged once it is programmed: after a crash
+    in between, the resumed run finds the page after the last one logged
+    programmed and skips it, so a page is never programmed twice.
+
+    The state holds up to CKPT_MAX_BLKS blocks, the ones given back not
+    counting. A change that would need more is refused, not logged, and
+    the writer stops. Every CKPT_INTERVAL records, the whole state is
+    written to FILE, a memory-mapped file with two images used in turn: the image
+    not holding the last checkpoint is overwritten, carries the next
+    generation and a CRC, and is synced before the log is truncated. Log
+    records carry the generation they follow, so records that outlive
+    their checkpoint are ignored.
+
+    On restart, FILE is mapped, the valid image with the newest
+    generation is taken and the log is replayed up to the first torn
+    record. This reads at most one image and CKPT_INTERVAL records, not
+    the device, whatever its size.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <argp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+static size_t ckpt_size(void)
+{
+    return sizeof(struct nvm_ckpt_hdr) + 2 * sizeof(struct nvm_ckpt_img);
+}
+
+/* Bytes of an image in use: the table is only used up to nr_blks */
+static size_t ckpt_img_len(struct nvm_ckpt_img *img)
+{
+    return offsetof(struct nvm_ckpt_img, blks) +
+                                img->nr_blks * sizeof(struct nvm_ckpt_blk);
+}
+
+static uint32_t ckpt_img_crc(struct nvm_ckpt_img *img)
+{
+    uint32_t crc = img->crc, ret;
+
+    img->crc = 0;
+    ret = lnvm_crc32c(img, ckpt_img_len(img));
+    img->crc = crc;
+
+    return ret;
+}
+
+static uint32_t ckpt_rec_crc(struct nvm_ckpt_rec *rec)
+{
+    return lnvm_crc32c(rec, offsetof(struct nvm_ckpt_rec, crc));
+}
+
+static int ckpt_img_ok(struct nvm_ckpt_img *img)
+{
+    return img->gen && img->nr_blks <= CKPT_MAX_BLKS &&
+                (img->open == CKPT_NONE || img->open < img->nr_blks) &&
+                img->crc == ckpt_img_crc(img);
+}
+
+static struct nvm_ckpt_blk *ckpt_find(struct nvm_ckpt_img *img, uint64_t id)
+{
+    uint32_t i;
+
+    for (i = 0; i < img->nr_blks; i++)
+        if (img->blks[i].state != CKPT_FREE && img->blks[i].id == id)
+            return &img->blks[i];
+
+    return NULL;
+}
+
+/* Drop the blocks given back, keeping the open one */
+static void ckpt_compact(struct nvm_ckpt_img *img)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < img->nr_blks; i++) {
+        if (img->blks[i].state == CKPT_FREE)
+            continue;
+        if (i == img->open)
+            img->open = n;
+        img->blks[n++] = img->blks[i];
+    }
+    img->nr_blks = n;
+}
+
+/* Whether a record can be applied: a block it adds needs a free entry */
+static int ckpt_room(struct nvm_ckpt_img *img, struct nvm_ckpt_rec *rec)
+{
+    if (rec->op != CKPT_OP_POOL && rec->op != CKPT_OP_OPEN)
+        return 1;
+    if (img->nr_blks == CKPT_MAX_BLKS && !ckpt_find(img, rec->id))
+        ckpt_compact(img);
+
+    return img->nr_blks < CKPT_MAX_BLKS || ckpt_find(img, rec->id);
+}
+
+static struct nvm_ckpt_blk *ckpt_add(struct nvm_ckpt_img *img, uint64_t id,
+                                                                uint32_t lun)
+{
+    struct nvm_ckpt_blk *b;
+
+    if (img->nr_blks == CKPT_MAX_BLKS)
+        ckpt_compact(img);
+    if (img->nr_blks == CKPT_MAX_BLKS)
+        return NULL;
+
+    b = &img->blks[img->nr_blks++];
+    memset(b, 0, sizeof(*b));
+    b->id = id;
+    b->lun = lun;
+
+    return b;
+}
+
+/* Returns -1 when the table has no room for the block of the record */
+static int ckpt_apply(struct nvm_ckpt_img *img, struct nvm_ckpt_rec *rec)
+{
+    struct nvm_ckpt_blk *b = ckpt_find(img, rec->id);
+
+    switch (rec->op) {
+        case CKPT_OP_POOL:
+            if (!b)
+                b = ckpt_add(img, rec->id, rec->lun);
+            if (!b)
+                return -1;
+            b->state = CKPT_POOLED;
+            break;
+        case CKPT_OP_OPEN:
+            if (!b)
+                b = ckpt_add(img, rec->id, rec->lun);
+            if (!b)
+                return -1;
+            if (img->open != CKPT_NONE && &img->blks[img->open] != b)
+                img->blks[img->open].state = CKPT_FULL;
+            b->state = CKPT_OPEN;
+            b->next_pg = rec->pg;
+            img->open = b - img->blks;
+            break;
+        case CKPT_OP_PROG:
+            if (!b)
+                break;
+            b->next_pg = rec->pg + 1;
+            b->nr_recs += rec->nr_recs;
+            b->host_bytes += rec->bytes;
+            break;
+        case CKPT_OP_PUT:
+            if (!b)
+                break;
+            if (img->open == b - img->blks)
+                img->open = CKPT_NONE;
+            b->state = CKPT_FREE;
+            break;
+    }
+
+    return 0;
+}
+
+/* Apply the log records that follow the checkpoint */
+static void ckpt_replay(struct nvm_ckpt *ck)
+{
+    struct nvm_ckpt_rec rec;
+
+    ck->replayed = 0;
+    while (read(ck->log_fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        /* Torn by a crash: nothing valid follows */
+        if (rec.crc != ckpt_rec_crc(&rec))
+            break;
+        if (rec.gen != ck->cur->gen)
+            continue;
+        /* Only records that applied were logged */
+        if (ckpt_apply(ck->cur, &rec)) {
+            fprintf(stderr, "Checkpoint log record of block %lu does not "
+                                "apply.\n", (unsigned long) rec.id);
+            break;
+        }
+        ck->replayed++;
+    }
+}
+
+int ckpt_open(struct nvm_ckpt *ck, const char *path, struct nvm_dev_info *info)
+{
+    char log[PATH_MAX];
+    struct nvm_ckpt_hdr *hdr;
+    struct stat sb;
+    void *map;
+
+    memset(ck, 0, sizeof(*ck));
+    ck->log_fd = -1;
+
+    if (snprintf(log, sizeof(log), "%s.log", path) >= sizeof(log)) {
+        fprintf(stderr, "Checkpoint path too long.\n");
+        return -1;
+    }
+
+    ck->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ck->fd < 0) {
+        fprintf(stderr, "Could not open checkpoint %s.\n", path);
+        return -1;
+    }
+
+    if (fstat(ck->fd, &sb))
+        goto err;
+    if (sb.st_size == 0 && ftruncate(ck->fd, ckpt_size())) {
+        fprintf(stderr, "Could not initialize checkpoint %s.\n", path);
+        goto err;
+    }
+    if (sb.st_size != 0 && sb.st_size != ckpt_size()) {
+        fprintf(stderr, "%s is not a checkpoint.\n", path);
+        goto err;
+    }
+
+    map = mmap(NULL, ckpt_size(), PROT_READ | PROT_WRITE, MAP_SHARED, ck->fd,
+                                                                        0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map checkpoint %s.\n", path);
+        goto err;
+    }
+    hdr = map;
+    ck->img = (struct nvm_ckpt_img *)(hdr + 1);
+
+    if (sb.st_size == 0) {
+        hdr->magic = CKPT_MAGIC;
+        hdr->pln_pg_size = info->pln_pg_size;
+        hdr->pg_per_blk = info->pg_per_blk;
+        hdr->max_blks = CKPT_MAX_BLKS;
+        /* Before anything is logged against it */
+        if (msync(map, sizeof(*hdr), MS_SYNC)) {
+            fprintf(stderr, "Could not initialize checkpoint %s.\n", path);
+            goto err_unmap;
+        }
+    } else if (hdr->magic != CKPT_MAGIC || hdr->max_blks != CKPT_MAX_BLKS) {
+        fprintf(stderr, "%s is not a checkpoint.\n", path);
+        goto err_unmap;
+    } else if (hdr->pln_pg_size != info->pln_pg_size ||
+                                    hdr->pg_per_blk != info->pg_per_blk) {
+        fprintf(stderr, "Checkpoint %s geometry mismatch (page size %u, "
+                "pages per block %u).\n", path, hdr->pln_pg_size,
+                                                            hdr->pg_per_blk);
+        goto err_unmap;
+    }
+
+    ck->cur = malloc(sizeof(*ck->cur));
+    if (!ck->cur) {
+        fprintf(stderr, "Could not allocate checkpoint memory.\n");
+        goto err_unmap;
+    }
+
+    /* Newest valid image, or an empty state */
+    memset(ck->cur, 0, offsetof(struct nvm_ckpt_img, blks));
+    ck->cur->open = CKPT_NONE;
+    if (ckpt_img_ok(&ck->img[0]))
+        memcpy(ck->cur, &ck->img[0], ckpt_img_len(&ck->img[0]));
+    if (ckpt_img_ok(&ck->img[1]) && ck->img[1].gen > ck->cur->gen)
+        memcpy(ck->cur, &ck->img[1], ckpt_img_len(&ck->img[1]));
+
+    ck->log_fd = open(log, O_RDWR | O_CREAT | O_APPEND | O_DSYNC, 0644);
+    if (ck->log_fd < 0) {
+        fprintf(stderr, "Could not open checkpoint log %s.\n", log);
+        goto err_free;
+    }
+    ckpt_replay(ck);
+
+    pthread_mutex_init(&ck->lock, NULL);
+
+    /* Start from a checkpoint of the recovered state */
+    if (ckpt_save(ck))
+        goto err_log;
+
+    return 0;
+
+err_log:
+    pthread_mutex_destroy(&ck->lock);
+    close(ck->log_fd);
+err_free:
+    free(ck->cur);
+err_unmap:
+    munmap(map, ckpt_size());
+err:
+    close(ck->fd);
+    ck->fd = -1;
+    ck->log_fd = -1;
+    ck->img = NULL;
+    ck->cur = NULL;
+    return -1;
+}
+
+static int ckpt_save_locked(struct nvm_ckpt *ck)
+{
+    struct nvm_ckpt_img *img;
+    long pgsz = sysconf(_SC_PAGESIZE);
+    uintptr_t start, end;
+
+    ckpt_compact(ck->cur);
+    ck->cur->gen++;
+    ck->cur->crc = ckpt_img_crc(ck->cur);
+
+    /* Never over the image holding the last checkpoint */
+    img = &ck->img[ck->cur->gen % 2];
+    memcpy(img, ck->cur, ckpt_img_len(ck->cur));
+
+    start = (uintptr_t) img & ~(uintptr_t)(pgsz - 1);
+    end = (uintptr_t) img + ckpt_img_len(ck->cur);
+    if (msync((void *) start, end - start, MS_SYNC)) {
+        fprintf(stderr, "Could not write checkpoint.\n");
+        return -1;
+    }
+
+    /* The records before the new generation are no longer needed */
+    if (ftruncate(ck->log_fd, 0)) {
+        fprintf(stderr, "Could not truncate checkpoint log.\n");
+        return -1;
+    }
+    ck->nr_log = 0;
+
+    return 0;
+}
+
+int ckpt_save(struct nvm_ckpt *ck)
+{
+    int ret;
+
+    pthread_mutex_lock(&ck->lock);
+    ret = ckpt_save_locked(ck);
+    pthread_mutex_unlock(&ck->lock);
+
+    return ret;
+}
+
+/* Record a change of the state, checkpointing every CKPT_INTERVAL */
+int ckpt_log(struct nvm_ckpt *ck, int op, uint64_t id, uint32_t lun, int pg,
+                                            uint32_t nr_recs, uint32_t bytes)
+{
+    struct nvm_ckpt_rec rec;
+    int ret = 0;
+
+    if (!ck)
+        return 0;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.id = id;
+    rec.lun = lun;
+    rec.op = op;
+    rec.pg = pg;
+    rec.nr_recs = nr_recs;
+    rec.bytes = bytes;
+
+    pthread_mutex_lock(&ck->lock);
+    if (!ckpt_room(ck->cur, &rec)) {
+        fprintf(stderr, "Checkpoint full: %d blocks held, block %lu not "
+                "recorded.\n", CKPT_MAX_BLKS, (unsigned long) id);
+        ret = -1;
+        goto out;
+    }
+
+    rec.gen = ck->cur->gen;
+    rec.crc = ckpt_rec_crc(&rec);
+
+    if (write(ck->log_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        fprintf(stderr, "Could not write checkpoint log.\n");
+        ret = -1;
+        goto out;
+    }
+    ckpt_apply(ck->cur, &rec);
+
+    if (++ck->nr_log >= CKPT_INTERVAL)
+        ret = ckpt_save_locked(ck);
+
+out:
+    pthread_mutex_unlock(&ck->lock);
+    return ret;
+}
+
+/* Open block of the recovered state, -1 if there is none */
+int ckpt_resume(struct nvm_ckpt *ck, struct nvm_ckpt_blk *open)
+{
+    if (ck->cur->open == CKPT_NONE)
+        return -1;
+
+    *open = ck->cur->blks[ck->cur->open];
+    return 0;
+}
+
+/* Give back the blocks a previous run left in its pool. Returns how many
+ * were found. */
+int ckpt_release(struct nvm_ckpt *ck, int tgt_fd)
+{
+    NVM_VBLOCK vblk;
+    uint32_t i;
+    int nr = 0;
+
+    /* Logging may compact the table: look again from the start */
+    for (i = 0; i < ck->cur->nr_blks; i++) {
+        if (ck->cur->blks[i].state != CKPT_POOLED)
+            continue;
+
+        memset(&vblk, 0, sizeof(vblk));
+        vblk.id = ck->cur->blks[i].id;
+        vblk.vlun_id = ck->cur->blks[i].lun;
+        if (nvm_be->put_block(tgt_fd, &vblk))
+            fprintf(stderr, "nvm_put_block error. Could not put block %llu "
+                    "to LUN %u.\n", (unsigned long long) vblk.id, vblk.vlun_id);
+        if (ckpt_log(ck, CKPT_OP_PUT, vblk.id, vblk.vlun_id, 0, 0, 0))
+            break;
+        nr++;
+        i = -1;
+    }
+
+    return nr;
+}
+
+void ckpt_close(struct nvm_ckpt *ck)
+{
+    if (!ck->cur)
+        return;
+
+    ckpt_save(ck);
+    pthread_mutex_destroy(&ck->lock);
+    close(ck->log_fd);
+    munmap((struct nvm_ckpt_hdr *) ck->img - 1, ckpt_size());
+    close(ck->fd);
+    free(ck->cur);
+    ck->cur = NULL;
+    ck->img = NULL;
+    ck->fd = ck->log_fd = -1;
+}
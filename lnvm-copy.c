@@ -0,0 +1,273 @@
+/*  Block copy/migration for lnvm-manager.
+
+    Copies a page range (or a whole block) from one (LUN, block) to
+    another without going through a file. Each copy job keeps a ring of
+    COPY_DEPTH page buffers: the reads of the next pages are in flight
+    while the current page is programmed, and a buffer is refilled with
+    the read of page N + COPY_DEPTH as soon as page N is written. Pages
+    are programmed in order, one at a time, as the block requires.
+
+    All I/O goes through the per-LUN scheduler, with the queue depth
+    tuned for the device. Jobs run in parallel on as many threads as LUNs
+    the device is tuned to drive at once (all of them by default).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct copy_job {
+    struct nvm_copy *cp;
+    struct nvm_sched *s;
+    struct nvm_dev_info *info;
+    struct nvm_csum *cs;
+    int ret;
+    uint64_t bytes;
+};
+
+struct copy_run {
+    struct copy_job *jobs;
+    int nr_jobs;
+    int next;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void copy_read(struct copy_job *job, struct nvm_sched_req *rq,
+                                                        char *buf, int pg)
+{
+    memset(rq, 0, sizeof(*rq));
+    rq->lun = job->cp->src_lun;
+    rq->dir = READ;
+    rq->buf = buf;
+    rq->blk_id = job->cp->src_blk;
+    rq->pg = pg;
+    rq->nr_pages = 1;
+    if (sched_submit(job->s, rq)) {
+        rq->ret = -1;
+        rq->done = 1;
+    }
+}
+
+static void *copy_worker(void *arg)
+{
+    struct copy_job *job = arg;
+    struct nvm_copy *cp = job->cp;
+    struct nvm_dev_info *info = job->info;
+    struct nvm_sched_req rq[COPY_DEPTH];
+    char *bufs = NULL, *buf;
+    int depth = (cp->nr_pages < COPY_DEPTH) ? cp->nr_pages : COPY_DEPTH;
+    int i, slot, issued = 0;
+
+    job->ret = -1;
+
+    if (posix_memalign((void **)&bufs, info->sec_size,
+                                    (size_t) depth * info->pln_pg_size)) {
+        printf("Could not allocate copy memory (%d,%d)\n", info->sec_size,
+                                                        info->pln_pg_size);
+        return NULL;
+    }
+
+    for (; issued < depth; issued++)
+        copy_read(job, &rq[issued], bufs + (size_t) issued *
+                                    info->pln_pg_size, cp->start_pg + issued);
+
+    for (i = 0; i < cp->nr_pages; i++) {
+        slot = i % depth;
+        buf = bufs + (size_t) slot * info->pln_pg_size;
+
+        if (sched_wait(job->s, &rq[slot])) {
+            printf("  Could not read page %d of block %u (LUN %u).\n",
+                                cp->start_pg + i, cp->src_blk, cp->src_lun);
+            goto drain;
+        }
+
+        if (job->cs && csum_verify(job->cs, cp->src_blk, cp->start_pg + i,
+                                                                1, buf)) {
+            printf("  Page %d of block %u failed checksum verification, "
+                    "copy stopped.\n", cp->start_pg + i, cp->src_blk);
+            goto drain;
+        }
+
+        if (sched_io(job->s, cp->dst_lun, WRITE, buf, cp->dst_blk,
+                                                    cp->start_pg + i, 1)) {
+            printf("  Could not write page %d of block %u (LUN %u).\n",
+                                cp->start_pg + i, cp->dst_blk, cp->dst_lun);
+            goto drain;
+        }
+
+        stats_add(job->s->tgt_fd, STATS_COPY, info->pln_pg_size);
+        if (page_cache)
+            cache_inval(page_cache, job->s->tgt_fd, cp->dst_blk,
+                                                        cp->start_pg + i, 1);
+        if (job->cs && csum_store(job->cs, cp->dst_blk, cp->start_pg + i,
+                                                                    1, buf))
+            goto drain;
+
+        job->bytes += info->pln_pg_size;
+
+        if (issued < cp->nr_pages) {
+            copy_read(job, &rq[slot], buf, cp->start_pg + issued);
+            issued++;
+        }
+    }
+    job->ret = 0;
+
+drain:
+    /* Reads still in flight use the buffers */
+    for (i = (job->ret) ? i + 1 : cp->nr_pages; i < issued; i++)
+        sched_wait(job->s, &rq[i % depth]);
+    free(bufs);
+
+    return NULL;
+}
+
+static void *copy_thread(void *arg)
+{
+    struct copy_run *run = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) <
+                                                                run->nr_jobs)
+        copy_worker(&run->jobs[i]);
+
+    return NULL;
+}
+
+void lnvm_copy(struct arguments *args)
+{
+    struct nvm_dev_info info;
+    struct nvm_csum cs = { .fd = -1 };
+    struct copy_job *jobs;
+    struct copy_run run;
+    struct nvm_sched s;
+    pthread_t threads[COPY_MAX_JOBS];
+    uint32_t nr_luns = 0;
+    uint64_t total = 0;
+    int tgt_fd, i, j, nr_threads, failed = 0;
+    double start, t;
+
+    printf("\n### LNVM BLOCK COPY ###\n");
+
+    if (get_dev_info(args->cp_tgt, &info)) {
+        printf("nvm_dev_info error. Failed to get device info.\n");
+        return;
+    }
+
+    for (i = 0; i < args->cp_nr; i++) {
+        struct nvm_copy *cp = &args->cp[i];
+
+        cp->start_pg = args->cp_pgstart;
+        cp->nr_pages = (args->cp_flag & IOARGP) ? args->cp_nrpages :
+                                        info.pg_per_blk - args->cp_pgstart;
+        if (cp->nr_pages < 1 || cp->start_pg + cp->nr_pages > info.pg_per_blk) {
+            printf(" IO out of bounds (last page in the block: %d)\n",
+                                                        info.pg_per_blk - 1);
+            return;
+        }
+        if (cp->src_lun >= info.nr_luns || cp->dst_lun >= info.nr_luns) {
+            printf(" LUN out of bounds (last LUN of the device: %u)\n",
+                                                            info.nr_luns - 1);
+            return;
+        }
+        /* Two jobs would program the same pages of the block, or one
+         * would program a block being read */
+        for (j = 0; j < args->cp_nr; j++) {
+            if (j < i && args->cp[j].dst_blk == cp->dst_blk) {
+                printf(" Block %u is the destination of two copies.\n",
+                                                                cp->dst_blk);
+                return;
+            }
+            if (args->cp[j].src_blk == cp->dst_blk) {
+                printf(" Block %u is both a source and a destination.\n",
+                                                                cp->dst_blk);
+                return;
+            }
+        }
+        if (cp->src_lun >= nr_luns)
+            nr_luns = cp->src_lun + 1;
+        if (cp->dst_lun >= nr_luns)
+            nr_luns = cp->dst_lun + 1;
+    }
+
+    tgt_fd = nvm_be->target_open(args->cp_tgt, 0x0);
+    if (tgt_fd < 0) {
+        printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
+                                                                args->cp_tgt);
+        return;
+    }
+    qos_bind(tgt_fd, args->cp_tgt);
+    cache_bind(tgt_fd, args->cp_tgt, &info);
+
+    if ((args->cp_flag & IOARGC) && csum_open(&cs, args->cp_csum, &info))
+        goto close;
+
+    jobs = calloc(args->cp_nr, sizeof(struct copy_job));
+    if (!jobs)
+        goto close;
+
+    if (sched_init(&s, tgt_fd, &info, nr_luns, info.io_depth, SCHED_WR_MAX))
+        goto free_jobs;
+
+    for (i = 0; i < args->cp_nr; i++) {
+        jobs[i].cp = &args->cp[i];
+        jobs[i].s = &s;
+        jobs[i].info = &info;
+        jobs[i].cs = (cs.fd >= 0) ? &cs : NULL;
+    }
+    run.jobs = jobs;
+    run.nr_jobs = args->cp_nr;
+    run.next = 0;
+
+    start = now_sec();
+    /* The caller is one of the threads */
+    nr_threads = ((args->cp_nr < info.io_luns) ? args->cp_nr : info.io_luns)
+                                                                        - 1;
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, copy_thread, &run))
+            break;
+    nr_threads = i;
+    copy_thread(&run);
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < args->cp_nr; i++) {
+        struct nvm_copy *cp = &args->cp[i];
+
+        total += jobs[i].bytes;
+        if (jobs[i].ret)
+            failed++;
+        if (jobs[i].ret || (args->cp_flag & IOARGV))
+            printf(" LUN %u block %u -> LUN %u block %u, pages %d:%d: %s\n",
+                    cp->src_lun, cp->src_blk, cp->dst_lun, cp->dst_blk,
+                    cp->start_pg, cp->start_pg + cp->nr_pages - 1,
+                    (jobs[i].ret) ? "FAILED" : "done");
+    }
+    t = now_sec() - start;
+
+    sched_free(&s);
+
+    printf("\n %d of %d copies performed succesfully.\n", args->cp_nr - failed,
+                                                                args->cp_nr);
+    printf(" Total copied: %lu bytes in %.3f s (%.1f MB/s)\n",
+            (unsigned long) total, t, (t > 0) ? total / t / 1048576 : 0);
+    printf("\n");
+
+free_jobs:
+    free(jobs);
+close:
+    csum_close(&cs);
+    nvm_be->target_close(tgt_fd);
+}
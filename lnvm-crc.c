@@ -0,0 +1,329 @@
+/*  End-to-end page integrity for lnvm-manager.
+
+    A CRC32C is computed for every plane page on write and checked on
+    read. The dflash target only exposes the data area through
+    pread/pwrite, so the checksums are kept in a side table (a sparse
+    file indexed by block and page) instead of the OOB area.
+
+    CRC32C uses the SSE4.2 'crc32' instruction on x86-64 and the ARMv8
+    CRC extension on aarch64 when available, and a slicing-by-8 table
+    otherwise.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <argp.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY     0x82F63B78
+
+static uint32_t crc_table[8][256];
+static uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t w;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^
+              crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^
+              crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^
+              crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^
+              crc_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    uint64_t w;
+
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+
+    return (uint32_t) c;
+}
+
+static int crc32c_hw_ok(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t w;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static int crc32c_hw_ok(void)
+{
+    return 1;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = crc_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+            crc_table[j][i] = crc;
+        }
+    }
+
+    crc_fn = crc32c_sw;
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    if (crc32c_hw_ok())
+        crc_fn = crc32c_hw;
+#endif
+}
+
+uint32_t lnvm_crc32c(const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc32c_init);
+
+    return ~crc_fn(~0U, buf, len);
+}
+
+static off_t csum_offset(struct nvm_csum *cs, uint32_t blk_id, int pg)
+{
+    return sizeof(struct nvm_csum_hdr) + ((off_t) blk_id * cs->pg_per_blk
+                                    + pg) * sizeof(struct nvm_csum_ent);
+}
+
+int csum_open(struct nvm_csum *cs, const char *path, struct nvm_dev_info *info)
+{
+    struct nvm_csum_hdr hdr;
+    ssize_t ret;
+
+    cs->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cs->fd < 0) {
+        fprintf(stderr, "Could not open checksum table %s.\n", path);
+        return -1;
+    }
+
+    cs->pln_pg_size = info->pln_pg_size;
+    cs->pg_per_blk = info->pg_per_blk;
+
+    ret = pread(cs->fd, &hdr, sizeof(hdr), 0);
+    if (ret == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = CSUM_MAGIC;
+        hdr.pln_pg_size = cs->pln_pg_size;
+        hdr.pg_per_blk = cs->pg_per_blk;
+        if (pwrite(cs->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            fprintf(stderr, "Could not initialize checksum table %s.\n",
+                                                                    path);
+            goto err;
+        }
+        return 0;
+    }
+
+    if (ret != sizeof(hdr) || hdr.magic != CSUM_MAGIC) {
+        fprintf(stderr, "%s is not a checksum table.\n", path);
+        goto err;
+    }
+
+    if (hdr.pln_pg_size != cs->pln_pg_size ||
+                                        hdr.pg_per_blk != cs->pg_per_blk) {
+        fprintf(stderr, "Checksum table %s geometry mismatch (page size %u, "
+                "pages per block %u).\n", path, hdr.pln_pg_size,
+                                                            hdr.pg_per_blk);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    close(cs->fd);
+    cs->fd = -1;
+    return -1;
+}
+
+void csum_close(struct nvm_csum *cs)
+{
+    if (cs->fd >= 0)
+        close(cs->fd);
+    cs->fd = -1;
+}
+
+/* Number of blocks covered by the table, written or not */
+uint32_t csum_nr_blocks(struct nvm_csum *cs)
+{
+    off_t end = lseek(cs->fd, 0, SEEK_END);
+
+    if (end <= (off_t) sizeof(struct nvm_csum_hdr))
+        return 0;
+
+    end -= sizeof(struct nvm_csum_hdr);
+    return (end + cs->pg_per_blk * sizeof(struct nvm_csum_ent) - 1) /
+                            (cs->pg_per_blk * sizeof(struct nvm_csum_ent));
+}
+
+/* Load the entries of every page of a block, returns 1 if any is valid */
+int csum_load(struct nvm_csum *cs, uint32_t blk_id, struct nvm_csum_ent *ent)
+{
+    size_t len = cs->pg_per_blk * sizeof(struct nvm_csum_ent);
+    int i;
+
+    memset(ent, 0, len);
+    if (pread(cs->fd, ent, len, csum_offset(cs, blk_id, 0)) < 0)
+        return -1;
+
+    for (i = 0; i < cs->pg_per_blk; i++)
+        if (ent[i].flags & CSUM_VALID)
+            return 1;
+
+    return 0;
+}
+
+int csum_store(struct nvm_csum *cs, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_csum_ent ent[CSUM_BATCH];
+    size_t len;
+    int i, j, n;
+
+    for (i = 0; i < nr_pages; i += n) {
+        n = (nr_pages - i < CSUM_BATCH) ? nr_pages - i : CSUM_BATCH;
+        len = n * sizeof(struct nvm_csum_ent);
+
+        /* Keep the error history of pages being rewritten */
+        memset(ent, 0, len);
+        if (pread(cs->fd, ent, len, csum_offset(cs, blk_id, start_pg + i))
+                                                                        < 0)
+            return -1;
+
+        for (j = 0; j < n; j++) {
+            ent[j].crc = lnvm_crc32c(buf + (size_t)(i + j) * cs->pln_pg_size,
+                                                            cs->pln_pg_size);
+            ent[j].flags = CSUM_VALID;
+        }
+
+        if (pwrite(cs->fd, ent, len, csum_offset(cs, blk_id, start_pg + i))
+                                                                != len) {
+            fprintf(stderr, "Could not update checksum table.\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int csum_verify(struct nvm_csum *cs, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_csum_ent ent[CSUM_BATCH];
+    uint32_t crc;
+    ssize_t ret;
+    size_t len;
+    int bad = 0;
+    int dirty;
+    int i, j, n;
+
+    for (i = 0; i < nr_pages; i += n) {
+        n = (nr_pages - i < CSUM_BATCH) ? nr_pages - i : CSUM_BATCH;
+        len = n * sizeof(struct nvm_csum_ent);
+
+        memset(ent, 0, len);
+        ret = pread(cs->fd, ent, len, csum_offset(cs, blk_id, start_pg + i));
+        if (ret < 0)
+            return -1;
+
+        dirty = 0;
+        for (j = 0; j < n; j++) {
+            if (!(ent[j].flags & CSUM_VALID))
+                continue;
+
+            crc = lnvm_crc32c(buf + (size_t)(i + j) * cs->pln_pg_size,
+                                                            cs->pln_pg_size);
+            if (crc == ent[j].crc)
+                continue;
+
+            printf("  Checksum mismatch in block %u page %d (stored %#010x, "
+                    "computed %#010x)\n", blk_id, start_pg + i + j,
+                                                            ent[j].crc, crc);
+            if (ent[j].errs < UINT16_MAX)
+                ent[j].errs++;
+            dirty = 1;
+            bad++;
+        }
+
+        if (dirty && pwrite(cs->fd, ent, ret, csum_offset(cs, blk_id,
+                                                    start_pg + i)) != ret)
+            fprintf(stderr, "Could not update checksum table.\n");
+    }
+
+    return bad;
+}
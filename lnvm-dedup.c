@@ -0,0 +1,640 @@
+/*  Page deduplication for lnvm-manager ('write -d', 'read -d').
+
+    Every plane page written is fingerprinted with a 64-bit hash. A page
+    whose content is already on the device is not programmed again: its
+    entry in the page map points to the plane page holding the copy.
+    Other pages are appended to the block, after the plane pages already
+    programmed, so a block is always programmed in order and without
+    holes. Logical pages of a block are therefore not in place: a block
+    written with -d is only read with -d, and is full once its plane
+    pages are used, like with -z.
+
+    The dedup file holds both structures:
+
+        header
+        fingerprint index   DD_SLOTS slots (fingerprint, block, page),
+                            open addressing, mapped shared
+        block records       per block: next plane page to program and
+                            puts of the block (stats_blk_puts()), the
+                            page map (fingerprint and the plane page
+                            holding the data of each logical page) and
+                            the number of page maps pointing to each of
+                            its plane pages
+
+    The index is a cache: when the DD_PROBE slots of a fingerprint are
+    taken, the last one is reused, which only costs a missed duplicate.
+    A fingerprint match is confirmed by comparing the page with the copy
+    on the device before the page is dropped, so hash collisions cannot
+    lose data.
+
+    Only copies some page map points to are deduplicated against.
+    'putblock -d' keeps a block whose plane pages are still referenced
+    from other blocks. A block put without -d starts over the next time
+    it is used with -d: its references are dropped, and the pages of
+    other blocks that pointed to it read back with a fingerprint that
+    does not match and are reported. Without the put counts (<target>.puts
+    cannot be opened) such a put would go unseen, so -d I/O is refused.
+
+    The hash runs four independent 64-bit lanes over 32-byte stripes, so
+    the multiplies overlap and the compiler can vectorize the loop.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <argp.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+/* In-memory record of a block */
+struct dd_rec {
+    uint32_t blk_id;
+    struct nvm_dd_blk b;
+    struct nvm_dd_ent *ent;
+    uint32_t *refs;             /* page maps pointing to each plane page */
+};
+
+/* A reference on a plane page of another block, applied once the pages
+ * of a write are programmed */
+struct dd_ref {
+    uint32_t blk;
+    uint32_t puts;
+    uint16_t pg;
+    int16_t delta;
+};
+
+#define DD_P1   0x9E3779B185EBCA87ULL
+#define DD_P2   0xC2B2AE3D27D4EB4FULL
+#define DD_P3   0x165667B19E3779F9ULL
+
+static inline uint64_t dd_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t dd_round(uint64_t acc, uint64_t in)
+{
+    return dd_rotl(acc + in * DD_P2, 31) * DD_P1;
+}
+
+/* 64-bit page fingerprint. len is a multiple of 32 (plane pages are) */
+uint64_t dd_hash(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t v[4] = { DD_P1 + DD_P2, DD_P2, 0, -DD_P1 };
+    uint64_t w[4], h;
+    size_t i;
+    int l;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        memcpy(w, p + i, 32);
+        for (l = 0; l < 4; l++)
+            v[l] = dd_round(v[l], w[l]);
+    }
+
+    h = dd_rotl(v[0], 1) + dd_rotl(v[1], 7) + dd_rotl(v[2], 12) +
+                                                        dd_rotl(v[3], 18);
+    for (l = 0; l < 4; l++)
+        h = (h ^ dd_round(0, v[l])) * DD_P1 + DD_P3;
+    h += len;
+
+    h ^= h >> 33;
+    h *= DD_P2;
+    h ^= h >> 29;
+    h *= DD_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static size_t dd_index_size(uint32_t nr_slots)
+{
+    return sizeof(struct nvm_dd_hdr) +
+                                (size_t) nr_slots * sizeof(struct nvm_dd_slot);
+}
+
+/* Record of a block: header, page map, then the references to each of its
+ * plane pages */
+static size_t dd_rec_size(struct nvm_dd *dd)
+{
+    return sizeof(struct nvm_dd_blk) + dd->info->pg_per_blk *
+                            (sizeof(struct nvm_dd_ent) + sizeof(uint32_t));
+}
+
+static off_t dd_offset(struct nvm_dd *dd, uint32_t blk_id)
+{
+    return dd_index_size(dd->nr_slots) + (off_t) blk_id * dd_rec_size(dd);
+}
+
+static off_t dd_refs_offset(struct nvm_dd *dd, uint32_t blk_id, int pg)
+{
+    return dd_offset(dd, blk_id) + sizeof(struct nvm_dd_blk) +
+                    dd->info->pg_per_blk * sizeof(struct nvm_dd_ent) +
+                    pg * sizeof(uint32_t);
+}
+
+int dd_open(struct nvm_dd *dd, const char *path, struct nvm_dev_info *info)
+{
+    struct nvm_dd_hdr hdr;
+    struct stat sb;
+    ssize_t ret;
+    void *map;
+
+    dd->info = info;
+    dd->slots = NULL;
+    dd->nr_slots = DD_SLOTS;
+
+    dd->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (dd->fd < 0) {
+        printf("Could not open dedup file %s.\n", path);
+        return -1;
+    }
+
+    ret = pread(dd->fd, &hdr, sizeof(hdr), 0);
+    if (ret == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = DD_MAGIC;
+        hdr.pln_pg_size = info->pln_pg_size;
+        hdr.pg_per_blk = info->pg_per_blk;
+        hdr.nr_slots = DD_SLOTS;
+        /* The index is sparse until slots are used */
+        if (pwrite(dd->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+                        ftruncate(dd->fd, dd_index_size(hdr.nr_slots))) {
+            printf("Could not initialize dedup file %s.\n", path);
+            goto err;
+        }
+    } else if (ret != sizeof(hdr) || hdr.magic != DD_MAGIC) {
+        printf("%s is not a dedup file.\n", path);
+        goto err;
+    } else if (hdr.pln_pg_size != info->pln_pg_size ||
+                                    hdr.pg_per_blk != info->pg_per_blk) {
+        printf("Dedup file %s geometry mismatch (page size %u, pages per "
+                "block %u).\n", path, hdr.pln_pg_size, hdr.pg_per_blk);
+        goto err;
+    }
+
+    dd->nr_slots = hdr.nr_slots;
+    if (fstat(dd->fd, &sb) || sb.st_size < dd_index_size(dd->nr_slots)) {
+        printf("Dedup file %s is truncated.\n", path);
+        goto err;
+    }
+
+    map = mmap(NULL, dd_index_size(dd->nr_slots), PROT_READ | PROT_WRITE,
+                                                    MAP_SHARED, dd->fd, 0);
+    if (map == MAP_FAILED) {
+        printf("Could not map dedup file %s.\n", path);
+        goto err;
+    }
+    dd->slots = (struct nvm_dd_slot *)((char *) map +
+                                                sizeof(struct nvm_dd_hdr));
+
+    return 0;
+
+err:
+    close(dd->fd);
+    dd->fd = -1;
+    return -1;
+}
+
+void dd_close(struct nvm_dd *dd)
+{
+    if (dd->slots)
+        munmap((char *) dd->slots - sizeof(struct nvm_dd_hdr),
+                                            dd_index_size(dd->nr_slots));
+    if (dd->fd >= 0)
+        close(dd->fd);
+    dd->slots = NULL;
+    dd->fd = -1;
+}
+
+static int dd_rec_alloc(struct nvm_dd *dd, struct dd_rec *r)
+{
+    r->ent = malloc(dd->info->pg_per_blk * sizeof(*r->ent));
+    r->refs = malloc(dd->info->pg_per_blk * sizeof(*r->refs));
+    if (!r->ent || !r->refs) {
+        printf("Could not allocate dedup memory.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void dd_rec_free(struct dd_rec *r)
+{
+    free(r->ent);
+    free(r->refs);
+}
+
+static int dd_store(struct nvm_dd *dd, struct dd_rec *r)
+{
+    struct iovec iov[3] = {
+        { &r->b, sizeof(r->b) },
+        { r->ent, dd->info->pg_per_blk * sizeof(*r->ent) },
+        { r->refs, dd->info->pg_per_blk * sizeof(*r->refs) },
+    };
+    ssize_t len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+    if (pwritev(dd->fd, iov, 3, dd_offset(dd, r->blk_id)) != len) {
+        printf("Could not update dedup file.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Put count of a block, -1 when it is unknown */
+static int dd_puts(int tgt_fd, uint32_t blk, uint32_t *puts)
+{
+    if (stats_blk_puts(tgt_fd, blk, puts)) {
+        printf("Could not read the put count of block %u: is the stats "
+                                            "directory writable?\n", blk);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Take (delta 1) or drop (-1) a reference on plane page pg of another
+ * block, unless that block was erased since puts was read */
+static int dd_ref(struct nvm_dd *dd, int tgt_fd, uint32_t blk, uint32_t puts,
+                                                            int pg, int delta)
+{
+    off_t off = dd_refs_offset(dd, blk, pg);
+    struct nvm_dd_blk b;
+    uint32_t refs = 0, cur;
+
+    if (dd_puts(tgt_fd, blk, &cur))
+        return -1;
+    if (pread(dd->fd, &b, sizeof(b), dd_offset(dd, blk)) != sizeof(b) ||
+                                            b.puts != puts || cur != puts)
+        return 0;
+
+    if (pread(dd->fd, &refs, sizeof(refs), off) < 0)
+        return -1;
+    if (delta < 0 && !refs)
+        return 0;
+    refs += delta;
+
+    if (pwrite(dd->fd, &refs, sizeof(refs), off) != sizeof(refs)) {
+        printf("Could not update dedup file.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drop the references the page map of a block holds on other blocks */
+static int dd_unref_all(struct nvm_dd *dd, int tgt_fd, struct dd_rec *r)
+{
+    struct nvm_dd_ent *e;
+    int i;
+
+    for (i = 0; i < dd->info->pg_per_blk; i++) {
+        e = &r->ent[i];
+        if ((e->flags & DD_VALID) && e->blk != r->blk_id &&
+                        dd_ref(dd, tgt_fd, e->blk, e->puts, e->pg, -1))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Start the record of a block over, as erased */
+static int dd_reset(struct nvm_dd *dd, int tgt_fd, struct dd_rec *r)
+{
+    memset(&r->b, 0, sizeof(r->b));
+    memset(r->ent, 0, dd->info->pg_per_blk * sizeof(*r->ent));
+    memset(r->refs, 0, dd->info->pg_per_blk * sizeof(*r->refs));
+
+    return dd_puts(tgt_fd, r->blk_id, &r->b.puts);
+}
+
+/* Record of a block. Blocks never written with -d read as zeroes: no page
+ * mapped. A block erased since it was written starts over, and the
+ * references its pages held on other blocks are dropped. */
+static int dd_load(struct nvm_dd *dd, int tgt_fd, uint32_t blk_id,
+                                                        struct dd_rec *r)
+{
+    struct iovec iov[3] = {
+        { &r->b, sizeof(r->b) },
+        { r->ent, dd->info->pg_per_blk * sizeof(*r->ent) },
+        { r->refs, dd->info->pg_per_blk * sizeof(*r->refs) },
+    };
+    uint32_t puts;
+
+    r->blk_id = blk_id;
+    memset(&r->b, 0, sizeof(r->b));
+    memset(r->ent, 0, iov[1].iov_len);
+    memset(r->refs, 0, iov[2].iov_len);
+
+    if (dd_puts(tgt_fd, blk_id, &puts) ||
+                        preadv(dd->fd, iov, 3, dd_offset(dd, blk_id)) < 0)
+        return -1;
+    if (r->b.puts == puts)
+        return 0;
+
+    if (dd_unref_all(dd, tgt_fd, r) || dd_reset(dd, tgt_fd, r))
+        return -1;
+
+    return dd_store(dd, r);
+}
+
+/* Whether plane page pg of block blk holds data some page maps to, and the
+ * puts of the block; -1 when they are unknown */
+static int dd_live(struct nvm_dd *dd, int tgt_fd, struct dd_rec *r,
+                                    uint32_t blk, int pg, uint32_t *puts)
+{
+    struct nvm_dd_blk b;
+    uint32_t refs = 0, cur;
+
+    if (blk == r->blk_id) {
+        *puts = r->b.puts;
+        return pg < r->b.next_pg && r->refs[pg];
+    }
+
+    if (dd_puts(tgt_fd, blk, &cur))
+        return -1;
+    if (pread(dd->fd, &b, sizeof(b), dd_offset(dd, blk)) != sizeof(b) ||
+            b.puts != cur || pg >= b.next_pg ||
+            pread(dd->fd, &refs, sizeof(refs), dd_refs_offset(dd, blk, pg)) !=
+                                                                sizeof(refs))
+        return 0;
+
+    *puts = b.puts;
+    return refs > 0;
+}
+
+/* Slot holding fp, or the slot to insert it in */
+static struct nvm_dd_slot *dd_slot(struct nvm_dd *dd, uint64_t fp)
+{
+    struct nvm_dd_slot *s;
+    uint32_t i, h = fp % dd->nr_slots;
+
+    for (i = 0; i < DD_PROBE; i++) {
+        s = &dd->slots[(h + i) % dd->nr_slots];
+        if (!s->used || s->fp == fp)
+            return s;
+    }
+
+    return s;
+}
+
+/* Write nr_pages pages of buf, mapping those already on the device to
+ * their copy and appending the others to the block. Returns the number of
+ * pages not programmed, -1 on error. */
+int dd_write(struct nvm_dd *dd, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_dev_info *info = dd->info;
+    uint32_t size = info->pln_pg_size;
+    struct nvm_dd_ent *e, old;
+    struct nvm_dd_slot *s;
+    struct dd_rec r = { 0 };
+    struct dd_ref *refs = NULL;
+    char *page, *out = NULL, *tmp = NULL;
+    uint32_t first, puts;
+    int i, dup, live, nr_refs = 0, nr_dup = 0, ret = -1;
+
+    if (dd_rec_alloc(dd, &r))
+        goto out;
+
+    /* A reference taken and one dropped per page */
+    refs = malloc(2 * nr_pages * sizeof(*refs));
+    if (!refs || posix_memalign((void **)&tmp, info->sec_size, size) ||
+            posix_memalign((void **)&out, info->sec_size,
+                                                (size_t) nr_pages * size)) {
+        printf("Could not allocate dedup memory.\n");
+        goto out;
+    }
+
+    /* One user at a time updates the index and the map */
+    flock(dd->fd, LOCK_EX);
+
+    if (dd_load(dd, tgt_fd, blk_id, &r))
+        goto unlock;
+    first = r.b.next_pg;
+
+    for (i = 0; i < nr_pages; i++) {
+        page = buf + (size_t) i * size;
+        e = &r.ent[start_pg + i];
+        old = *e;
+        e->fp = dd_hash(page, size);
+        s = dd_slot(dd, e->fp);
+        dup = 0;
+
+        /* A copy appended by this call, or one on the device */
+        live = (s->used && s->fp == e->fp) ?
+                        dd_live(dd, tgt_fd, &r, s->blk, s->pg, &puts) : 0;
+        if (live < 0)
+            goto unlock;
+        if (live) {
+            if (s->blk == blk_id && s->pg >= first)
+                dup = !memcmp(out + (size_t)(s->pg - first) * size, page,
+                                                                        size);
+            else
+                dup = (lnvm_page_io(tgt_fd, info, READ, tmp, s->blk, s->pg,
+                                        1) == 0 && !memcmp(tmp, page, size));
+        }
+
+        if (dup) {
+            e->blk = s->blk;
+            e->pg = s->pg;
+            e->puts = puts;
+            nr_dup++;
+        } else {
+            if (r.b.next_pg == info->pg_per_blk) {
+                printf("  Block %u is full (%d page(s) not written).\n",
+                                                        blk_id, nr_pages - i);
+                goto unlock;
+            }
+            memcpy(out + (size_t)(r.b.next_pg - first) * size, page, size);
+            e->blk = blk_id;
+            e->pg = r.b.next_pg++;
+            e->puts = r.b.puts;
+
+            /* Newest copy of this content */
+            s->fp = e->fp;
+            s->blk = blk_id;
+            s->pg = e->pg;
+            s->used = 1;
+        }
+        e->flags = DD_VALID;
+        e->reserved = 0;
+
+        /* Reference the copy, then drop the one the page had */
+        if (e->blk == blk_id)
+            r.refs[e->pg]++;
+        else
+            refs[nr_refs++] = (struct dd_ref) { e->blk, e->puts, e->pg, 1 };
+
+        if (!(old.flags & DD_VALID))
+            continue;
+        if (old.blk != blk_id)
+            refs[nr_refs++] = (struct dd_ref) { old.blk, old.puts, old.pg,
+                                                                        -1 };
+        else if (r.refs[old.pg])
+            r.refs[old.pg]--;
+    }
+
+    /* New pages follow those already in the block, with one request */
+    if (r.b.next_pg > first) {
+        if (lnvm_page_io(tgt_fd, info, WRITE, out, blk_id, first,
+                                                    r.b.next_pg - first)) {
+            printf("  Could not perform IO on pages %u:%u.\n", first,
+                                                            r.b.next_pg - 1);
+            goto unlock;
+        }
+        if (page_cache)
+            cache_inval(page_cache, tgt_fd, blk_id, first,
+                                                        r.b.next_pg - first);
+    }
+    stats_add(tgt_fd, STATS_HOST, (size_t) nr_pages * size);
+
+    for (i = 0; i < nr_refs; i++)
+        if (dd_ref(dd, tgt_fd, refs[i].blk, refs[i].puts, refs[i].pg,
+                                                            refs[i].delta))
+            goto unlock;
+
+    if (dd_store(dd, &r))
+        goto unlock;
+
+    ret = nr_dup;
+
+unlock:
+    flock(dd->fd, LOCK_UN);
+out:
+    dd_rec_free(&r);
+    free(refs);
+    free(out);
+    free(tmp);
+    return ret;
+}
+
+/* Read nr_pages pages into buf through the page map. Returns the number of
+ * pages whose copy changed, -1 on error. */
+int dd_read(struct nvm_dd *dd, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_dev_info *info = dd->info;
+    uint32_t size = info->pln_pg_size;
+    struct dd_rec r = { 0 };
+    struct nvm_dd_ent *e;
+    char *page;
+    int i, n, bad = 0, ret = -1;
+
+    if (dd_rec_alloc(dd, &r))
+        goto out;
+
+    /* Loading drops the references of a block erased since */
+    flock(dd->fd, LOCK_EX);
+
+    if (dd_load(dd, tgt_fd, blk_id, &r))
+        goto unlock;
+
+    for (i = 0; i < nr_pages; i += n) {
+        e = &r.ent[start_pg + i];
+        page = buf + (size_t) i * size;
+        n = 1;
+
+        /* Never written: read as erased */
+        if (!(e->flags & DD_VALID)) {
+            memset(page, 0, size);
+            continue;
+        }
+
+        /* Copies next to each other, with one request */
+        while (i + n < nr_pages && (e[n].flags & DD_VALID) &&
+                                e[n].blk == e->blk && e[n].pg == e->pg + n)
+            n++;
+
+        if (lnvm_page_io(tgt_fd, info, READ, page, e->blk, e->pg, n)) {
+            printf("  Could not perform IO on page %d.\n", start_pg + i);
+            goto unlock;
+        }
+    }
+
+    for (i = 0; i < nr_pages; i++) {
+        e = &r.ent[start_pg + i];
+        if (!(e->flags & DD_VALID) ||
+                        dd_hash(buf + (size_t) i * size, size) == e->fp)
+            continue;
+        if (e->blk != blk_id)
+            printf("  Page %d: its copy in block %u page %u changed.\n",
+                                                start_pg + i, e->blk, e->pg);
+        else
+            printf("  Page %d changed since it was written.\n",
+                                                                start_pg + i);
+        bad++;
+    }
+    ret = bad;
+
+unlock:
+    flock(dd->fd, LOCK_UN);
+out:
+    dd_rec_free(&r);
+    return ret;
+}
+
+/* Put a block written with -d. A block holding the copy of pages of other
+ * blocks is kept. Returns the number of such plane pages, 0 once the block
+ * is put, -1 on error. */
+int dd_put(struct nvm_dd *dd, int tgt_fd, NVM_VBLOCK *vblk)
+{
+    uint32_t n = dd->info->pg_per_blk;
+    struct dd_rec r = { 0 };
+    struct nvm_dd_ent *e;
+    uint32_t *own = NULL;
+    int i, busy = 0, ret = -1;
+
+    if (dd_rec_alloc(dd, &r))
+        goto out;
+
+    own = calloc(n, sizeof(*own));
+    if (!own) {
+        printf("Could not allocate dedup memory.\n");
+        goto out;
+    }
+
+    flock(dd->fd, LOCK_EX);
+
+    if (dd_load(dd, tgt_fd, vblk->id, &r))
+        goto unlock;
+
+    /* References from its own pages go away with the block */
+    for (i = 0; i < n; i++) {
+        e = &r.ent[i];
+        if ((e->flags & DD_VALID) && e->blk == vblk->id)
+            own[e->pg]++;
+    }
+    for (i = 0; i < n; i++)
+        if (r.refs[i] > own[i])
+            busy++;
+    if (busy) {
+        ret = busy;
+        goto unlock;
+    }
+
+    if (nvm_be->put_block(tgt_fd, vblk))
+        goto unlock;
+
+    if (dd_unref_all(dd, tgt_fd, &r) || dd_reset(dd, tgt_fd, &r))
+        goto unlock;
+    if (dd_store(dd, &r))
+        goto unlock;
+
+    ret = 0;
+
+unlock:
+    flock(dd->fd, LOCK_UN);
+out:
+    dd_rec_free(&r);
+    free(own);
+    return ret;
+}
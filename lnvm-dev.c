@@ -0,0 +1,238 @@
+/*  Device and target enumeration for lnvm-manager.
+
+    dev_scan() lists every LightNVM device with its geometry and the
+    targets created on it. The device properties are queried by a pool
+    of DEV_WORKERS threads, while another thread looks up the targets,
+    so a host with many devices is listed in about the time of its
+    slowest query.
+
+    The management interface returns at most 31 devices; when it
+    returns that many, every other device is found in sysfs (block
+    devices with a 'lightnvm' directory), however many there are.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <argp.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+#define DEV_IOCTL_MAX   31
+
+struct dev_scan_ctx {
+    struct nvm_dev_list *l;
+    int next;
+};
+
+static int dev_known(struct nvm_dev_list *l, const char *name)
+{
+    int i;
+
+    for (i = 0; i < l->nr_devs; i++)
+        if (strcmp(l->devs[i].info.dev, name) == 0)
+            return 1;
+
+    return 0;
+}
+
+/* Devices the management ioctl could not return. The list, of max
+ * entries, grows as needed. */
+static int dev_scan_sysfs(struct nvm_dev_list *l, int *max)
+{
+    char path[PATH_MAX];
+    struct nvm_dev_entry *devs;
+    struct dirent *de;
+    DIR *dir;
+    int ret = 0;
+
+    dir = opendir("/sys/block");
+    if (!dir)
+        return 0;
+
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= DISK_NAME_LEN)
+            continue;
+        snprintf(path, sizeof(path), "/sys/block/%s/lightnvm", de->d_name);
+        if (access(path, F_OK) || dev_known(l, de->d_name))
+            continue;
+
+        if (l->nr_devs == *max) {
+            devs = realloc(l->devs, 2 * *max * sizeof(*devs));
+            if (!devs) {
+                ret = -1;
+                break;
+            }
+            memset(devs + *max, 0, *max * sizeof(*devs));
+            l->devs = devs;
+            *max *= 2;
+        }
+        strcpy(l->devs[l->nr_devs++].info.dev, de->d_name);
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+static void *dev_worker(void *arg)
+{
+    struct dev_scan_ctx *ctx = arg;
+    struct nvm_ioctl_dev_info info;
+    struct nvm_dev_entry *d;
+    int i;
+
+    while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+                                                            ctx->l->nr_devs) {
+        d = &ctx->l->devs[i];
+        memset(&info, 0, sizeof(info));
+        strcpy(info.dev, d->info.dev);
+        d->ret = nvm_be->get_device_info(&info);
+        if (d->ret)
+            continue;
+
+        d->info.prop = info.prop;
+        /* Devices found in sysfs only have a name */
+        if (!d->info.bmname[0]) {
+            memcpy(d->info.bmname, info.bmname, NVM_MMTYPE_LEN);
+            memcpy(d->info.bmversion, info.bmversion, sizeof(info.bmversion));
+        }
+        if (nvm_be->pg_per_blk)
+            d->pg_per_blk = nvm_be->pg_per_blk(d->info.dev);
+        if (!d->pg_per_blk)
+            d->pg_per_blk = PGS_PER_BLK;
+    }
+
+    return NULL;
+}
+
+static void *tgt_worker(void *arg)
+{
+    struct nvm_dev_list *l = arg;
+
+    l->nr_tgts = nvm_be->get_targets(l->tgts, DEV_MAX_TGTS);
+    if (l->nr_tgts < 0)
+        l->nr_tgts = 0;
+
+    return NULL;
+}
+
+int dev_scan(struct nvm_dev_list *l)
+{
+    struct nvm_ioctl_get_devices *devs;
+    struct dev_scan_ctx ctx;
+    pthread_t workers[DEV_WORKERS], tgt_thread;
+    int i, nr, max, nr_workers, tgt_ok;
+
+    memset(l, 0, sizeof(*l));
+
+    devs = malloc(sizeof(*devs));
+    l->tgts = calloc(DEV_MAX_TGTS, sizeof(struct nvm_ioctl_tgt_info));
+    if (!devs || !l->tgts)
+        goto err;
+
+    /* Targets are looked up while the devices are queried */
+    tgt_ok = (pthread_create(&tgt_thread, NULL, tgt_worker, l) == 0);
+    if (!tgt_ok)
+        tgt_worker(l);
+
+    memset(devs, 0, sizeof(*devs));
+    if (nvm_be->get_devices(devs)) {
+        printf("nvm_get_devices error. Do you have root privilegies? "
+                                                "If yes, look to 'dmesg'.\n");
+        if (tgt_ok)
+            pthread_join(tgt_thread, NULL);
+        goto err;
+    }
+
+    max = (devs->nr_devices > DEV_IOCTL_MAX) ? devs->nr_devices :
+                                                            DEV_IOCTL_MAX;
+    l->devs = calloc(max, sizeof(struct nvm_dev_entry));
+    if (!l->devs) {
+        if (tgt_ok)
+            pthread_join(tgt_thread, NULL);
+        goto err;
+    }
+
+    nr = (devs->nr_devices < DEV_IOCTL_MAX) ? devs->nr_devices :
+                                                            DEV_IOCTL_MAX;
+    for (i = 0; i < nr; i++)
+        l->devs[i].info = devs->info[i];
+    l->nr_devs = nr;
+    /* A full answer may hide more devices */
+    if (devs->nr_devices >= DEV_IOCTL_MAX && dev_scan_sysfs(l, &max)) {
+        printf("Could not allocate memory.\n");
+        if (tgt_ok)
+            pthread_join(tgt_thread, NULL);
+        goto err;
+    }
+
+    ctx.l = l;
+    ctx.next = 0;
+    nr_workers = (l->nr_devs < DEV_WORKERS) ? l->nr_devs : DEV_WORKERS;
+    for (i = 0; i < nr_workers; i++)
+        if (pthread_create(&workers[i], NULL, dev_worker, &ctx))
+            break;
+    nr_workers = i;
+    /* Also the fallback when no worker could be started */
+    dev_worker(&ctx);
+    for (i = 0; i < nr_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    if (tgt_ok)
+        pthread_join(tgt_thread, NULL);
+    free(devs);
+
+    return 0;
+
+err:
+    free(devs);
+    dev_list_free(l);
+    return -1;
+}
+
+void dev_list_free(struct nvm_dev_list *l)
+{
+    free(l->devs);
+    free(l->tgts);
+    l->devs = NULL;
+    l->tgts = NULL;
+    l->nr_devs = l->nr_tgts = 0;
+}
+
+/* Print a string as a JSON string literal */
+void json_str(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Print a string as a CSV field, quoted when it holds a separator, a quote
+ * or a line break */
+void csv_str(const char *s)
+{
+    if (!strpbrk(s, ",\"\r\n")) {
+        fputs(s, stdout);
+        return;
+    }
+
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"')
+            putchar('"');
+        putchar(*s);
+    }
+    putchar('"');
+}
@@ -0,0 +1,366 @@
+/*  Event loop mode for lnvm-manager.
+
+    Page requests from any number of clients are multiplexed onto a few
+    reactor threads. Each reactor runs an epoll loop over two eventfds,
+    one for new submissions and one for device completions, and over any
+    other fd registered with evl_add_fd() (sockets of a daemon, say):
+
+        client --evl_submit()--> submission list --eventfd--> reactor
+        reactor --sched_submit()--> per-LUN scheduler (lnvm-sched.c)
+        scheduler --end_io--> completion list --eventfd--> reactor
+        reactor --end_io or client eventfd--> client
+
+    Both lists are lock-free stacks: a producer pushes with one
+    compare-and-swap and only the push onto an empty list writes the
+    eventfd, and the reactor takes the whole list with one exchange.
+    A reactor wakes up once for a batch of requests, however many there
+    are, and never blocks on the device: the page I/O is done by the
+    scheduler dispatch threads, 'depth' per LUN, since the target fd
+    only offers blocking pread/pwrite.
+
+    A request completes through its end_io callback, run on the reactor,
+    and/or by a write to its client's eventfd, which the client can poll
+    along with its own sockets.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <argp.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+/* Push onto a lock-free stack. Returns 1 if it was empty */
+static int evl_push(struct nvm_evl_req **head, struct nvm_evl_req *rq)
+{
+    struct nvm_evl_req *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+    do {
+        rq->next = old;
+    } while (!__atomic_compare_exchange_n(head, &old, rq, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return old == NULL;
+}
+
+/* Take the whole stack, oldest first */
+static struct nvm_evl_req *evl_take(struct nvm_evl_req **head)
+{
+    struct nvm_evl_req *rq, *next, *fifo = NULL;
+
+    rq = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+    for (; rq; rq = next) {
+        next = rq->next;
+        rq->next = fifo;
+        fifo = rq;
+    }
+
+    return fifo;
+}
+
+static void evl_kick(int efd)
+{
+    uint64_t one = 1;
+
+    if (write(efd, &one, sizeof(one)) != sizeof(one))
+        printf("Could not signal eventfd %d.\n", efd);
+}
+
+static void evl_drain(int efd)
+{
+    uint64_t n;
+
+    if (read(efd, &n, sizeof(n)) != sizeof(n))
+        return;
+}
+
+/* Runs on a scheduler thread */
+static void evl_end_io(struct nvm_sched_req *srq)
+{
+    struct nvm_evl_req *rq = srq->priv;
+
+    rq->ret = srq->ret;
+    if (evl_push(&rq->r->cpl, rq))
+        evl_kick(rq->r->cpl_fd);
+}
+
+static void evl_complete(struct nvm_evl_req *rq)
+{
+    int efd = rq->efd;
+
+    /* Either may free the request */
+    if (rq->end_io)
+        rq->end_io(rq);
+    if (efd >= 0)
+        evl_kick(efd);
+}
+
+static void evl_on_submit(struct nvm_evl_fd *f, uint32_t events)
+{
+    struct nvm_evl_reactor *r = f->priv;
+    struct nvm_evl_req *rq, *next;
+
+    evl_drain(r->sub_fd);
+    r->wakeups++;
+
+    for (rq = evl_take(&r->sub); rq; rq = next) {
+        next = rq->next;
+        memset(&rq->srq, 0, sizeof(rq->srq));
+        rq->srq.lun = rq->lun;
+        rq->srq.dir = rq->dir;
+        rq->srq.buf = rq->buf;
+        rq->srq.blk_id = rq->blk_id;
+        rq->srq.pg = rq->pg;
+        rq->srq.nr_pages = rq->nr_pages;
+        rq->srq.end_io = evl_end_io;
+        rq->srq.priv = rq;
+        r->nr_reqs++;
+
+        if (sched_submit(&r->evl->sched, &rq->srq)) {
+            rq->ret = -1;
+            evl_complete(rq);
+        }
+    }
+}
+
+static void evl_on_complete(struct nvm_evl_fd *f, uint32_t events)
+{
+    struct nvm_evl_reactor *r = f->priv;
+    struct nvm_evl_req *rq, *next;
+
+    evl_drain(r->cpl_fd);
+    r->wakeups++;
+
+    for (rq = evl_take(&r->cpl); rq; rq = next) {
+        next = rq->next;
+        evl_complete(rq);
+    }
+}
+
+static void *evl_reactor(void *arg)
+{
+    struct nvm_evl_reactor *r = arg;
+    struct epoll_event ev[EVL_MAX_EVENTS];
+    struct nvm_evl_fd *f;
+    int i, nr;
+
+    while (!__atomic_load_n(&r->evl->stop, __ATOMIC_ACQUIRE)) {
+        nr = epoll_wait(r->epfd, ev, EVL_MAX_EVENTS, -1);
+        for (i = 0; i < nr; i++) {
+            f = ev[i].data.ptr;
+            f->fn(f, ev[i].events);
+        }
+    }
+
+    return NULL;
+}
+
+static int evl_watch(int epfd, struct nvm_evl_fd *f, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = f;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, f->fd, &ev);
+}
+
+static void evl_reactor_free(struct nvm_evl_reactor *r)
+{
+    if (r->epfd >= 0)
+        close(r->epfd);
+    if (r->sub_fd >= 0)
+        close(r->sub_fd);
+    if (r->cpl_fd >= 0)
+        close(r->cpl_fd);
+}
+
+static int evl_reactor_init(struct nvm_evl *evl, struct nvm_evl_reactor *r)
+{
+    r->evl = evl;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    r->sub_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->cpl_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->epfd < 0 || r->sub_fd < 0 || r->cpl_fd < 0)
+        goto err;
+
+    r->sub_ev.fd = r->sub_fd;
+    r->sub_ev.fn = evl_on_submit;
+    r->sub_ev.priv = r;
+    r->cpl_ev.fd = r->cpl_fd;
+    r->cpl_ev.fn = evl_on_complete;
+    r->cpl_ev.priv = r;
+    if (evl_watch(r->epfd, &r->sub_ev, EPOLLIN) ||
+                                    evl_watch(r->epfd, &r->cpl_ev, EPOLLIN))
+        goto err;
+
+    return 0;
+
+err:
+    printf("Could not set up event loop reactor.\n");
+    evl_reactor_free(r);
+    return -1;
+}
+
+int evl_init(struct nvm_evl *evl, int tgt_fd, struct nvm_dev_info *info,
+                                        uint32_t nr_luns, int nr_reactors)
+{
+    int i;
+
+    memset(evl, 0, sizeof(*evl));
+    if (nr_reactors < 1)
+        nr_reactors = 1;
+    if (nr_reactors > EVL_MAX_REACTORS)
+        nr_reactors = EVL_MAX_REACTORS;
+
+    if (posix_memalign((void **)&evl->r, 64,
+                        nr_reactors * sizeof(struct nvm_evl_reactor))) {
+        printf("Could not allocate event loop memory.\n");
+        evl->r = NULL;
+        return -1;
+    }
+    memset(evl->r, 0, nr_reactors * sizeof(struct nvm_evl_reactor));
+
+    if (sched_init(&evl->sched, tgt_fd, info, nr_luns, info->io_depth,
+                                                            SCHED_WR_MAX))
+        goto err;
+
+    for (i = 0; i < nr_reactors; i++) {
+        evl->r[i].epfd = evl->r[i].sub_fd = evl->r[i].cpl_fd = -1;
+        if (evl_reactor_init(evl, &evl->r[i]))
+            goto err;
+        if (pthread_create(&evl->r[i].thread, NULL, evl_reactor,
+                                                            &evl->r[i])) {
+            printf("Could not start event loop reactor.\n");
+            evl_reactor_free(&evl->r[i]);
+            goto err;
+        }
+        evl->nr_reactors++;
+    }
+
+    return 0;
+
+err:
+    evl_free(evl);
+    return -1;
+}
+
+/* Requests still in flight must have completed */
+void evl_free(struct nvm_evl *evl)
+{
+    int i;
+
+    __atomic_store_n(&evl->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < evl->nr_reactors; i++) {
+        evl_kick(evl->r[i].sub_fd);
+        pthread_join(evl->r[i].thread, NULL);
+    }
+
+    sched_free(&evl->sched);
+
+    for (i = 0; i < evl->nr_reactors; i++)
+        evl_reactor_free(&evl->r[i]);
+    free(evl->r);
+    evl->r = NULL;
+    evl->nr_reactors = 0;
+}
+
+/* Queue a request on a reactor. Callable from any thread, reactors
+ * included (from end_io) */
+void evl_submit(struct nvm_evl *evl, struct nvm_evl_req *rq)
+{
+    struct nvm_evl_reactor *r;
+
+    r = &evl->r[__atomic_fetch_add(&evl->next, 1, __ATOMIC_RELAXED) %
+                                                        evl->nr_reactors];
+    rq->r = r;
+    if (evl_push(&r->sub, rq))
+        evl_kick(r->sub_fd);
+}
+
+/* Watch another fd from a reactor: fn runs on it when events occur */
+int evl_add_fd(struct nvm_evl *evl, struct nvm_evl_fd *f, uint32_t events)
+{
+    struct nvm_evl_reactor *r;
+
+    r = &evl->r[__atomic_fetch_add(&evl->next, 1, __ATOMIC_RELAXED) %
+                                                        evl->nr_reactors];
+    return evl_watch(r->epfd, f, events);
+}
+
+/* Read or write pages of a block through an event loop, as many requests
+ * of info->io_pages pages in flight as there are. The caller waits in its
+ * own epoll loop on an eventfd, as a daemon serving sockets would. */
+int evl_pages(int tgt_fd, struct nvm_dev_info *info, uint8_t direction,
+                            char *buf, uint32_t blk_id, int pg, int nr_pages)
+{
+    struct nvm_evl evl;
+    struct nvm_evl_req *rqs;
+    struct epoll_event ev;
+    uint64_t n;
+    int i, nr_rqs, done = 0, ret = -1;
+    int epfd = -1, efd = -1;
+
+    nr_rqs = (nr_pages + info->io_pages - 1) / info->io_pages;
+    rqs = calloc(nr_rqs, sizeof(*rqs));
+    if (!rqs) {
+        printf("Could not allocate event loop memory.\n");
+        return -1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    efd = eventfd(0, EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (epfd < 0 || efd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev)) {
+        printf("Could not set up completion eventfd.\n");
+        goto out;
+    }
+
+    /* The block is on one LUN: a single queue, io_depth deep */
+    if (evl_init(&evl, tgt_fd, info, 1, 1))
+        goto out;
+
+    for (i = 0; i < nr_rqs; i++) {
+        rqs[i].dir = direction;
+        rqs[i].blk_id = blk_id;
+        rqs[i].pg = pg + i * info->io_pages;
+        rqs[i].nr_pages = (nr_pages - i * info->io_pages < info->io_pages) ?
+                                nr_pages - i * info->io_pages : info->io_pages;
+        rqs[i].buf = buf + (size_t) i * info->io_pages * info->pln_pg_size;
+        rqs[i].efd = efd;
+        evl_submit(&evl, &rqs[i]);
+    }
+
+    /* The eventfd counts the completions since the last read */
+    while (done < nr_rqs) {
+        if (epoll_wait(epfd, &ev, 1, -1) < 1)
+            continue;
+        if (read(efd, &n, sizeof(n)) == sizeof(n))
+            done += n;
+    }
+    evl_free(&evl);
+
+    ret = 0;
+    for (i = 0; i < nr_rqs; i++) {
+        if (rqs[i].ret) {
+            printf("  Could not perform IO on pages %d:%d.\n", rqs[i].pg,
+                                            rqs[i].pg + rqs[i].nr_pages - 1);
+            ret = -1;
+        }
+    }
+
+out:
+    if (efd >= 0)
+        close(efd);
+    if (epfd >= 0)
+        close(epfd);
+    free(rqs);
+    return ret;
+}
@@ -0,0 +1,472 @@
+/*  Compressed page mode for lnvm-manager ('write -z', 'read -z').
+
+    Logical pages are compressed with LZ4 and packed back to back into
+    plane pages, so writing them programs fewer pages. A packed plane
+    page starts with a small header (magic, number of records), each
+    record with its logical page and length; records are LZ_ALIGN aligned
+    and never span plane pages. A page that does not compress gets a
+    plane page of its own, stored as is.
+
+    Writes append to the block: the plane pages of a write follow those
+    of the previous one, so a logical page can be written again until the
+    block is full. The index file keeps, per block, the next plane page
+    to program and an 8-byte entry per logical page (plane page, offset,
+    length); rewriting a logical page points it to its new copy. A block
+    written with -z must only be written with -z until it is erased.
+
+    The record of a block also keeps how many times the block had been
+    put when it was written (stats_blk_puts()). When the count has moved
+    since, the block was erased by some other command and the record
+    starts over: writes go to plane page 0 and unwritten pages read as
+    erased. Without the count (<target>.puts cannot be opened) an erase
+    would go unseen, so -z I/O is refused.
+
+    Compression and decompression are spread over one thread per CPU (up
+    to LZ_MAX_WORKERS), the caller being one of them.
+
+    Needs liblz4: build with 'make LZ4=1'.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <argp.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+struct lz_job {
+    struct nvm_dev_info *info;
+    char *src;
+    char *dst;
+    struct nvm_lz_ent *ent;
+    uint32_t *clen;
+    int start_pg;
+    int nr_pages;
+    int first_pg;               /* plane page at the start of src (read) */
+    size_t slot;                /* bytes per compressed page (write) */
+    int next;
+    int bad;
+};
+
+#ifdef HAVE_LZ4
+static int lz_compress(const char *src, char *dst, int len, int cap)
+{
+    return LZ4_compress_default(src, dst, len, cap);
+}
+
+static int lz_decompress(const char *src, char *dst, int len, int cap)
+{
+    return LZ4_decompress_safe(src, dst, len, cap);
+}
+#else
+static int lz_compress(const char *src, char *dst, int len, int cap)
+{
+    return 0;
+}
+
+static int lz_decompress(const char *src, char *dst, int len, int cap)
+{
+    return -1;
+}
+#endif
+
+static off_t lz_offset(struct nvm_lz *lz, uint32_t blk_id)
+{
+    return sizeof(struct nvm_lz_idx_hdr) + (off_t) blk_id *
+            (sizeof(struct nvm_lz_blk) + lz->info->pg_per_blk *
+                                            sizeof(struct nvm_lz_ent));
+}
+
+/* Largest compressed page that fits in a packed plane page */
+static uint32_t lz_max_rec(struct nvm_dev_info *info)
+{
+    return info->pln_pg_size - sizeof(struct nvm_lz_pg) -
+                                                sizeof(struct nvm_lz_rec);
+}
+
+static size_t lz_align(size_t len)
+{
+    return (len + LZ_ALIGN - 1) & ~((size_t) LZ_ALIGN - 1);
+}
+
+int lz_open(struct nvm_lz *lz, const char *path, struct nvm_dev_info *info)
+{
+    struct nvm_lz_idx_hdr hdr;
+    ssize_t ret;
+
+    lz->fd = -1;
+    lz->info = info;
+
+#ifndef HAVE_LZ4
+    printf("lnvm was built without LZ4 support (make LZ4=1).\n");
+    return -1;
+#endif
+
+    lz->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (lz->fd < 0) {
+        printf("Could not open compression index %s.\n", path);
+        return -1;
+    }
+
+    ret = pread(lz->fd, &hdr, sizeof(hdr), 0);
+    if (ret == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = LZ_IDX_MAGIC;
+        hdr.pln_pg_size = info->pln_pg_size;
+        hdr.pg_per_blk = info->pg_per_blk;
+        if (pwrite(lz->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            printf("Could not initialize compression index %s.\n", path);
+            goto err;
+        }
+        return 0;
+    }
+
+    if (ret != sizeof(hdr) || hdr.magic != LZ_IDX_MAGIC) {
+        printf("%s is not a compression index.\n", path);
+        goto err;
+    }
+
+    if (hdr.pln_pg_size != info->pln_pg_size ||
+                                    hdr.pg_per_blk != info->pg_per_blk) {
+        printf("Compression index %s geometry mismatch (page size %u, pages "
+                "per block %u).\n", path, hdr.pln_pg_size, hdr.pg_per_blk);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    close(lz->fd);
+    lz->fd = -1;
+    return -1;
+}
+
+void lz_close(struct nvm_lz *lz)
+{
+    if (lz->fd >= 0)
+        close(lz->fd);
+    lz->fd = -1;
+}
+
+/* Block record: next plane page, then the entries of every logical page.
+ * The record of a block erased since it was written is empty. */
+static int lz_load(struct nvm_lz *lz, int tgt_fd, uint32_t blk_id,
+                                struct nvm_lz_blk *b, struct nvm_lz_ent *ent)
+{
+    struct iovec iov[2] = {
+        { b, sizeof(*b) },
+        { ent, lz->info->pg_per_blk * sizeof(*ent) },
+    };
+    uint32_t puts;
+
+    memset(b, 0, sizeof(*b));
+    memset(ent, 0, iov[1].iov_len);
+
+    if (stats_blk_puts(tgt_fd, blk_id, &puts)) {
+        printf("Could not read the put count of block %u: is the stats "
+                                        "directory writable?\n", blk_id);
+        return -1;
+    }
+
+    if (preadv(lz->fd, iov, 2, lz_offset(lz, blk_id)) < 0)
+        return -1;
+
+    if (b->puts != puts) {
+        memset(b, 0, sizeof(*b));
+        memset(ent, 0, iov[1].iov_len);
+        b->puts = puts;
+    }
+
+    return 0;
+}
+
+static int lz_store(struct nvm_lz *lz, uint32_t blk_id, struct nvm_lz_blk *b,
+                                                    struct nvm_lz_ent *ent)
+{
+    struct iovec iov[2] = {
+        { b, sizeof(*b) },
+        { ent, lz->info->pg_per_blk * sizeof(*ent) },
+    };
+    ssize_t len = iov[0].iov_len + iov[1].iov_len;
+
+    if (pwritev(lz->fd, iov, 2, lz_offset(lz, blk_id)) != len) {
+        printf("Could not update compression index.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Run fn on one thread per CPU, the caller included */
+static void lz_run(struct lz_job *job, void *(*fn)(void *))
+{
+    pthread_t workers[LZ_MAX_WORKERS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, nr;
+
+    nr = (cpus > 0 && cpus < LZ_MAX_WORKERS) ? cpus : LZ_MAX_WORKERS;
+    if (nr > job->nr_pages)
+        nr = job->nr_pages;
+
+    for (i = 0; i < nr - 1; i++)
+        if (pthread_create(&workers[i], NULL, fn, job))
+            break;
+    nr = i;
+    fn(job);
+    for (i = 0; i < nr; i++)
+        pthread_join(workers[i], NULL);
+}
+
+static void *lz_compress_worker(void *arg)
+{
+    struct lz_job *job = arg;
+    uint32_t size = job->info->pln_pg_size;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+                                                            job->nr_pages) {
+        /* 0 when it does not fit: stored as is */
+        job->clen[i] = lz_compress(job->src + (size_t) i * size,
+                                    job->dst + i * job->slot, size,
+                                    lz_max_rec(job->info));
+    }
+
+    return NULL;
+}
+
+static void *lz_decompress_worker(void *arg)
+{
+    struct lz_job *job = arg;
+    uint32_t size = job->info->pln_pg_size;
+    struct nvm_lz_ent *e;
+    struct nvm_lz_pg *hdr;
+    struct nvm_lz_rec *rec;
+    char *page, *dst;
+    int i, pg;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+                                                            job->nr_pages) {
+        pg = job->start_pg + i;
+        e = &job->ent[pg];
+        dst = job->dst + (size_t) i * size;
+
+        /* Never written: read as erased */
+        if (!e->len) {
+            memset(dst, 0, size);
+            continue;
+        }
+
+        page = job->src + (size_t)(e->pg - job->first_pg) * size;
+        if (e->len & LZ_RAW) {
+            memcpy(dst, page, size);
+            continue;
+        }
+
+        hdr = (struct nvm_lz_pg *) page;
+        rec = (struct nvm_lz_rec *)(page + e->off * LZ_ALIGN);
+        if (hdr->magic != LZ_PG_MAGIC || rec->pg != pg ||
+                rec->len != e->len || e->off * LZ_ALIGN + sizeof(*rec) +
+                                                        e->len > size ||
+                lz_decompress((char *)(rec + 1), dst, e->len, size) != size) {
+            printf("  Page %d does not decompress (plane page %u).\n", pg,
+                                                                    e->pg);
+            memset(dst, 0, size);
+            __atomic_fetch_add(&job->bad, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/* Close a packed plane page: header and zeroed tail */
+static void lz_seal(char *page, uint32_t fill, int nr_recs, uint32_t size)
+{
+    struct nvm_lz_pg *hdr = (struct nvm_lz_pg *) page;
+
+    hdr->magic = LZ_PG_MAGIC;
+    hdr->nr_recs = nr_recs;
+    hdr->reserved = 0;
+    memset(page + fill, 0, size - fill);
+}
+
+/* Compress and program nr_pages logical pages of buf. Returns the number
+ * of plane pages programmed, -1 on error. */
+int lz_write(struct nvm_lz *lz, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_dev_info *info = lz->info;
+    uint32_t size = info->pln_pg_size;
+    struct nvm_lz_ent *ent = NULL, *e;
+    struct nvm_lz_rec *rec;
+    struct nvm_lz_blk b;
+    struct lz_job job;
+    char *out = NULL, *page;
+    uint32_t fill = 0, pad = 0;
+    int i, nr = 0, nr_recs = 0, ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.info = info;
+    job.src = buf;
+    job.start_pg = start_pg;
+    job.nr_pages = nr_pages;
+    job.slot = lz_align(lz_max_rec(info));
+
+    ent = malloc(info->pg_per_blk * sizeof(*ent));
+    job.clen = malloc(nr_pages * sizeof(uint32_t));
+    job.dst = malloc(nr_pages * job.slot);
+    /* At worst, one plane page per logical page */
+    if (!ent || !job.clen || !job.dst || posix_memalign((void **)&out,
+                                info->sec_size, (size_t) nr_pages * size)) {
+        printf("Could not allocate compression memory.\n");
+        goto out;
+    }
+
+    if (lz_load(lz, tgt_fd, blk_id, &b, ent))
+        goto out;
+
+    lz_run(&job, lz_compress_worker);
+
+    /* Pack in logical page order */
+    for (i = 0; i < nr_pages; i++) {
+        e = &ent[start_pg + i];
+
+        if (!job.clen[i]) {
+            if (nr_recs) {
+                lz_seal(out + (size_t)(nr - 1) * size, fill, nr_recs, size);
+                pad += size - fill;
+                nr_recs = 0;
+            }
+            memcpy(out + (size_t) nr * size, buf + (size_t) i * size, size);
+            e->pg = b.next_pg + nr++;
+            e->off = 0;
+            e->len = LZ_RAW | size;
+            continue;
+        }
+
+        if (!nr_recs || fill + sizeof(*rec) + job.clen[i] > size) {
+            if (nr_recs) {
+                lz_seal(out + (size_t)(nr - 1) * size, fill, nr_recs, size);
+                pad += size - fill;
+            }
+            nr++;
+            nr_recs = 0;
+            fill = sizeof(struct nvm_lz_pg);
+        }
+
+        page = out + (size_t)(nr - 1) * size;
+        rec = (struct nvm_lz_rec *)(page + fill);
+        rec->pg = start_pg + i;
+        rec->len = job.clen[i];
+        memcpy(rec + 1, job.dst + i * job.slot, job.clen[i]);
+
+        e->pg = b.next_pg + nr - 1;
+        e->off = fill / LZ_ALIGN;
+        e->len = job.clen[i];
+        fill = lz_align(fill + sizeof(*rec) + job.clen[i]);
+        if (fill > size)
+            fill = size;
+        nr_recs++;
+    }
+    if (nr_recs) {
+        lz_seal(out + (size_t)(nr - 1) * size, fill, nr_recs, size);
+        pad += size - fill;
+    }
+
+    if (b.next_pg + nr > info->pg_per_blk) {
+        printf("  Block %u is full (%d plane page(s) needed, %u left).\n",
+                                blk_id, nr, info->pg_per_blk - b.next_pg);
+        goto out;
+    }
+
+    if (lnvm_page_io(tgt_fd, info, WRITE, out, blk_id, b.next_pg, nr)) {
+        printf("  Could not perform IO on pages %u:%u.\n", b.next_pg,
+                                                        b.next_pg + nr - 1);
+        goto out;
+    }
+    if (page_cache)
+        cache_inval(page_cache, tgt_fd, blk_id, b.next_pg, nr);
+    stats_add(tgt_fd, STATS_HOST, (size_t) nr_pages * size);
+    stats_add(tgt_fd, STATS_PAD, pad);
+
+    b.next_pg += nr;
+    if (lz_store(lz, blk_id, &b, ent))
+        goto out;
+
+    ret = nr;
+
+out:
+    free(ent);
+    free(job.clen);
+    free(job.dst);
+    free(out);
+    return ret;
+}
+
+/* Read and decompress nr_pages logical pages into buf. Returns the number
+ * of pages that failed to decompress, -1 on error. */
+int lz_read(struct nvm_lz *lz, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf)
+{
+    struct nvm_dev_info *info = lz->info;
+    struct nvm_lz_ent *ent;
+    struct nvm_lz_blk b;
+    struct lz_job job;
+    int i, first = -1, last = -1, ret = -1;
+
+    memset(&job, 0, sizeof(job));
+    job.info = info;
+    job.dst = buf;
+    job.start_pg = start_pg;
+    job.nr_pages = nr_pages;
+
+    ent = malloc(info->pg_per_blk * sizeof(*ent));
+    if (!ent) {
+        printf("Could not allocate compression memory.\n");
+        return -1;
+    }
+    job.ent = ent;
+
+    if (lz_load(lz, tgt_fd, blk_id, &b, ent))
+        goto out;
+
+    /* Plane pages holding the range, read with one request */
+    for (i = start_pg; i < start_pg + nr_pages; i++) {
+        if (!ent[i].len)
+            continue;
+        if (first < 0 || ent[i].pg < first)
+            first = ent[i].pg;
+        if (ent[i].pg > last)
+            last = ent[i].pg;
+    }
+
+    if (first >= 0) {
+        if (posix_memalign((void **)&job.src, info->sec_size,
+                            (size_t)(last - first + 1) * info->pln_pg_size)) {
+            printf("Could not allocate compression memory.\n");
+            goto out;
+        }
+        if (lnvm_page_io(tgt_fd, info, READ, job.src, blk_id, first,
+                                                        last - first + 1)) {
+            printf("  Could not perform IO on pages %d:%d.\n", first, last);
+            goto out;
+        }
+        job.first_pg = first;
+    }
+
+    lz_run(&job, lz_decompress_worker);
+    ret = job.bad;
+
+out:
+    free(job.src);
+    free(ent);
+    return ret;
+}
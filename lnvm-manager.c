@@ -20,7 +20,7 @@
 #include <linux/types.h>
 #include "lnvm-manager.h"
 
-static int get_dev_info(char * tgt_name, struct nvm_dev_info *info)
+int get_dev_info(char * tgt_name, struct nvm_dev_info *info)
 {
     static struct nvm_ioctl_dev_prop *dev_prop;
     static struct nvm_ioctl_tgt_info tgt_info; 
@@ -28,7 +28,7 @@ static int get_dev_info(char * tgt_name, struct nvm_dev_info *info)
     int ret = 0;
 
     sprintf(tgt_info.target.tgtname, "%s", tgt_name);
-    ret = nvm_get_target_info(&tgt_info);
+    ret = nvm_be->get_target_info(&tgt_info);
     if (ret) {
         printf("nvm_get_target_info error. Failed to get target info.\n");
         goto out;
@@ -36,7 +36,7 @@ static int get_dev_info(char * tgt_name, struct nvm_dev_info *info)
 
     strncpy(dev_ioctl_info.dev, tgt_info.target.dev, DISK_NAME_LEN);
 
-    ret = nvm_get_device_info(&dev_ioctl_info);
+    ret = nvm_be->get_device_info(&dev_ioctl_info);
     if (ret)
         goto out;
 
@@ -46,8 +46,29 @@ static int get_dev_info(char * tgt_name, struct nvm_dev_info *info)
     info->page_size = info->sec_size * dev_prop->sec_per_page;
     info->pln_pg_size = info->page_size * dev_prop->nr_planes;
     info->pg_sec_ratio = info->pln_pg_size / info->sec_size;
-
-    info->pg_per_blk = PGS_PER_BLK;
+    info->max_sec_io = dev_prop->max_sec_io;
+    info->nr_luns = dev_prop->nr_luns;
+
+    info->pg_per_blk = (nvm_be->pg_per_blk) ?
+                            nvm_be->pg_per_blk(dev_ioctl_info.dev) : 0;
+    /* Without the real geometry, keep the offsets data was written at */
+    info->layout = (info->pg_per_blk) ? LAYOUT_LINEAR : LAYOUT_ORIG;
+
+    info->io_pages = 1;
+    info->io_depth = SCHED_DEPTH;
+    info->io_luns = dev_prop->nr_luns;
+    tune_load(dev_ioctl_info.dev, info);
+
+    if (!info->pg_per_blk)
+        info->pg_per_blk = PGS_PER_BLK;
+    if (info->io_pages > max_io_pages(info))
+        info->io_pages = max_io_pages(info);
+    if (!info->io_pages)
+        info->io_pages = 1;
+    if (!info->io_depth)
+        info->io_depth = 1;
+    if (!info->io_luns)
+        info->io_luns = 1;
 out:
     return ret;
 }
@@ -59,13 +80,37 @@ static void lnvm_show_info(struct arguments *args)
 
     memset(&c, 0, sizeof(struct nvm_ioctl_info));
     
-    ret = nvm_get_info(&c);
+    ret = nvm_be->get_info(&c);
     if(ret){
         printf("nvm_get_info error. Do you have root privilegies? "
                                         "If yes, look to 'dmesg'. %d\n",ret);
         return;
     }                     
 
+    if (args->out_fmt == FMT_JSON) {
+        printf("{\"version\":[%u,%u,%u],\"types\":[", c.version[0],
+                                                c.version[1], c.version[2]);
+        for (i = 0; i < c.tgtsize; i++) {
+            struct nvm_ioctl_tgt_info *tgt = &c.tgts[i];
+            printf("%s{\"name\":", (i) ? "," : "");
+            json_str(tgt->target.tgtname);
+            printf(",\"version\":[%u,%u,%u]}", tgt->version[0],
+                                        tgt->version[1], tgt->version[2]);
+        }
+        printf("]}\n");
+        return;
+    }
+
+    if (args->out_fmt == FMT_CSV) {
+        printf("type,version\n");
+        for (i = 0; i < c.tgtsize; i++) {
+            csv_str(c.tgts[i].target.tgtname);
+            printf(",%u.%u.%u\n", c.tgts[i].version[0],
+                            c.tgts[i].version[1], c.tgts[i].version[2]);
+        }
+        return;
+    }
+
     printf("\n### LNVM TARGET TYPES ###\n");
     printf(" LightNVM version (%u, %u, %u). %u target type(s) registered.\n",
                             c.version[0],c.version[1],c.version[2],c.tgtsize);
@@ -78,31 +123,147 @@ static void lnvm_show_info(struct arguments *args)
     printf("\n");
 }
 
+static void dev_print_json(struct nvm_dev_list *l)
+{
+    int i, j, n;
+
+    printf("{\"devices\":[");
+    for (i = 0; i < l->nr_devs; i++) {
+        struct nvm_dev_entry *d = &l->devs[i];
+        struct nvm_ioctl_dev_prop *p = &d->info.prop;
+        uint32_t pg_size = p->sec_size * p->sec_per_page;
+
+        printf("%s{\"name\":", (i) ? "," : "");
+        json_str(d->info.dev);
+        if (d->ret) {
+            printf(",\"error\":true}");
+            continue;
+        }
+        printf(",\"bm\":");
+        json_str(d->info.bmname);
+        printf(",\"bm_version\":[%u,%u,%u],\"sec_size\":%u,"
+            "\"sec_per_page\":%u,\"page_size\":%u,\"pln_pg_size\":%u,"
+            "\"nr_planes\":%u,\"nr_luns\":%u,\"nr_channels\":%u,"
+            "\"plane_mode\":%u,\"max_sec_io\":%u,\"oob_size\":%u,"
+            "\"pg_per_blk\":%u,\"targets\":[",
+            d->info.bmversion[0], d->info.bmversion[1], d->info.bmversion[2],
+            p->sec_size, p->sec_per_page, pg_size, pg_size * p->nr_planes,
+            p->nr_planes, p->nr_luns, p->nr_channels, p->plane_mode,
+            p->max_sec_io, p->oob_size, d->pg_per_blk);
+        for (j = 0, n = 0; j < l->nr_tgts; j++) {
+            struct nvm_ioctl_tgt_info *t = &l->tgts[j];
+
+            if (strcmp(t->target.dev, d->info.dev))
+                continue;
+            printf("%s{\"name\":", (n++) ? "," : "");
+            json_str(t->target.tgtname);
+            printf(",\"type\":");
+            json_str(t->target.tgttype);
+            printf(",\"version\":[%u,%u,%u]}", t->version[0], t->version[1],
+                                                                t->version[2]);
+        }
+        printf("]}");
+    }
+    printf("]}\n");
+}
+
+/* Targets of a device as name:type pairs separated by ';', NULL if out of
+ * memory */
+static char *dev_csv_tgts(struct nvm_dev_list *l, const char *dev)
+{
+    size_t len = 1, off = 0;
+    char *tgts;
+    int j;
+
+    for (j = 0; j < l->nr_tgts; j++)
+        if (strcmp(l->tgts[j].target.dev, dev) == 0)
+            len += strlen(l->tgts[j].target.tgtname) +
+                                strlen(l->tgts[j].target.tgttype) + 2;
+
+    tgts = malloc(len);
+    if (!tgts)
+        return NULL;
+
+    tgts[0] = '\0';
+    for (j = 0; j < l->nr_tgts; j++) {
+        if (strcmp(l->tgts[j].target.dev, dev))
+            continue;
+        off += snprintf(tgts + off, len - off, "%s%s:%s", (off) ? ";" : "",
+                    l->tgts[j].target.tgtname, l->tgts[j].target.tgttype);
+    }
+
+    return tgts;
+}
+
+static void dev_print_csv(struct nvm_dev_list *l)
+{
+    char *tgts;
+    int i;
+
+    printf("device,bm,bm_version,sec_size,sec_per_page,page_size,"
+            "pln_pg_size,nr_planes,nr_luns,nr_channels,plane_mode,"
+            "max_sec_io,oob_size,pg_per_blk,targets\n");
+
+    for (i = 0; i < l->nr_devs; i++) {
+        struct nvm_dev_entry *d = &l->devs[i];
+        struct nvm_ioctl_dev_prop *p = &d->info.prop;
+        uint32_t pg_size = p->sec_size * p->sec_per_page;
+
+        csv_str(d->info.dev);
+        if (d->ret) {
+            printf(",,,,,,,,,,,,,,\n");
+            continue;
+        }
+        putchar(',');
+        csv_str(d->info.bmname);
+        printf(",%u.%u.%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,",
+            d->info.bmversion[0], d->info.bmversion[1], d->info.bmversion[2],
+            p->sec_size, p->sec_per_page, pg_size, pg_size * p->nr_planes,
+            p->nr_planes, p->nr_luns, p->nr_channels, p->plane_mode,
+            p->max_sec_io, p->oob_size, d->pg_per_blk);
+        /* Quoted as one field */
+        tgts = dev_csv_tgts(l, d->info.dev);
+        if (!tgts) {
+            fprintf(stderr, "Could not allocate memory.\n");
+            printf("\n");
+            continue;
+        }
+        csv_str(tgts);
+        printf("\n");
+        free(tgts);
+    }
+}
+
 static void lnvm_show_devices(struct arguments *args)
 {
-    struct nvm_ioctl_get_devices devs;
-    int ret, i;
+    struct nvm_dev_list l;
+    int i, j;
 
-    ret = nvm_get_devices(&devs);
-    if (ret) {
-        printf("nvm_get_devices error. Do you have root privilegies? "
-                                    "If yes, look to 'dmesg'. %d\n",ret);        
+    if (dev_scan(&l))
         return;
+
+    if (args->out_fmt == FMT_JSON) {
+        dev_print_json(&l);
+        goto out;
+    }
+    if (args->out_fmt == FMT_CSV) {
+        dev_print_csv(&l);
+        goto out;
     }
 
     printf("\n### LNVM DEVICES ###\n");
-    printf(" nr_devices: %u\n", devs.nr_devices);
+    printf(" nr_devices: %u\n", l.nr_devs);
 
-    for (i = 0; i < devs.nr_devices && i < 31; i++) {
-        struct nvm_ioctl_dev_info *dev = &devs.info[i];
-        struct nvm_ioctl_dev_info info;
+    for (i = 0; i < l.nr_devs; i++) {
+        struct nvm_ioctl_dev_info *dev = &l.devs[i].info;
+        struct nvm_ioctl_dev_info info = *dev;
         uint32_t pg_size, pln_pg_size;
         
-        strncpy(info.dev, dev->dev, DISK_NAME_LEN);
-        ret = nvm_get_device_info(&info); 
-        if(ret){
-            printf("nvm_get_device_info error.\n");
-        }        
+        if (l.devs[i].ret) {
+            printf("\n  Device: %s\n", dev->dev);
+            printf("   nvm_get_device_info error.\n");
+            continue;
+        }
 
         // Calculated values
         pg_size = info.prop.sec_size * info.prop.sec_per_page;
@@ -121,8 +282,17 @@ static void lnvm_show_devices(struct arguments *args)
         printf("   Plane mode: %d\n",info.prop.plane_mode);
         printf("   max_sec_io: %d\n",info.prop.max_sec_io);
         printf("   oob_size: %d\n",info.prop.oob_size); 
+        printf("   Targets:");
+        for (j = 0; j < l.nr_tgts; j++)
+            if (strcmp(l.tgts[j].target.dev, dev->dev) == 0)
+                printf(" %s (%s)", l.tgts[j].target.tgtname,
+                                                l.tgts[j].target.tgttype);
+        printf("\n");
     }
     printf("\n");
+
+out:
+    dev_list_free(&l);
 }
 
 static void lnvm_create_tgt(struct arguments *args)
@@ -140,7 +310,7 @@ static void lnvm_create_tgt(struct arguments *args)
 
     printf("\n### LNVM CREATE TARGET ###\n");
 
-    ret = nvm_create_target(&c);
+    ret = nvm_be->create_target(&c);
 
     if(ret) {
         printf(" nvm_create_target ERROR. Do you have root privilegies? "
@@ -163,7 +333,7 @@ static void lnvm_remove_tgt(struct arguments *args)
 
     printf("\n### LNVM REMOVE TARGET ###\n");
 
-    ret = nvm_remove_target(&c);
+    ret = nvm_be->remove_target(&c);
 
     if(ret){
         printf("nvm_remove_target error. Do you have root privilegies? "
@@ -182,9 +352,10 @@ static void lnvm_show_tgt_info(struct arguments *args)
 
     sprintf(tgt.target.tgtname, "%s", args->tgt_name);
     
-    printf("\n### LNVM TARGET INFO ###\n");
+    if (args->out_fmt == FMT_HUMAN)
+        printf("\n### LNVM TARGET INFO ###\n");
 
-    ret = nvm_get_target_info(&tgt);
+    ret = nvm_be->get_target_info(&tgt);
 
     if (ret) {
         printf("nvm_get_target_info error. Do you have root privilegies? "
@@ -192,6 +363,29 @@ static void lnvm_show_tgt_info(struct arguments *args)
         return;
     }
     
+    if (args->out_fmt == FMT_JSON) {
+        printf("{\"name\":");
+        json_str(tgt.target.tgtname);
+        printf(",\"type\":");
+        json_str(tgt.target.tgttype);
+        printf(",\"version\":[%u,%u,%u],\"device\":", tgt.version[0],
+                                            tgt.version[1], tgt.version[2]);
+        json_str(tgt.target.dev);
+        printf("}\n");
+        return;
+    }
+
+    if (args->out_fmt == FMT_CSV) {
+        printf("name,type,version,device\n");
+        csv_str(tgt.target.tgtname);
+        putchar(',');
+        csv_str(tgt.target.tgttype);
+        printf(",%u.%u.%u,", tgt.version[0], tgt.version[1], tgt.version[2]);
+        csv_str(tgt.target.dev);
+        printf("\n");
+        return;
+    }
+
     printf("\n Target File: /dev/%s\n",tgt.target.tgtname);
     printf(" Target Type: %s (%u, %u, %u)\n", tgt.target.tgttype, 
                             tgt.version[0],tgt.version[1],tgt.version[2]);
@@ -202,6 +396,8 @@ static void lnvm_show_tgt_info(struct arguments *args)
 
 static void lnvm_put_blk(struct arguments *args)
 {
+    struct nvm_dd dd = { .fd = -1 };
+    struct nvm_dev_info info;
     NVM_VBLOCK *vblk;
     int tgt_fd;
     int ret;
@@ -210,7 +406,7 @@ static void lnvm_put_blk(struct arguments *args)
 
     printf("\n### LNVM PUT BLOCK ###\n");
 
-    tgt_fd = nvm_target_open(args->putblk_tgt, 0x0);
+    tgt_fd = nvm_be->target_open(args->putblk_tgt, 0x0);
     if (tgt_fd < 0) {
         printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
                                                             args->getblk_tgt);
@@ -218,18 +414,43 @@ static void lnvm_put_blk(struct arguments *args)
     }
 
 
-    ret = nvm_put_block(tgt_fd, vblk);
+    /* Pages of other blocks may be deduplicated to this one */
+    if (args->putblk_dd) {
+        ret = get_dev_info(args->putblk_tgt, &info);
+        if (ret) {
+            printf("nvm_dev_info error. Failed to get device info.\n");
+            goto close;
+        }
+        ret = dd_open(&dd, args->putblk_dd, &info);
+        if (ret)
+            goto close;
+        ret = dd_put(&dd, tgt_fd, vblk);
+        dd_close(&dd);
+    } else
+        ret = nvm_be->put_block(tgt_fd, vblk);
+
+    if (ret > 0) {
+        printf("\n Block %llu holds %d page(s) that other blocks map to in "
+                        "%s, it was not freed.\n\n", vblk->id, ret,
+                                                            args->putblk_dd);
+        goto close;
+    }
     if (ret) {
         printf("nvm_put_block error. Could not put block %llu to LUN %u.\n",
                                                     vblk->id, vblk->vlun_id);
-        return;
+        goto close;
     }
 
-    nvm_target_close(tgt_fd);
+    if (page_cache) {
+        cache_bind(tgt_fd, args->putblk_tgt, NULL);
+        cache_inval_blk(page_cache, tgt_fd, vblk->id);
+    }
 
     printf("\n Block %llu from LUN %u has been succesfully freed.\n",
                                                     vblk->id, vblk->vlun_id);
     printf("\n");
+close:
+    nvm_be->target_close(tgt_fd);
 }
 
 static void lnvm_get_blk(struct arguments *args)
@@ -242,20 +463,20 @@ static void lnvm_get_blk(struct arguments *args)
     
     printf("\n### LNVM GET BLOCK ###\n");
 
-    tgt_fd = nvm_target_open(args->getblk_tgt, 0x0);
+    tgt_fd = nvm_be->target_open(args->getblk_tgt, 0x0);
     if (tgt_fd < 0) {
         printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
                                                             args->getblk_tgt);
         return;
     }
 
-    ret = nvm_get_block(tgt_fd, vblk->vlun_id, vblk);
+    ret = nvm_be->get_block(tgt_fd, vblk->vlun_id, vblk);
     if (ret) {
         printf("nvm_get_block error. 'dmesg' for further info.\n");
         return;
     }
 
-    nvm_target_close(tgt_fd);
+    nvm_be->target_close(tgt_fd);
 
     printf("\n A block has been succesfully allocated.\n");
     printf(" LUN: %d\n", vblk->vlun_id);
@@ -265,7 +486,7 @@ static void lnvm_get_blk(struct arguments *args)
     printf("\n");
 }
 
-static void write_prepare(struct nvm_io_info *io, struct nvm_dev_info *info,
+void write_prepare(struct nvm_io_info *io, struct nvm_dev_info *info,
                                                             uint8_t verbose)
 {
     char *current;
@@ -347,16 +568,152 @@ static void write_prepare(struct nvm_io_info *io, struct nvm_dev_info *info,
     }
 }
 
+/* Fill the write buffer with the content of a file, zeroed past its end */
+static int write_load(struct nvm_io_info *io, struct nvm_dev_info *info,
+                                                            const char *path)
+{
+    size_t len = (size_t) info->pln_pg_size * io->nr_pages, n;
+    FILE *in;
+
+    in = fopen(path, "r");
+    if (!in) {
+        printf("Could not open %s.\n", path);
+        return -1;
+    }
+
+    n = fread(io->buf_data, 1, len, in);
+    if (ferror(in)) {
+        printf("Could not read %s.\n", path);
+        fclose(in);
+        return -1;
+    }
+    memset(io->buf_data + n, 0, len - n);
+    fclose(in);
+
+    return 0;
+}
+
+/* Line 'i' of a page written by write_prepare() */
+static void pattern_line(char *line, int i, int pg_lines, uint32_t blk_id,
+                                                            int pg, char fill)
+{
+    char aux[16];
+
+    if (i == 0 || i == pg_lines - 1) {
+        memset(line, '#', 63);
+        line[63] = '\n';
+        return;
+    }
+
+    memset(line + 1, (i <= 5) ? ' ' : fill, 61);
+    if (i == 2 || i == 4) {
+        sprintf(aux, (i == 2) ? "BLOCK %d" : "PAGE %d",
+                                            (i == 2) ? (int) blk_id : pg);
+        memcpy(line + 24, aux, strlen(aux));
+    }
+    line[0] = '|';
+    line[62] = '|';
+    line[63] = '\n';
+}
+
+/* Check a page against the pattern written by write_prepare() */
+int pattern_check(char *page, struct nvm_dev_info *info, uint32_t blk_id,
+                                                                    int pg)
+{
+    int pg_lines = info->pln_pg_size / 64;
+    char line[64];
+    char fill;
+    size_t i;
+
+    /* Erased or never written */
+    for (i = 1; i < info->pln_pg_size && page[i] == page[0]; i++);
+    if (i == info->pln_pg_size)
+        return 0;
+
+    /* Every filler line repeats the same printable character */
+    fill = (pg_lines > 7) ? page[64 * 6 + 1] : '!';
+    if (fill < 33 || fill > 125)
+        return 1;
+
+    for (i = 0; i < pg_lines; i++) {
+        pattern_line(line, i, pg_lines, blk_id, pg, fill);
+        if (memcmp(page + 64 * i, line, 64))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* First sector of a plane page. The original layout only scales the page
+ * by the sectors per plane page, and a block starts pg_per_blk sectors
+ * after the previous one. With the geometry known, blocks are laid out
+ * back to back. */
+size_t page_ppa(struct nvm_dev_info *info, uint32_t blk_id, int pg)
+{
+    if (info->layout == LAYOUT_ORIG)
+        return (size_t) blk_id * info->pg_per_blk +
+                                        (size_t) pg * info->pg_sec_ratio;
+
+    return ((size_t) blk_id * info->pg_per_blk + pg) * info->pg_sec_ratio;
+}
+
+/* Largest I/O the device accepts (max_sec_io), in plane pages */
+int max_io_pages(struct nvm_dev_info *info)
+{
+    if (!info->max_sec_io)
+        return info->pg_per_blk;
+
+    return (info->max_sec_io < info->pg_sec_ratio) ? 1 :
+                                    info->max_sec_io / info->pg_sec_ratio;
+}
+
+/* Read or write nr_pages plane pages from sector ppa on, with as few calls
+ * as max_sec_io allows */
+static int ppa_io(int tgt_fd, struct nvm_dev_info *info, uint8_t direction,
+                                        char *buf, size_t ppa, int nr_pages)
+{
+    int n, max = max_io_pages(info);
+    size_t len;
+    off_t off;
+    ssize_t ret;
+
+    for (; nr_pages > 0; nr_pages -= n, ppa += info->pg_sec_ratio * n,
+                                                                buf += len) {
+        n = (nr_pages < max) ? nr_pages : max;
+        len = (size_t) info->pln_pg_size * n;
+        off = (off_t) ppa * info->sec_size;
+
+        qos_admit(tgt_fd, len);
+
+        ret = (direction) ? nvm_be->pwrite(tgt_fd, buf, len, off) :
+                            nvm_be->pread(tgt_fd, buf, len, off);
+        if (ret != len)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Read or write nr_pages consecutive plane pages of a block */
+int lnvm_page_io(int tgt_fd, struct nvm_dev_info *info, uint8_t direction,
+                            char *buf, uint32_t blk_id, int pg, int nr_pages)
+{
+    return ppa_io(tgt_fd, info, direction, buf, page_ppa(info, blk_id, pg),
+                                                                    nr_pages);
+}
+
 static int io_prepare(struct nvm_io_info *io, struct nvm_dev_info *info)
 {
     int ret;
 
-    io->tgt_fd = nvm_target_open(io->tgt_name, 0x0);
+    io->tgt_fd = nvm_be->target_open(io->tgt_name, 0x0);
     if (io->tgt_fd < 0) {
         printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
                                                                 io->tgt_name);
         return -1;
     } 
+    qos_bind(io->tgt_fd, io->tgt_name);
+    cache_bind(io->tgt_fd, io->tgt_name, info);
 
     ret = posix_memalign((void **)&io->buf_data, info->sec_size, 
                                           info->pln_pg_size * io->nr_pages + 1);
@@ -367,16 +724,25 @@ static int io_prepare(struct nvm_io_info *io, struct nvm_dev_info *info)
     }
     
     io->bytes_trans = 0;
-    io->current_ppa = io->blk_id * info->pg_per_blk + io->start_pg;  
+    io->current_ppa = page_ppa(info, io->blk_id, io->start_pg);
+    /* The original tool did not scale the start page of a range */
+    if (info->layout == LAYOUT_ORIG)
+        io->current_ppa -= (size_t) io->start_pg * (info->pg_sec_ratio - 1);
     io->left_pages = io->nr_pages;
 
     return 0;
 }
 
-static int lnvm_io (struct nvm_io_info *io, struct nvm_dev_info *info, 
+int lnvm_io (struct nvm_io_info *io, struct nvm_dev_info *info, 
                                 uint8_t direction, struct arguments *args)
 {   
-    int ret;
+    struct nvm_csum cs = { .fd = -1 };
+    struct nvm_lz lz = { .fd = -1 };
+    struct nvm_dd dd = { .fd = -1 };
+    struct nvm_ra ra;
+    uint32_t *gens = NULL;
+    int use_ra = 0, at_pg;
+    int ret, pg, i, n;
 
     io->blk_id = args->io_blkid;
     io->tgt_name = args->io_tgt;
@@ -402,12 +768,133 @@ static int lnvm_io (struct nvm_io_info *io, struct nvm_dev_info *info,
         goto clean;
     }
 
+    if (args->io_flag & IOARGC) {
+        ret = csum_open(&cs, args->io_csum, info);
+        if (ret)
+            goto clean;
+    }
+
+    if (args->io_lz) {
+        /* Checksums cover plane pages, compressed ones are not in place */
+        if (args->io_flag & IOARGC) {
+            printf("Checksums and compression cannot be combined.\n");
+            ret = 1;
+            goto clean;
+        }
+        ret = lz_open(&lz, args->io_lz, info);
+        if (ret)
+            goto clean;
+    }
+
+    if (args->io_dd) {
+        if (args->io_lz) {
+            printf("Deduplication and compression cannot be combined.\n");
+            ret = 1;
+            goto clean;
+        }
+        /* Nor with checksums: deduplicated pages are not in place */
+        if (args->io_flag & IOARGC) {
+            printf("Checksums and deduplication cannot be combined.\n");
+            ret = 1;
+            goto clean;
+        }
+        ret = dd_open(&dd, args->io_dd, info);
+        if (ret)
+            goto clean;
+    }
+
     ret = io_prepare(io, info);
     if (ret)
         goto clean;
+
+    /* Ranges at the original offsets only go through the page loop */
+    at_pg = (io->current_ppa == page_ppa(info, io->blk_id, io->start_pg));
   
-    if(direction == WRITE)
+    if (direction == WRITE && args->io_file) {
+        ret = write_load(io, info, args->io_file);
+        if (ret) {
+            ret = 1;
+            goto clean;
+        }
+    } else if(direction == WRITE)
         write_prepare(io, info, args->io_flag & IOARGV);
+    else if (lz.fd < 0 && dd.fd < 0 && !args->io_evl && at_pg &&
+                                                io->nr_pages > RA_TRIGGER)
+        use_ra = (ra_init(&ra, io->tgt_fd, info) == 0);
+
+    /* Cache generations of the pages of a request, taken before reading */
+    if (page_cache && direction == READ) {
+        gens = calloc(info->io_pages, sizeof(uint32_t));
+        if (!gens) {
+            ret = 1;
+            goto clean;
+        }
+    }
+
+    if (lz.fd >= 0) {
+        ret = (direction) ?
+              lz_write(&lz, io->tgt_fd, io->blk_id, io->start_pg,
+                                                io->nr_pages, io->buf_data):
+              lz_read(&lz, io->tgt_fd, io->blk_id, io->start_pg,
+                                                io->nr_pages, io->buf_data);
+        if (ret < 0) {
+            ret = 1;
+            goto clean;
+        }
+        if (direction == READ && ret > 0) {
+            printf("  %d page(s) failed to decompress in block %d.\n", ret,
+                                                                io->blk_id);
+            ret = 1;
+            goto clean;
+        }
+        if (direction == WRITE && (args->io_flag & IOARGV))
+            printf(" %d page(s) compressed into %d plane page(s).\n",
+                                                        io->nr_pages, ret);
+        io->bytes_trans = info->pln_pg_size * io->nr_pages;
+        io->left_pages = 0;
+    }
+
+    if (dd.fd >= 0) {
+        ret = (direction) ?
+              dd_write(&dd, io->tgt_fd, io->blk_id, io->start_pg,
+                                                io->nr_pages, io->buf_data):
+              dd_read(&dd, io->tgt_fd, io->blk_id, io->start_pg,
+                                                io->nr_pages, io->buf_data);
+        if (ret < 0) {
+            ret = 1;
+            goto clean;
+        }
+        if (direction == READ && ret > 0) {
+            printf("  %d page(s) changed since they were written in block "
+                                                "%d.\n", ret, io->blk_id);
+            ret = 1;
+            goto clean;
+        }
+        if (direction == WRITE && (args->io_flag & IOARGV))
+            printf(" %d page(s) already on the device, %d programmed.\n",
+                                                ret, io->nr_pages - ret);
+        io->bytes_trans = info->pln_pg_size * io->nr_pages;
+        io->left_pages = 0;
+    }
+
+    /* All the requests in flight at once, completed through an eventfd */
+    if (args->io_evl && at_pg && io->left_pages > 0) {
+        ret = evl_pages(io->tgt_fd, info, direction, io->buf_data,
+                                    io->blk_id, io->start_pg, io->nr_pages);
+        if (ret) {
+            ret = 1;
+            goto clean;
+        }
+        if (direction == WRITE) {
+            stats_add(io->tgt_fd, STATS_HOST,
+                                (size_t) info->pln_pg_size * io->nr_pages);
+            if (page_cache)
+                cache_inval(page_cache, io->tgt_fd, io->blk_id, io->start_pg,
+                                                                io->nr_pages);
+        }
+        io->bytes_trans = info->pln_pg_size * io->nr_pages;
+        io->left_pages = 0;
+    }
 
     while(io->left_pages > 0){
         //sleep(1);
@@ -415,30 +902,82 @@ static int lnvm_io (struct nvm_io_info *io, struct nvm_dev_info *info,
         io->buf_offset = io->buf_data + ( ( io->nr_pages - io->left_pages ) 
                                                     * info->pln_pg_size );
 
-        ret = (direction)?pwrite(io->tgt_fd, io->buf_offset, info->pln_pg_size,
-                                io->current_ppa * info->sec_size):
-                          pread(io->tgt_fd, io->buf_offset, info->pln_pg_size,
-                                io->current_ppa * info->sec_size);
-        //printf("  buf: %#018llx, current_ppa: %lu, offset: %lu\n", 
-        //    (long long unsigned int) io->buf_offset, io->current_ppa, 
-        //                                    io->current_ppa * info->sec_size);
-        if (ret != info->pln_pg_size) {
-            printf("  Could not perform IO on page %d.\n", 
-                                io->nr_pages - io->left_pages + io->start_pg);
+        pg = io->nr_pages - io->left_pages + io->start_pg;
+        n = 1;
+
+        if (page_cache && at_pg && direction == READ &&
+                cache_get(page_cache, io->tgt_fd, io->blk_id, pg,
+                                                        io->buf_offset)) {
+            /* Still a read of the stream for read-ahead */
+            if (use_ra)
+                ra_note(&ra, io->blk_id, pg);
+            goto next;
+        }
+
+        /* Requests of io_pages pages, as tuned for the device */
+        if (!use_ra)
+            n = (io->left_pages < info->io_pages) ? io->left_pages :
+                                                            info->io_pages;
+
+        if (gens && !use_ra)
+            for (i = 0; i < n; i++)
+                gens[i] = cache_gen(page_cache, io->tgt_fd, io->blk_id,
+                                                                    pg + i);
+
+        ret = (use_ra) ?
+              ra_read(&ra, io->blk_id, pg, io->buf_offset, gens) :
+              ppa_io(io->tgt_fd, info, direction, io->buf_offset,
+                                                        io->current_ppa, n);
+        if (ret) {
+            printf("  Could not perform IO on page %d.\n", pg);
             ret = 1;
             goto clean;
         }
-        io->bytes_trans += ret;
+        if (direction == WRITE)
+            stats_add(io->tgt_fd, STATS_HOST, (size_t) info->pln_pg_size * n);
+
+        if (page_cache && !at_pg) {
+            if (direction == WRITE)
+                cache_inval_blk(page_cache, io->tgt_fd, io->blk_id);
+        } else if (page_cache) {
+            if (direction == READ)
+                for (i = 0; i < n; i++)
+                    cache_put(page_cache, io->tgt_fd, io->blk_id, pg + i,
+                            io->buf_offset + i * info->pln_pg_size, gens[i]);
+            else
+                cache_inval(page_cache, io->tgt_fd, io->blk_id, pg, n);
+        }
+next:
+        io->bytes_trans += info->pln_pg_size * n;
     
         //printf("  Page %d succesfull.\n",info->pg_per_blk - io->left_pages);
 
-        io->current_ppa += info->pg_sec_ratio;
-        io->left_pages--; 
+        io->current_ppa += info->pg_sec_ratio * n;
+        io->left_pages -= n;
     }
     ret = 0;
 
+    if (cs.fd >= 0) {
+        ret = (direction) ?
+              csum_store(&cs, io->blk_id, io->start_pg, io->nr_pages,
+                                                                io->buf_data):
+              csum_verify(&cs, io->blk_id, io->start_pg, io->nr_pages,
+                                                                io->buf_data);
+        if (ret > 0)
+            printf("  %d page(s) failed checksum verification in block %d.\n",
+                                                            ret, io->blk_id);
+        if (ret)
+            ret = 1;
+    }
+
 clean:
-    nvm_target_close(io->tgt_fd);    
+    if (use_ra)
+        ra_free(&ra);
+    free(gens);
+    csum_close(&cs);
+    lz_close(&lz);
+    dd_close(&dd);
+    nvm_be->target_close(io->tgt_fd);    
     return ret;
 }
 
@@ -509,19 +1048,33 @@ char doc_global[] = "\n*** LNVM MANAGER ***\n"
       "   getblock        Get a block from a specific LUN (mark as in-use)\n"
       "   putblock        Free a block (mark as free, it can be erased)\n"
       "   write           Write data to a block\n"
-      "   read            Read data from a block\n";
+      "   read            Read data from a block\n"
+      "   scrub           Verify written blocks in the background\n"
+      "   append          Pack small records into the pages of a block\n"
+      "   copy            Copy pages or whole blocks between LUNs\n"
+      "   bench           Benchmark the I/O paths of the tool\n"
+      "   apply           Create/remove targets to match a spec file\n"
+      "   tune            Probe a target and save its I/O profile\n"
+      "   stats           Show device traffic and write amplification\n";
 
 struct argp argp = {NULL, parse_opt, "lnvm [<cmd> [cmd-options]]",
                                                             doc_global};
 int main(int argc, char **argv)
 {
     struct arguments args = { 0 };
+    int ret = 0;
 
     args.lun_begin=0;
     args.lun_end=0;
+    args.app_timeout = WBUF_DEFAULT_TIMEOUT;
+    args.bench_reps = BENCH_DEFAULT_REPS;
+    args.bench_thresh = BENCH_DEFAULT_THRESH;
 
     argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &args);
 
+    if (backend_init() || qos_init())
+        return 1;
+
     switch (args.cmdtype)
     {
         case LNVM_INFO:
@@ -551,9 +1104,30 @@ int main(int argc, char **argv)
         case LNVM_READ:
             lnvm_read(&args);
             break;
+        case LNVM_SCRUB:
+            lnvm_scrub(&args);
+            break;
+        case LNVM_APPEND:
+            lnvm_append(&args);
+            break;
+        case LNVM_COPY:
+            lnvm_copy(&args);
+            break;
+        case LNVM_BENCH:
+            ret = lnvm_bench(&args);
+            break;
+        case LNVM_APPLY:
+            ret = lnvm_apply(&args);
+            break;
+        case LNVM_TUNE:
+            lnvm_tune(&args);
+            break;
+        case LNVM_STATS:
+            lnvm_stats(&args);
+            break;
         default:
             printf("Invalid command.\n");            
     }
 
-    return 0;
+    return ret;
 }
@@ -2,6 +2,8 @@
 #define LNVM_H
 
 #include <linux/types.h>
+#include <sys/types.h>
+#include <pthread.h>
 #include <liblightnvm.h>
 
 /* pg_per_blk should come from the kernel, we wait for this */
@@ -12,8 +14,20 @@ struct nvm_dev_info {
     uint32_t page_size;
     uint32_t pln_pg_size;
     uint32_t max_sec_io;
+    uint32_t nr_luns;
     uint16_t pg_per_blk;
     uint16_t pg_sec_ratio;
+    uint8_t layout;
+    /* Tuned I/O profile (see lnvm-tune.c) */
+    uint16_t io_pages;
+    uint16_t io_depth;
+    uint16_t io_luns;
+};
+
+/* Where the pages of a block are on the target (see page_ppa()) */
+enum page_layout {
+    LAYOUT_ORIG = 0,
+    LAYOUT_LINEAR
 };
 
 struct nvm_io_info {
@@ -29,6 +43,579 @@ struct nvm_io_info {
     uint32_t bytes_trans;
 };
 
+/* Device backend: liblightnvm, or the simulator (see lnvm-backend.c) */
+struct nvm_backend {
+    const char *name;
+    int (*get_info)(struct nvm_ioctl_info *);
+    int (*get_devices)(struct nvm_ioctl_get_devices *);
+    int (*get_device_info)(struct nvm_ioctl_dev_info *);
+    int (*create_target)(struct nvm_ioctl_tgt_create *);
+    int (*remove_target)(struct nvm_ioctl_tgt_remove *);
+    int (*get_target_info)(struct nvm_ioctl_tgt_info *);
+    int (*target_open)(const char *, int);
+    void (*target_close)(int);
+    int (*get_block)(int, uint32_t, NVM_VBLOCK *);
+    int (*put_block)(int, NVM_VBLOCK *);
+    ssize_t (*pread)(int, void *, size_t, off_t);
+    ssize_t (*pwrite)(int, const void *, size_t, off_t);
+    /* Pages per block of a device, 0 if the backend cannot tell */
+    uint32_t (*pg_per_blk)(const char *);
+    /* Fill up to 'max' online targets, returns how many */
+    int (*get_targets)(struct nvm_ioctl_tgt_info *, int max);
+};
+
+/* Output formats of 'info', 'dev' and 'tgt' */
+enum out_fmt {
+    FMT_HUMAN = 0,
+    FMT_JSON,
+    FMT_CSV
+};
+
+/* Device enumeration (see lnvm-dev.c) */
+#define DEV_WORKERS     16
+#define DEV_MAX_TGTS    1024
+
+struct nvm_dev_entry {
+    struct nvm_ioctl_dev_info info;
+    uint32_t pg_per_blk;
+    int ret;
+};
+
+struct nvm_dev_list {
+    struct nvm_dev_entry *devs;
+    int nr_devs;
+    struct nvm_ioctl_tgt_info *tgts;
+    int nr_tgts;
+};
+
+/* Simulated device defaults (see lnvm-sim.c) */
+#define SIM_DEV_NAME        "sim0"
+#define SIM_TGT_NAME        "sim"
+#define SIM_MAX_TGTS        16
+#define SIM_READ_US         50
+#define SIM_PROG_US         500
+#define SIM_ERASE_US        3000
+
+/* Device traffic accounting (see lnvm-stats.c) */
+#define STATS_DEFAULT_DIR   "/var/lib/lnvm"
+#define STATS_MAGIC         0x4c4e5354
+#define STATS_MAX_TGTS      64
+#define STATS_MAX_FDS       1024
+
+enum stats_ctr {
+    STATS_HOST = 0,
+    STATS_PROG,
+    STATS_PAD,
+    STATS_COPY,
+    STATS_READ,
+    STATS_GETS,
+    STATS_PUTS,
+    STATS_NR
+};
+
+/* QoS token buckets of a target, shared by the processes using it */
+struct nvm_qos_bucket {
+    uint64_t iops_tat;
+    uint64_t bw_tat;
+    uint64_t last_ns;
+};
+
+struct nvm_stats {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t since;
+    uint64_t ctr[STATS_NR];
+    /* Foreground page I/O and its device time, watched by scrub */
+    uint64_t fg_ios;
+    uint64_t fg_ns;
+    struct nvm_qos_bucket qos;
+};
+
+/* I/O autotuning (see lnvm-tune.c) */
+#define TUNE_DEFAULT_CONF   "/etc/lnvm/tune.conf"
+#define TUNE_PROBE_PAGES    64
+#define TUNE_MAX_DEPTH      16
+#define TUNE_MAX_THREADS    256
+#define TUNE_MAX_POINTS     16
+#define TUNE_REPS           3
+#define TUNE_KNEE           10
+
+/* Target provisioning from a spec file (see lnvm-apply.c) */
+#define APPLY_MAX_TGTS          256
+
+/* Benchmarks (see lnvm-bench.c) */
+#define BENCH_NAME_LEN          32
+#define BENCH_MAX_RES           64
+#define BENCH_GETPUT            64
+#define BENCH_SIZES             { 1, 8, 32 }
+#define BENCH_DEPTHS            { 1, 4, 16 }
+#define BENCH_MAX_DEPTH         16
+#define BENCH_DEFAULT_REPS      7
+#define BENCH_MAX_REPS          31
+#define BENCH_MIN_MS            100
+#define BENCH_NOISE             3
+#define BENCH_DEFAULT_THRESH    10
+#define BENCH_EVL_CLIENTS       256
+#define BENCH_EVL_OPS           65536
+
+/* Default flush timeout of the write coalescing buffer in ms */
+#define WBUF_DEFAULT_TIMEOUT    100
+
+/* Default scrub bandwidth cap in MB/s */
+#define SCRUB_DEFAULT_RATE  32
+#define SCRUB_DEPTH         4
+#define SCRUB_SAMPLE_MS     100
+
+/* Per-page checksum side table (see lnvm-crc.c) */
+#define CSUM_MAGIC      0x4c4e4353
+#define CSUM_BATCH      64
+#define CSUM_VALID      0x1
+
+struct nvm_csum_hdr {
+    uint32_t magic;
+    uint32_t pln_pg_size;
+    uint32_t pg_per_blk;
+    uint32_t reserved;
+};
+
+struct nvm_csum_ent {
+    uint32_t crc;
+    uint16_t flags;
+    uint16_t errs;
+};
+
+struct nvm_csum {
+    int fd;
+    uint32_t pln_pg_size;
+    uint16_t pg_per_blk;
+};
+
+/* Compressed page mode (see lnvm-lz4.c) */
+#define LZ_IDX_MAGIC    0x4c4e5a49
+#define LZ_PG_MAGIC     0x4c4e5a50
+#define LZ_ALIGN        8
+#define LZ_RAW          0x80000000
+#define LZ_MAX_WORKERS  16
+
+struct nvm_lz_idx_hdr {
+    uint32_t magic;
+    uint32_t pln_pg_size;
+    uint32_t pg_per_blk;
+    uint32_t reserved;
+};
+
+struct nvm_lz_blk {
+    uint32_t next_pg;           /* next plane page to program */
+    uint32_t puts;              /* puts of the block when it was written */
+};
+
+struct nvm_lz_ent {
+    uint16_t pg;                /* plane page holding the logical page */
+    uint16_t off;               /* record offset, in LZ_ALIGN units */
+    uint32_t len;               /* compressed length or LZ_RAW, 0 if unset */
+};
+
+/* Header of a packed plane page, each record follows a nvm_lz_rec */
+struct nvm_lz_pg {
+    uint32_t magic;
+    uint16_t nr_recs;
+    uint16_t reserved;
+};
+
+struct nvm_lz_rec {
+    uint32_t pg;
+    uint32_t len;
+};
+
+struct nvm_lz {
+    int fd;
+    struct nvm_dev_info *info;
+};
+
+/* Page deduplication (see lnvm-dedup.c) */
+#define DD_MAGIC        0x4c4e4432
+#define DD_SLOTS        (1 << 20)
+#define DD_PROBE        16
+#define DD_VALID        0x1
+
+struct nvm_dd_hdr {
+    uint32_t magic;
+    uint32_t pln_pg_size;
+    uint32_t pg_per_blk;
+    uint32_t nr_slots;
+};
+
+/* Fingerprint index slot: where a page content was last programmed */
+struct nvm_dd_slot {
+    uint64_t fp;
+    uint32_t blk;
+    uint16_t pg;
+    uint16_t used;
+};
+
+struct nvm_dd_blk {
+    uint32_t next_pg;           /* next plane page to program */
+    uint32_t puts;              /* puts of the block when it was written */
+};
+
+/* Page map entry: plane page holding the data of a logical page */
+struct nvm_dd_ent {
+    uint64_t fp;
+    uint32_t blk;
+    uint32_t puts;              /* puts of blk when the entry was set */
+    uint16_t pg;
+    uint16_t flags;
+    uint32_t reserved;
+};
+
+struct nvm_dd {
+    int fd;
+    struct nvm_dev_info *info;
+    struct nvm_dd_slot *slots;
+    uint32_t nr_slots;
+};
+
+/* Block pre-allocation pool (see lnvm-pool.c) */
+#define POOL_RING       64
+#define POOL_LOW        2
+#define POOL_HIGH       8
+#define POOL_POLL_MS    100
+
+struct nvm_pool_cell {
+    uint64_t seq;
+    NVM_VBLOCK vblk;
+};
+
+struct nvm_pool_lun {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t lun;
+    uint8_t failing;
+    struct nvm_pool_cell cells[POOL_RING];
+};
+
+struct nvm_pool {
+    int tgt_fd;
+    struct nvm_ckpt *ck;
+    uint32_t lun_begin;
+    uint32_t nr_luns;
+    struct nvm_pool_lun *luns;
+    uint32_t low;
+    uint32_t high;
+    uint64_t allocs;
+    uint64_t stalls;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int stop;
+};
+
+/* Checkpoint of the append writer state (see lnvm-ckpt.c) */
+#define CKPT_MAGIC      0x4c4e434b
+#define CKPT_MAX_BLKS   4096
+#define CKPT_INTERVAL   256
+#define CKPT_NONE       0xffffffff
+
+enum ckpt_state {
+    CKPT_FREE = 0,
+    CKPT_POOLED,
+    CKPT_OPEN,
+    CKPT_FULL,
+};
+
+enum ckpt_op {
+    CKPT_OP_POOL = 1,           /* block allocated into the pool */
+    CKPT_OP_OPEN,               /* block opened for writing at pg */
+    CKPT_OP_PROG,               /* page pg programmed */
+    CKPT_OP_PUT,                /* block given back */
+};
+
+struct nvm_ckpt_blk {
+    uint64_t id;
+    uint32_t lun;
+    uint16_t state;
+    uint16_t next_pg;
+    uint64_t nr_recs;
+    uint64_t host_bytes;
+};
+
+struct nvm_ckpt_img {
+    uint64_t gen;
+    uint32_t crc;
+    uint32_t nr_blks;
+    uint32_t open;              /* index of the open block or CKPT_NONE */
+    uint32_t reserved;
+    struct nvm_ckpt_blk blks[CKPT_MAX_BLKS];
+};
+
+struct nvm_ckpt_hdr {
+    uint32_t magic;
+    uint32_t pln_pg_size;
+    uint32_t pg_per_blk;
+    uint32_t max_blks;
+};
+
+struct nvm_ckpt_rec {
+    uint64_t gen;
+    uint64_t id;
+    uint32_t lun;
+    uint16_t op;
+    uint16_t pg;
+    uint32_t nr_recs;
+    uint32_t bytes;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+struct nvm_ckpt {
+    int fd;
+    int log_fd;
+    struct nvm_ckpt_img *img;   /* both images, mapped from the file */
+    struct nvm_ckpt_img *cur;   /* current state */
+    uint32_t nr_log;
+    uint32_t replayed;
+    pthread_mutex_t lock;
+};
+
+/* Write coalescing buffer of an open block (see lnvm-wbuf.c) */
+struct nvm_rec_addr {
+    uint32_t blk_id;
+    uint32_t pg;
+    uint32_t off;
+    uint32_t len;
+};
+
+struct nvm_wbuf {
+    int tgt_fd;
+    struct nvm_dev_info *info;
+    struct nvm_csum *cs;
+    struct nvm_pool *pool;
+    struct nvm_ckpt *ck;
+    uint32_t lun;
+    uint32_t blk_id;
+    int next_pg;
+    char *page;
+    uint32_t fill;
+    uint32_t page_recs;
+    uint64_t first;
+    uint32_t timeout_ms;
+    uint32_t nr_blks;
+    uint64_t nr_recs;
+    uint64_t host_bytes;
+    uint64_t pad_bytes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t timer;
+    int stop;
+};
+
+/* Read cache of plane pages (see lnvm-cache.c) */
+#define CACHE_SHARDS    16
+#define CACHE_MAX_TGTS  64
+#define CACHE_MAX_FDS   1024
+
+struct nvm_cache_frame {
+    uint64_t key;
+    uint32_t next;
+    uint8_t valid;
+    uint8_t ref;
+};
+
+struct nvm_cache_shard {
+    pthread_mutex_t lock;
+    uint32_t *buckets;
+    uint32_t *gens;
+    uint32_t nr_buckets;
+    struct nvm_cache_frame *frames;
+    uint32_t nr_frames;
+    uint32_t hand;
+    char *data;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct nvm_cache {
+    uint32_t pg_size;
+    uint16_t pg_per_blk;
+    uint32_t nr_shards;
+    struct nvm_cache_shard *shards;
+    char *slab;
+};
+
+/* Sequential read-ahead (see lnvm-ra.c) */
+#define RA_TRIGGER      2
+#define RA_MIN_WINDOW   2
+#define RA_MAX_WINDOW   32
+#define RA_SLOTS        (RA_MAX_WINDOW * 2)
+#define RA_STREAMS      4
+#define RA_WORKERS      4
+
+struct nvm_ra_stream {
+    uint32_t blk_id;
+    int last_pg;
+    int next_pg;
+    int seq;
+    int window;
+    uint64_t used;
+};
+
+struct nvm_ra_slot {
+    uint32_t blk_id;
+    int pg;
+    int state;
+    uint32_t gen;
+    uint64_t order;
+    char *buf;
+};
+
+struct nvm_ra {
+    int tgt_fd;
+    struct nvm_dev_info *info;
+    struct nvm_ra_stream streams[RA_STREAMS];
+    struct nvm_ra_slot slots[RA_SLOTS];
+    char *data;
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t workers[RA_WORKERS];
+    int nr_workers;
+    int stop;
+};
+
+/* Per-LUN read-priority scheduler (see lnvm-sched.c) */
+#define SCHED_DEPTH         4
+#define SCHED_WR_MAX        2
+#define SCHED_WR_EXPIRE_MS  500
+
+struct nvm_sched_req {
+    uint32_t lun;
+    uint8_t dir;
+    char *buf;
+    uint32_t blk_id;
+    int pg;
+    int nr_pages;
+    uint64_t deadline;
+    int ret;
+    int done;
+    void (*end_io)(struct nvm_sched_req *);
+    void *priv;
+    struct nvm_sched_req *next;
+};
+
+struct nvm_sched_lun {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct nvm_sched_req *rq_head;
+    struct nvm_sched_req *rq_tail;
+    struct nvm_sched_req *wq_head;
+    struct nvm_sched_req *wq_tail;
+    int wr_inflight;
+    uint32_t *wr_blks;          /* blocks of the writes in flight */
+    uint64_t expired;
+    int stop;
+};
+
+struct nvm_sched {
+    int tgt_fd;
+    struct nvm_dev_info *info;
+    uint32_t nr_luns;
+    struct nvm_sched_lun *luns;
+    int depth;
+    int wr_max;
+    uint64_t wr_expire;
+    pthread_t *workers;
+    void *wargs;
+    int nr_workers;
+};
+
+/* Event loop mode (see lnvm-evl.c) */
+#define EVL_MAX_REACTORS    16
+#define EVL_MAX_EVENTS      64
+
+struct nvm_evl_fd {
+    int fd;
+    void (*fn)(struct nvm_evl_fd *, uint32_t events);
+    void *priv;
+};
+
+struct nvm_evl_req {
+    uint32_t lun;
+    uint8_t dir;
+    char *buf;
+    uint32_t blk_id;
+    int pg;
+    int nr_pages;
+    int ret;
+    int efd;                    /* signalled on completion if >= 0 */
+    void (*end_io)(struct nvm_evl_req *);  /* run on the reactor */
+    void *priv;
+    struct nvm_sched_req srq;
+    struct nvm_evl_reactor *r;
+    struct nvm_evl_req *next;
+};
+
+struct nvm_evl_reactor {
+    struct nvm_evl *evl;
+    int epfd;
+    int sub_fd;
+    int cpl_fd;
+    struct nvm_evl_fd sub_ev;
+    struct nvm_evl_fd cpl_ev;
+    struct nvm_evl_req *sub __attribute__((aligned(64)));
+    struct nvm_evl_req *cpl __attribute__((aligned(64)));
+    uint64_t nr_reqs __attribute__((aligned(64)));
+    uint64_t wakeups;
+    pthread_t thread;
+};
+
+struct nvm_evl {
+    struct nvm_sched sched;
+    struct nvm_evl_reactor *r;
+    int nr_reactors;
+    int next;
+    int stop;
+};
+
+/* Per-target QoS (see lnvm-qos.c) */
+#define QOS_DEFAULT_CONF    "/etc/lnvm/qos.conf"
+#define QOS_MAX_CLASSES     64
+#define QOS_MAX_WORKERS     64
+#define QOS_MAX_FDS         1024
+#define QOS_BURST_NS        10000000ULL
+
+struct nvm_qos_acct {
+    uint64_t ios;
+    uint64_t bytes;
+    uint64_t throttled_ns;
+} __attribute__((aligned(64)));
+
+struct nvm_qos_class {
+    char name[DISK_NAME_LEN];
+    uint64_t iops;
+    uint64_t bw;
+    uint32_t weight;
+    struct nvm_qos_bucket *bkt;
+    struct nvm_qos_acct acct[QOS_MAX_WORKERS];
+};
+
+/* Block copy (see lnvm-copy.c) */
+#define COPY_DEPTH      8
+#define COPY_MAX_JOBS   64
+
+struct nvm_copy {
+    uint32_t src_lun;
+    uint32_t src_blk;
+    uint32_t dst_lun;
+    uint32_t dst_blk;
+    int start_pg;
+    int nr_pages;
+};
+
 enum io_dir {
     READ = 0,
     WRITE
@@ -43,7 +630,14 @@ enum cmdtypes {
     LNVM_GETBLK,
     LNVM_PUTBLK,
     LNVM_WRITE,
-    LNVM_READ
+    LNVM_READ,
+    LNVM_SCRUB,
+    LNVM_APPEND,
+    LNVM_COPY,
+    LNVM_BENCH,
+    LNVM_APPLY,
+    LNVM_TUNE,
+    LNVM_STATS
 };
 
 enum ioargs_flags {
@@ -51,7 +645,10 @@ enum ioargs_flags {
     IOARGN = 2,
     IOARGS = 4,
     IOARGP = 8,
-    IOARGV = 16
+    IOARGV = 16,
+    IOARGC = 32,
+    IOARGR = 64,
+    IOARGL = 128
 };
 
 struct arguments
@@ -77,14 +674,223 @@ struct arguments
     int         putblk_argn;
     NVM_VBLOCK  putblk_vblk;
     char        putblk_tgt[DISK_NAME_LEN];
+    char        *putblk_dd;
     /* CMD IO WRITE/READ */
     char        io_tgt[DISK_NAME_LEN];
     uint32_t    io_blkid;
     uint32_t    io_pgstart;
     uint32_t    io_nrpages; 
     uint8_t     io_flag;
+    char        *io_csum;
+    char        *io_lz;
+    char        *io_dd;
+    char        *io_file;
+    uint8_t     io_evl;
+    /* CMD SCRUB */
+    char        scrub_tgt[DISK_NAME_LEN];
+    char        *scrub_csum;
+    uint32_t    scrub_blkid;
+    uint32_t    scrub_rate;
+    uint8_t     scrub_flag;
+    /* CMD APPEND */
+    char        app_tgt[DISK_NAME_LEN];
+    uint32_t    app_blkid;
+    uint32_t    app_pgstart;
+    uint32_t    app_timeout;
+    uint32_t    app_lun;
+    char        *app_file;
+    char        *app_csum;
+    char        *app_ckpt;
+    uint8_t     app_flag;
+    /* CMD COPY */
+    char        cp_tgt[DISK_NAME_LEN];
+    struct nvm_copy cp[COPY_MAX_JOBS];
+    int         cp_nr;
+    uint32_t    cp_pgstart;
+    uint32_t    cp_nrpages;
+    char        *cp_csum;
+    uint8_t     cp_flag;
+    /* CMD INFO, DEV, TGT, STATS */
+    uint8_t     out_fmt;
+    /* CMD BENCH */
+    char        bench_tgt[DISK_NAME_LEN];
+    char        *bench_out;
+    char        *bench_base;
+    uint32_t    bench_thresh;
+    int         bench_reps;
+    uint8_t     bench_flag;
+    /* CMD APPLY */
+    char        *apply_file;
+    uint8_t     apply_dry;
+    /* CMD TUNE */
+    char        tune_tgt[DISK_NAME_LEN];
+    uint8_t     tune_dry;
+    /* CMD STATS */
+    char        stats_tgt[DISK_NAME_LEN];
+    uint32_t    stats_interval;
+    uint8_t     stats_reset;
 };
 
 error_t parse_opt (int, char *, struct argp_state *);
 
+/* lnvm-backend.c */
+extern struct nvm_backend *nvm_be;
+int backend_init(void);
+
+/* lnvm-sim.c */
+extern struct nvm_backend sim_backend;
+int sim_init(const char *conf);
+
+/* lnvm-manager.c */
+int get_dev_info(char * tgt_name, struct nvm_dev_info *info);
+size_t page_ppa(struct nvm_dev_info *info, uint32_t blk_id, int pg);
+int max_io_pages(struct nvm_dev_info *info);
+int lnvm_page_io(int tgt_fd, struct nvm_dev_info *info, uint8_t direction,
+                            char *buf, uint32_t blk_id, int pg, int nr_pages);
+int pattern_check(char *page, struct nvm_dev_info *info, uint32_t blk_id,
+                                                                    int pg);
+void write_prepare(struct nvm_io_info *io, struct nvm_dev_info *info,
+                                                            uint8_t verbose);
+int lnvm_io(struct nvm_io_info *io, struct nvm_dev_info *info,
+                                uint8_t direction, struct arguments *args);
+
+/* lnvm-crc.c */
+uint32_t lnvm_crc32c(const void *buf, size_t len);
+int csum_open(struct nvm_csum *cs, const char *path, struct nvm_dev_info *info);
+void csum_close(struct nvm_csum *cs);
+uint32_t csum_nr_blocks(struct nvm_csum *cs);
+int csum_load(struct nvm_csum *cs, uint32_t blk_id, struct nvm_csum_ent *ent);
+int csum_store(struct nvm_csum *cs, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+int csum_verify(struct nvm_csum *cs, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+
+/* lnvm-lz4.c */
+int lz_open(struct nvm_lz *lz, const char *path, struct nvm_dev_info *info);
+void lz_close(struct nvm_lz *lz);
+int lz_write(struct nvm_lz *lz, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+int lz_read(struct nvm_lz *lz, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+
+/* lnvm-dedup.c */
+uint64_t dd_hash(const void *buf, size_t len);
+int dd_open(struct nvm_dd *dd, const char *path, struct nvm_dev_info *info);
+void dd_close(struct nvm_dd *dd);
+int dd_write(struct nvm_dd *dd, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+int dd_read(struct nvm_dd *dd, int tgt_fd, uint32_t blk_id, int start_pg,
+                                                    int nr_pages, char *buf);
+int dd_put(struct nvm_dd *dd, int tgt_fd, NVM_VBLOCK *vblk);
+
+/* lnvm-scrub.c */
+void lnvm_scrub(struct arguments *args);
+
+/* lnvm-cache.c */
+extern struct nvm_cache *page_cache;
+int cache_init(struct nvm_cache *c, size_t bytes, uint32_t pg_size,
+                                                        uint16_t pg_per_blk);
+void cache_free(struct nvm_cache *c);
+void cache_bind(int tgt_fd, const char *tgt_name, struct nvm_dev_info *info);
+void cache_unbind(int tgt_fd);
+int cache_get(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                                                char *dst);
+uint32_t cache_gen(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg);
+void cache_put(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                            const char *src, uint32_t gen);
+void cache_inval(struct nvm_cache *c, int tgt_fd, uint32_t blk_id, int pg,
+                                                                int nr_pages);
+void cache_inval_blk(struct nvm_cache *c, int tgt_fd, uint32_t blk_id);
+void cache_stats(struct nvm_cache *c, uint64_t *hits, uint64_t *misses,
+                                                        uint64_t *evictions);
+
+/* lnvm-ra.c */
+int ra_init(struct nvm_ra *ra, int tgt_fd, struct nvm_dev_info *info);
+void ra_free(struct nvm_ra *ra);
+int ra_read(struct nvm_ra *ra, uint32_t blk_id, int pg, char *dst,
+                                                            uint32_t *gen);
+void ra_note(struct nvm_ra *ra, uint32_t blk_id, int pg);
+
+/* lnvm-sched.c */
+int sched_init(struct nvm_sched *s, int tgt_fd, struct nvm_dev_info *info,
+                            uint32_t nr_luns, int depth, int wr_max);
+void sched_free(struct nvm_sched *s);
+int sched_submit(struct nvm_sched *s, struct nvm_sched_req *rq);
+int sched_wait(struct nvm_sched *s, struct nvm_sched_req *rq);
+int sched_io(struct nvm_sched *s, uint32_t lun, uint8_t direction, char *buf,
+                                    uint32_t blk_id, int pg, int nr_pages);
+
+/* lnvm-evl.c */
+int evl_init(struct nvm_evl *evl, int tgt_fd, struct nvm_dev_info *info,
+                                        uint32_t nr_luns, int nr_reactors);
+void evl_free(struct nvm_evl *evl);
+void evl_submit(struct nvm_evl *evl, struct nvm_evl_req *rq);
+int evl_add_fd(struct nvm_evl *evl, struct nvm_evl_fd *f, uint32_t events);
+int evl_pages(int tgt_fd, struct nvm_dev_info *info, uint8_t direction,
+                            char *buf, uint32_t blk_id, int pg, int nr_pages);
+
+/* lnvm-qos.c */
+int qos_init(void);
+void qos_bind(int tgt_fd, const char *tgt_name);
+void qos_unbind(int tgt_fd);
+void qos_admit(int tgt_fd, size_t bytes);
+void qos_stats(const char *tgt_name, uint64_t *ios, uint64_t *bytes,
+                                                    uint64_t *throttled_ns);
+
+/* lnvm-pool.c */
+int pool_init(struct nvm_pool *p, int tgt_fd, uint32_t lun_begin,
+                                uint32_t lun_end, uint32_t low, uint32_t high,
+                                struct nvm_ckpt *ck);
+void pool_free(struct nvm_pool *p);
+int pool_get(struct nvm_pool *p, uint32_t lun, NVM_VBLOCK *vblk);
+
+/* lnvm-dev.c */
+int dev_scan(struct nvm_dev_list *l);
+void dev_list_free(struct nvm_dev_list *l);
+void json_str(const char *s);
+void csv_str(const char *s);
+
+/* lnvm-stats.c */
+void stats_wrap(void);
+void stats_add(int tgt_fd, int ctr, uint64_t n);
+void stats_background(int tgt_fd);
+int stats_fg(int tgt_fd, uint64_t *ios, uint64_t *ns);
+int stats_get(const char *tgt, struct nvm_stats *out);
+int stats_reset(const char *tgt);
+double stats_waf(struct nvm_stats *st);
+int stats_blk_puts(int tgt_fd, uint64_t blk_id, uint32_t *puts);
+struct nvm_qos_bucket *stats_qos(const char *tgt);
+void lnvm_stats(struct arguments *args);
+
+/* lnvm-tune.c */
+void tune_load(const char *dev, struct nvm_dev_info *info);
+void lnvm_tune(struct arguments *args);
+
+/* lnvm-apply.c */
+int lnvm_apply(struct arguments *args);
+
+/* lnvm-bench.c */
+int lnvm_bench(struct arguments *args);
+
+/* lnvm-copy.c */
+void lnvm_copy(struct arguments *args);
+
+/* lnvm-ckpt.c */
+int ckpt_open(struct nvm_ckpt *ck, const char *path, struct nvm_dev_info *info);
+void ckpt_close(struct nvm_ckpt *ck);
+int ckpt_log(struct nvm_ckpt *ck, int op, uint64_t id, uint32_t lun, int pg,
+                                            uint32_t nr_recs, uint32_t bytes);
+int ckpt_save(struct nvm_ckpt *ck);
+int ckpt_resume(struct nvm_ckpt *ck, struct nvm_ckpt_blk *open);
+int ckpt_release(struct nvm_ckpt *ck, int tgt_fd);
+
+/* lnvm-wbuf.c */
+int wbuf_init(struct nvm_wbuf *wb, int tgt_fd, struct nvm_dev_info *info,
+                    uint32_t blk_id, int start_pg, uint32_t timeout_ms);
+int wbuf_append(struct nvm_wbuf *wb, const void *data, uint32_t len,
+                                                struct nvm_rec_addr *addr);
+int wbuf_sync(struct nvm_wbuf *wb);
+void wbuf_free(struct nvm_wbuf *wb);
+void lnvm_append(struct arguments *args);
+
 #endif /* LNVM_H */
@@ -0,0 +1,285 @@
+/*  Block pre-allocation pool for lnvm-manager.
+
+    A background thread keeps, for every LUN of the pool, between 'low'
+    and 'high' blocks already allocated with nvm_get_block(). Writers
+    take their next block with pool_get(), a lock-free pop from the
+    LUN's ring, instead of waiting on the ioctl. pool_init() fills the
+    rings before it returns, so the first blocks are there too. Only when
+    a ring is empty does pool_get() fall back to a synchronous
+    nvm_get_block().
+
+    A LUN that stops handing out blocks is reported on stderr once, and
+    again once it recovers, not on every refill round.
+
+    The rings are bounded multi-producer/multi-consumer queues where each
+    cell carries a sequence number telling whether it is ready to be
+    written or read for the current lap.
+
+    Blocks still in the pool are put back by pool_free(). With a
+    checkpoint (see lnvm-ckpt.c), every block allocated or put back is
+    logged, so a restart finds the blocks a crashed run had pooled.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+static int ring_push(struct nvm_pool_lun *pl, NVM_VBLOCK *vblk)
+{
+    struct nvm_pool_cell *cell;
+    uint64_t pos, seq;
+    int64_t dif;
+
+    pos = __atomic_load_n(&pl->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &pl->cells[pos & (POOL_RING - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pl->tail, &pos, pos + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&pl->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->vblk = *vblk;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int ring_pop(struct nvm_pool_lun *pl, NVM_VBLOCK *vblk)
+{
+    struct nvm_pool_cell *cell;
+    uint64_t pos, seq;
+    int64_t dif;
+
+    pos = __atomic_load_n(&pl->head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &pl->cells[pos & (POOL_RING - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (int64_t) seq - (int64_t) (pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pl->head, &pos, pos + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&pl->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    *vblk = cell->vblk;
+    __atomic_store_n(&cell->seq, pos + POOL_RING, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static uint32_t ring_count(struct nvm_pool_lun *pl)
+{
+    uint64_t tail = __atomic_load_n(&pl->tail, __ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&pl->head, __ATOMIC_RELAXED);
+
+    return (tail > head) ? tail - head : 0;
+}
+
+static int pool_alloc(struct nvm_pool *p, uint32_t lun, NVM_VBLOCK *vblk)
+{
+    memset(vblk, 0, sizeof(*vblk));
+    vblk->vlun_id = lun;
+    vblk->flags |= NVM_PROV_SPEC_LUN;
+    vblk->owner_id = 101;
+
+    if (nvm_be->get_block(p->tgt_fd, lun, vblk))
+        return -1;
+
+    if (ckpt_log(p->ck, CKPT_OP_POOL, vblk->id, lun, 0, 0, 0)) {
+        nvm_be->put_block(p->tgt_fd, vblk);
+        return -1;
+    }
+
+    __atomic_fetch_add(&p->allocs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Top a LUN up to the high watermark */
+static void pool_fill(struct nvm_pool *p, struct nvm_pool_lun *pl)
+{
+    NVM_VBLOCK vblk;
+
+    while (ring_count(pl) < p->high) {
+        if (pool_alloc(p, pl->lun, &vblk)) {
+            if (!pl->failing)
+                fprintf(stderr, "nvm_get_block error. Could not pre-allocate "
+                                        "a block from LUN %u.\n", pl->lun);
+            pl->failing = 1;
+            return;
+        }
+        if (pl->failing)
+            fprintf(stderr, " Pre-allocating from LUN %u again.\n",
+                                                                pl->lun);
+        pl->failing = 0;
+
+        if (ring_push(pl, &vblk)) {
+            nvm_be->put_block(p->tgt_fd, &vblk);
+            ckpt_log(p->ck, CKPT_OP_PUT, vblk.id, pl->lun, 0, 0, 0);
+            return;
+        }
+    }
+}
+
+static void *pool_refill(void *arg)
+{
+    struct nvm_pool *p = arg;
+    struct nvm_pool_lun *pl;
+    struct timespec ts;
+    uint32_t i;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop) {
+        pthread_mutex_unlock(&p->lock);
+
+        /* Top up to the high watermark once below the low one */
+        for (i = 0; i < p->nr_luns; i++) {
+            pl = &p->luns[i];
+            if (ring_count(pl) < p->low)
+                pool_fill(p, pl);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (p->stop)
+            break;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += POOL_POLL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/* Give the blocks of every ring back to the device */
+static void pool_drain(struct nvm_pool *p)
+{
+    NVM_VBLOCK vblk;
+    uint32_t i;
+
+    for (i = 0; i < p->nr_luns; i++) {
+        while (ring_pop(&p->luns[i], &vblk) == 0) {
+            if (nvm_be->put_block(p->tgt_fd, &vblk))
+                fprintf(stderr, "nvm_put_block error. Could not put block "
+                        "%llu to LUN %u.\n", (unsigned long long) vblk.id,
+                        vblk.vlun_id);
+            ckpt_log(p->ck, CKPT_OP_PUT, vblk.id, vblk.vlun_id, 0, 0, 0);
+        }
+    }
+}
+
+int pool_init(struct nvm_pool *p, int tgt_fd, uint32_t lun_begin,
+                                uint32_t lun_end, uint32_t low, uint32_t high,
+                                struct nvm_ckpt *ck)
+{
+    struct nvm_pool_lun *pl;
+    uint32_t i, j;
+
+    memset(p, 0, sizeof(*p));
+    p->tgt_fd = tgt_fd;
+    p->ck = ck;
+    p->lun_begin = lun_begin;
+    p->nr_luns = lun_end - lun_begin + 1;
+    p->high = (high < POOL_RING) ? high : POOL_RING;
+    p->low = (low < p->high) ? low : p->high;
+
+    if (posix_memalign((void **)&p->luns, 64,
+                                p->nr_luns * sizeof(struct nvm_pool_lun))) {
+        fprintf(stderr, "Could not allocate block pool memory.\n");
+        p->luns = NULL;
+        return -1;
+    }
+    memset(p->luns, 0, p->nr_luns * sizeof(struct nvm_pool_lun));
+
+    for (i = 0; i < p->nr_luns; i++) {
+        pl = &p->luns[i];
+        pl->lun = lun_begin + i;
+        for (j = 0; j < POOL_RING; j++)
+            pl->cells[j].seq = j;
+    }
+
+    /* Filled here so the first pool_get() does not wait on the device */
+    for (i = 0; i < p->nr_luns; i++)
+        pool_fill(p, &p->luns[i]);
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+
+    if (pthread_create(&p->thread, NULL, pool_refill, p)) {
+        fprintf(stderr, "Could not start block pool thread.\n");
+        pool_drain(p);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->wake);
+        free(p->luns);
+        p->luns = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Give every pooled block back to the device */
+void pool_free(struct nvm_pool *p)
+{
+    if (!p->luns)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+
+    pool_drain(p);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->luns);
+    p->luns = NULL;
+}
+
+int pool_get(struct nvm_pool *p, uint32_t lun, NVM_VBLOCK *vblk)
+{
+    struct nvm_pool_lun *pl;
+
+    if (lun < p->lun_begin || lun - p->lun_begin >= p->nr_luns) {
+        fprintf(stderr, "LUN %u is not in the block pool.\n", lun);
+        return -1;
+    }
+    pl = &p->luns[lun - p->lun_begin];
+
+    if (ring_pop(pl, vblk) == 0) {
+        if (ring_count(pl) < p->low)
+            pthread_cond_signal(&p->wake);
+        return 0;
+    }
+
+    /* Pool ran dry, allocate in place */
+    __atomic_fetch_add(&p->stalls, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&p->wake);
+
+    if (pool_alloc(p, lun, vblk)) {
+        fprintf(stderr, "nvm_get_block error. 'dmesg' for further info.\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*  Per-target QoS for lnvm-manager.
+
+    Limits are read from a config file (LNVM_QOS, default
+    /etc/lnvm/qos.conf), one target per line:
+
+        # name    limits
+        device    bw=800
+        mydev     iops=5000 bw=200 weight=1
+        logs      bw=50 weight=2
+
+    'iops' and 'bw' (MB/s) cap a target on their own. The 'device' line
+    sets a bandwidth budget that active targets (those with I/O in the
+    last second) share in proportion to their weight.
+
+    Every limit is a GCRA token bucket: a theoretical arrival time that
+    submitters advance with a single compare-and-swap, then sleep off
+    whatever exceeds the burst allowance. The buckets and the time of the
+    last I/O of a target live in its stats file (see lnvm-stats.c), so
+    the limits and the weighted shares hold across all the processes
+    using the target. I/O and byte counts are kept in per-worker slots of
+    the process so the submission path takes no lock.
+
+    A config file that exists but cannot be read or parsed is an error:
+    qos_init() reports it and the command fails rather than running
+    unlimited.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+static struct nvm_qos_class qos_classes[QOS_MAX_CLASSES];
+static int qos_nr_classes;
+static uint64_t qos_dev_bw;
+static struct nvm_qos_bucket qos_own[QOS_MAX_CLASSES];
+static struct nvm_qos_class *qos_fd_class[QOS_MAX_FDS];
+static pthread_once_t qos_once = PTHREAD_ONCE_INIT;
+static int qos_err;
+static uint32_t qos_next_worker;
+static __thread int qos_worker = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts));
+}
+
+static int qos_parse_line(char *line, int lineno)
+{
+    struct nvm_qos_class *c;
+    char *tok, *save;
+    char *name;
+
+    tok = strchr(line, '#');
+    if (tok)
+        *tok = '\0';
+
+    name = strtok_r(line, " \t\n", &save);
+    if (!name)
+        return 0;
+
+    if (strcmp(name, "device") == 0) {
+        while ((tok = strtok_r(NULL, " \t\n", &save))) {
+            if (strncmp(tok, "bw=", 3) == 0)
+                qos_dev_bw = strtoull(tok + 3, NULL, 10) * 1024 * 1024;
+            else
+                goto bad;
+        }
+        return 0;
+    }
+
+    if (qos_nr_classes == QOS_MAX_CLASSES || strlen(name) >= DISK_NAME_LEN) {
+        fprintf(stderr, "QoS config line %d: too many targets or name too "
+                                                        "long.\n", lineno);
+        return -1;
+    }
+
+    c = &qos_classes[qos_nr_classes];
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, name);
+    c->weight = 1;
+
+    while ((tok = strtok_r(NULL, " \t\n", &save))) {
+        if (strncmp(tok, "iops=", 5) == 0)
+            c->iops = strtoull(tok + 5, NULL, 10);
+        else if (strncmp(tok, "bw=", 3) == 0)
+            c->bw = strtoull(tok + 3, NULL, 10) * 1024 * 1024;
+        else if (strncmp(tok, "weight=", 7) == 0)
+            c->weight = strtoul(tok + 7, NULL, 10);
+        else
+            goto bad;
+    }
+    if (!c->weight)
+        c->weight = 1;
+
+    qos_nr_classes++;
+    return 0;
+
+bad:
+    fprintf(stderr, "QoS config line %d: unknown setting '%s'.\n", lineno,
+                                                                        tok);
+    return -1;
+}
+
+static void qos_load(void)
+{
+    const char *path = getenv("LNVM_QOS");
+    char line[256];
+    FILE *fp;
+    int i, lineno = 0;
+
+    if (!path)
+        path = QOS_DEFAULT_CONF;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT)
+            return;
+        fprintf(stderr, "Could not open QoS config %s.\n", path);
+        qos_err = -1;
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (qos_parse_line(line, ++lineno)) {
+            fprintf(stderr, "Invalid QoS config %s.\n", path);
+            qos_nr_classes = 0;
+            qos_dev_bw = 0;
+            qos_err = -1;
+            break;
+        }
+    }
+    fclose(fp);
+
+    for (i = 0; i < qos_nr_classes; i++) {
+        qos_classes[i].bkt = stats_qos(qos_classes[i].name);
+        if (!qos_classes[i].bkt)
+            qos_classes[i].bkt = &qos_own[i];
+    }
+}
+
+/* Load the config, -1 if it is there but unusable */
+int qos_init(void)
+{
+    pthread_once(&qos_once, qos_load);
+
+    return qos_err;
+}
+
+/* Apply the limits of a target to I/O issued on tgt_fd */
+void qos_bind(int tgt_fd, const char *tgt_name)
+{
+    int i;
+
+    pthread_once(&qos_once, qos_load);
+
+    if (tgt_fd < 0 || tgt_fd >= QOS_MAX_FDS)
+        return;
+
+    qos_fd_class[tgt_fd] = NULL;
+    for (i = 0; i < qos_nr_classes; i++) {
+        if (strcmp(qos_classes[i].name, tgt_name) == 0) {
+            qos_fd_class[tgt_fd] = &qos_classes[i];
+            break;
+        }
+    }
+}
+
+/* A closed fd: the next target to get it is not limited as this one */
+void qos_unbind(int tgt_fd)
+{
+    if (tgt_fd >= 0 && tgt_fd < QOS_MAX_FDS)
+        qos_fd_class[tgt_fd] = NULL;
+}
+
+/* Advance a GCRA bucket by cost_ns, returns how long to wait */
+static uint64_t gcra_reserve(uint64_t *tat, uint64_t now, uint64_t cost_ns)
+{
+    uint64_t old, new;
+
+    old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    do {
+        new = ((old > now) ? old : now) + cost_ns;
+    } while (!__atomic_compare_exchange_n(tat, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return (new > now + QOS_BURST_NS) ? new - now - QOS_BURST_NS : 0;
+}
+
+/* Bandwidth of a class: its own cap, lowered to its weighted share of the
+ * device budget among the targets active in the last second */
+static uint64_t qos_class_bw(struct nvm_qos_class *c, uint64_t now)
+{
+    uint64_t share, active = 0;
+    int i;
+
+    if (!qos_dev_bw)
+        return c->bw;
+
+    for (i = 0; i < qos_nr_classes; i++) {
+        if (now - __atomic_load_n(&qos_classes[i].bkt->last_ns,
+                                        __ATOMIC_RELAXED) < 1000000000ULL)
+            active += qos_classes[i].weight;
+    }
+    if (!active)
+        active = c->weight;
+
+    share = qos_dev_bw * c->weight / active;
+
+    return (c->bw && c->bw < share) ? c->bw : share;
+}
+
+void qos_admit(int tgt_fd, size_t bytes)
+{
+    struct nvm_qos_class *c;
+    struct nvm_qos_acct *acct;
+    uint64_t now, bw, wait = 0, w;
+
+    if (tgt_fd < 0 || tgt_fd >= QOS_MAX_FDS)
+        return;
+    c = qos_fd_class[tgt_fd];
+    if (!c)
+        return;
+
+    if (qos_worker < 0)
+        qos_worker = __atomic_fetch_add(&qos_next_worker, 1,
+                                    __ATOMIC_RELAXED) % QOS_MAX_WORKERS;
+
+    now = now_ns();
+    __atomic_store_n(&c->bkt->last_ns, now, __ATOMIC_RELAXED);
+
+    if (c->iops)
+        wait = gcra_reserve(&c->bkt->iops_tat, now, 1000000000ULL / c->iops);
+
+    bw = qos_class_bw(c, now);
+    if (bw) {
+        w = gcra_reserve(&c->bkt->bw_tat, now, bytes * 1000000000ULL / bw);
+        if (w > wait)
+            wait = w;
+    }
+
+    if (wait) {
+        sleep_ns(wait);
+        acct = &c->acct[qos_worker];
+        __atomic_fetch_add(&acct->throttled_ns, wait, __ATOMIC_RELAXED);
+    }
+
+    acct = &c->acct[qos_worker];
+    __atomic_fetch_add(&acct->ios, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&acct->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void qos_stats(const char *tgt_name, uint64_t *ios, uint64_t *bytes,
+                                                    uint64_t *throttled_ns)
+{
+    struct nvm_qos_class *c = NULL;
+    int i;
+
+    *ios = *bytes = *throttled_ns = 0;
+
+    for (i = 0; i < qos_nr_classes; i++)
+        if (strcmp(qos_classes[i].name, tgt_name) == 0)
+            c = &qos_classes[i];
+    if (!c)
+        return;
+
+    for (i = 0; i < QOS_MAX_WORKERS; i++) {
+        *ios += __atomic_load_n(&c->acct[i].ios, __ATOMIC_RELAXED);
+        *bytes += __atomic_load_n(&c->acct[i].bytes, __ATOMIC_RELAXED);
+        *throttled_ns += __atomic_load_n(&c->acct[i].throttled_ns,
+                                                        __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,312 @@
+/*  Adaptive sequential read-ahead for lnvm-manager.
+
+    A few streams are tracked per context, one per block being read. When
+    a stream has read RA_TRIGGER pages in order, the pages after it are
+    queued to a small pool of worker threads that read them into a ring of
+    page slots, so several reads are in flight while the caller consumes
+    the current one. The window doubles on every sequential read up to
+    RA_MAX_WINDOW pages; a non-sequential read drops it and cancels the
+    queued pages of that stream. Pages the caller found in the page cache
+    are reported with ra_note() so they still count for their stream.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+enum ra_state {
+    RA_FREE = 0,
+    RA_QUEUED,
+    RA_INFLIGHT,
+    RA_DONE,
+    RA_ERROR
+};
+
+/* Is the slot still ahead of a stream reading its block? */
+static int ra_wanted(struct nvm_ra *ra, struct nvm_ra_slot *slot)
+{
+    struct nvm_ra_stream *st;
+    int i;
+
+    for (i = 0; i < RA_STREAMS; i++) {
+        st = &ra->streams[i];
+        if (st->window && st->blk_id == slot->blk_id &&
+                                slot->pg > st->last_pg &&
+                                slot->pg <= st->last_pg + st->window)
+            return 1;
+    }
+    return 0;
+}
+
+static struct nvm_ra_slot *ra_lookup(struct nvm_ra *ra, uint32_t blk_id,
+                                                                    int pg)
+{
+    struct nvm_ra_slot *slot;
+    int i;
+
+    for (i = 0; i < RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (slot->state != RA_FREE && slot->blk_id == blk_id &&
+                                                            slot->pg == pg)
+            return slot;
+    }
+    return NULL;
+}
+
+static struct nvm_ra_slot *ra_get_slot(struct nvm_ra *ra)
+{
+    struct nvm_ra_slot *slot;
+    int i;
+
+    for (i = 0; i < RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (slot->state == RA_FREE)
+            return slot;
+        if ((slot->state == RA_DONE || slot->state == RA_ERROR) &&
+                                                        !ra_wanted(ra, slot))
+            return slot;
+    }
+    return NULL;
+}
+
+static void ra_cancel(struct nvm_ra *ra, uint32_t blk_id)
+{
+    int i;
+
+    for (i = 0; i < RA_SLOTS; i++) {
+        if (ra->slots[i].state == RA_QUEUED &&
+                                            ra->slots[i].blk_id == blk_id)
+            ra->slots[i].state = RA_FREE;
+    }
+}
+
+/* Find the stream of a read and update its window */
+static struct nvm_ra_stream *ra_stream(struct nvm_ra *ra, uint32_t blk_id,
+                                                                    int pg)
+{
+    struct nvm_ra_stream *st = NULL, *lru = &ra->streams[0];
+    int i;
+
+    for (i = 0; i < RA_STREAMS; i++) {
+        if (ra->streams[i].used && ra->streams[i].blk_id == blk_id) {
+            st = &ra->streams[i];
+            break;
+        }
+        if (ra->streams[i].used < lru->used)
+            lru = &ra->streams[i];
+    }
+
+    if (st && st->last_pg + 1 == pg) {
+        if (++st->seq >= RA_TRIGGER)
+            st->window = (st->window) ?
+                         ((st->window * 2 > RA_MAX_WINDOW) ?
+                                        RA_MAX_WINDOW : st->window * 2) :
+                         RA_MIN_WINDOW;
+    } else {
+        if (st)
+            ra_cancel(ra, st->blk_id);
+        else
+            st = lru;
+        st->blk_id = blk_id;
+        st->seq = 0;
+        st->window = 0;
+        st->next_pg = pg + 1;
+    }
+
+    st->last_pg = pg;
+    st->used = ++ra->tick;
+
+    return st;
+}
+
+static void ra_fill(struct nvm_ra *ra, struct nvm_ra_stream *st)
+{
+    struct nvm_ra_slot *slot;
+    int end = st->last_pg + 1 + st->window;
+
+    if (end > ra->info->pg_per_blk)
+        end = ra->info->pg_per_blk;
+    if (st->next_pg <= st->last_pg)
+        st->next_pg = st->last_pg + 1;
+
+    for (; st->next_pg < end; st->next_pg++) {
+        if (ra_lookup(ra, st->blk_id, st->next_pg))
+            continue;
+        slot = ra_get_slot(ra);
+        if (!slot)
+            break;
+        slot->blk_id = st->blk_id;
+        slot->pg = st->next_pg;
+        slot->order = ++ra->tick;
+        slot->state = RA_QUEUED;
+        pthread_cond_signal(&ra->work);
+    }
+}
+
+static void *ra_worker(void *arg)
+{
+    struct nvm_ra *ra = arg;
+    struct nvm_ra_slot *slot;
+    int ret, i;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop) {
+        slot = NULL;
+        for (i = 0; i < RA_SLOTS; i++) {
+            if (ra->slots[i].state == RA_QUEUED &&
+                            (!slot || ra->slots[i].order < slot->order))
+                slot = &ra->slots[i];
+        }
+        if (!slot) {
+            pthread_cond_wait(&ra->work, &ra->lock);
+            continue;
+        }
+
+        slot->state = RA_INFLIGHT;
+        pthread_mutex_unlock(&ra->lock);
+
+        /* Taken before the read, for the page cache */
+        if (page_cache)
+            slot->gen = cache_gen(page_cache, ra->tgt_fd, slot->blk_id,
+                                                                slot->pg);
+
+        ret = lnvm_page_io(ra->tgt_fd, ra->info, READ, slot->buf,
+                                                    slot->blk_id, slot->pg, 1);
+
+        pthread_mutex_lock(&ra->lock);
+        slot->state = (ret) ? RA_ERROR : RA_DONE;
+        pthread_cond_broadcast(&ra->done);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+int ra_init(struct nvm_ra *ra, int tgt_fd, struct nvm_dev_info *info)
+{
+    int i;
+
+    memset(ra, 0, sizeof(*ra));
+    ra->tgt_fd = tgt_fd;
+    ra->info = info;
+
+    if (posix_memalign((void **)&ra->data, info->sec_size,
+                                    (size_t) RA_SLOTS * info->pln_pg_size)) {
+        printf("Could not allocate read-ahead memory (%d,%d)\n",
+                                        info->sec_size, info->pln_pg_size);
+        return -1;
+    }
+    for (i = 0; i < RA_SLOTS; i++)
+        ra->slots[i].buf = ra->data + (size_t) i * info->pln_pg_size;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work, NULL);
+    pthread_cond_init(&ra->done, NULL);
+
+    /* As many pages in flight as tuned for the device */
+    for (i = 0; i < RA_WORKERS && i < info->io_depth; i++) {
+        if (pthread_create(&ra->workers[i], NULL, ra_worker, ra))
+            break;
+        ra->nr_workers++;
+    }
+
+    if (!ra->nr_workers) {
+        printf("Could not start read-ahead workers.\n");
+        ra_free(ra);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ra_free(struct nvm_ra *ra)
+{
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->work);
+    pthread_mutex_unlock(&ra->lock);
+
+    for (i = 0; i < ra->nr_workers; i++)
+        pthread_join(ra->workers[i], NULL);
+
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->work);
+    pthread_cond_destroy(&ra->done);
+    free(ra->data);
+    ra->data = NULL;
+}
+
+/* Read one plane page, from the read-ahead ring when it is there. With the
+ * page cache on, gen (if not NULL) gets the cache generation of the page
+ * as it was when the page was read. */
+int ra_read(struct nvm_ra *ra, uint32_t blk_id, int pg, char *dst,
+                                                            uint32_t *gen)
+{
+    struct nvm_ra_stream *st;
+    struct nvm_ra_slot *slot;
+    int ret = -1;
+
+    pthread_mutex_lock(&ra->lock);
+    st = ra_stream(ra, blk_id, pg);
+
+    slot = ra_lookup(ra, blk_id, pg);
+    if (slot && slot->state == RA_QUEUED) {
+        /* Not started yet, read it here */
+        slot->state = RA_FREE;
+        slot = NULL;
+    }
+    if (slot) {
+        while (slot->state == RA_INFLIGHT)
+            pthread_cond_wait(&ra->done, &ra->lock);
+        if (slot->state == RA_DONE) {
+            memcpy(dst, slot->buf, ra->info->pln_pg_size);
+            if (gen)
+                *gen = slot->gen;
+            ra->hits++;
+            ret = 0;
+        }
+        slot->state = RA_FREE;
+    }
+
+    if (ret)
+        ra->misses++;
+
+    /* Queue the pages ahead before waiting on this one */
+    if (st->window)
+        ra_fill(ra, st);
+    pthread_mutex_unlock(&ra->lock);
+
+    if (ret) {
+        if (page_cache && gen)
+            *gen = cache_gen(page_cache, ra->tgt_fd, blk_id, pg);
+        ret = lnvm_page_io(ra->tgt_fd, ra->info, READ, dst, blk_id, pg, 1);
+    }
+
+    return ret;
+}
+
+/* A page of blk_id read from elsewhere: move its stream along as ra_read()
+ * would, and drop the copy of the page in the ring if there is one */
+void ra_note(struct nvm_ra *ra, uint32_t blk_id, int pg)
+{
+    struct nvm_ra_stream *st;
+    struct nvm_ra_slot *slot;
+
+    pthread_mutex_lock(&ra->lock);
+    st = ra_stream(ra, blk_id, pg);
+
+    slot = ra_lookup(ra, blk_id, pg);
+    if (slot && slot->state != RA_INFLIGHT)
+        slot->state = RA_FREE;
+
+    if (st->window)
+        ra_fill(ra, st);
+    pthread_mutex_unlock(&ra->lock);
+}
@@ -0,0 +1,326 @@
+/*  Per-LUN I/O scheduler for lnvm-manager.
+
+    Every LUN has a read queue and a write queue served by its own
+    dispatch threads ('depth' per LUN, so at most 'depth' commands are
+    outstanding on a LUN). Reads go first, and at most 'wr_max' writes
+    are outstanding on a LUN at any time, so a read never waits behind a
+    full queue of programs. A write whose deadline has passed is
+    dispatched before any read, so bulk writes still make progress under
+    a steady read load.
+
+    Pages of a block must be programmed in order, so a block has at most
+    one write outstanding: the writes to a block are dispatched one at a
+    time, in the order they were submitted, while writes to other blocks
+    of the LUN overlap up to 'wr_max'.
+
+    Requests complete through their end_io callback, or sched_io() can
+    be used to submit and wait.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct sched_worker {
+    struct nvm_sched *s;
+    uint32_t lun;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sched_enqueue(struct nvm_sched_req **head,
+                        struct nvm_sched_req **tail, struct nvm_sched_req *rq)
+{
+    rq->next = NULL;
+    if (*tail)
+        (*tail)->next = rq;
+    else
+        *head = rq;
+    *tail = rq;
+}
+
+static struct nvm_sched_req *sched_dequeue(struct nvm_sched_req **head,
+                                                struct nvm_sched_req **tail)
+{
+    struct nvm_sched_req *rq = *head;
+
+    *head = rq->next;
+    if (!*head)
+        *tail = NULL;
+    return rq;
+}
+
+static int sched_blk_busy(struct nvm_sched_lun *l, uint32_t blk_id)
+{
+    int i;
+
+    for (i = 0; i < l->wr_inflight; i++)
+        if (l->wr_blks[i] == blk_id)
+            return 1;
+
+    return 0;
+}
+
+/* First queued write to a block with no write in flight, and the request
+ * before it in the queue. Lock must be held. */
+static struct nvm_sched_req *sched_next_write(struct nvm_sched *s,
+                    struct nvm_sched_lun *l, struct nvm_sched_req **prev)
+{
+    struct nvm_sched_req *rq;
+
+    *prev = NULL;
+    if (l->wr_inflight >= s->wr_max)
+        return NULL;
+
+    for (rq = l->wq_head; rq; *prev = rq, rq = rq->next)
+        if (!sched_blk_busy(l, rq->blk_id))
+            return rq;
+
+    return NULL;
+}
+
+static struct nvm_sched_req *sched_take_write(struct nvm_sched_lun *l,
+                    struct nvm_sched_req *prev, struct nvm_sched_req *rq)
+{
+    if (prev)
+        prev->next = rq->next;
+    else
+        l->wq_head = rq->next;
+    if (l->wq_tail == rq)
+        l->wq_tail = prev;
+    rq->next = NULL;
+
+    l->wr_blks[l->wr_inflight++] = rq->blk_id;
+    return rq;
+}
+
+static void sched_end_write(struct nvm_sched_lun *l, uint32_t blk_id)
+{
+    int i;
+
+    for (i = 0; i < l->wr_inflight; i++) {
+        if (l->wr_blks[i] == blk_id) {
+            l->wr_blks[i] = l->wr_blks[--l->wr_inflight];
+            break;
+        }
+    }
+}
+
+/* Pick the next request of a LUN. Lock must be held. */
+static struct nvm_sched_req *sched_pick(struct nvm_sched *s,
+                                                    struct nvm_sched_lun *l)
+{
+    struct nvm_sched_req *prev, *wr = sched_next_write(s, l, &prev);
+
+    if (wr && wr->deadline <= now_ns()) {
+        l->expired++;
+        return sched_take_write(l, prev, wr);
+    }
+
+    if (l->rq_head)
+        return sched_dequeue(&l->rq_head, &l->rq_tail);
+
+    if (wr)
+        return sched_take_write(l, prev, wr);
+
+    return NULL;
+}
+
+static void *sched_worker(void *arg)
+{
+    struct sched_worker *w = arg;
+    struct nvm_sched *s = w->s;
+    struct nvm_sched_lun *l = &s->luns[w->lun];
+    struct nvm_sched_req *rq;
+
+    pthread_mutex_lock(&l->lock);
+    while (!l->stop) {
+        rq = sched_pick(s, l);
+        if (!rq) {
+            pthread_cond_wait(&l->work, &l->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&l->lock);
+
+        rq->ret = lnvm_page_io(s->tgt_fd, s->info, rq->dir, rq->buf,
+                                            rq->blk_id, rq->pg, rq->nr_pages);
+
+        pthread_mutex_lock(&l->lock);
+        if (rq->dir == WRITE) {
+            sched_end_write(l, rq->blk_id);
+            /* a write slot opened up, and the block takes its next write */
+            pthread_cond_signal(&l->work);
+        }
+
+        if (rq->end_io) {
+            pthread_mutex_unlock(&l->lock);
+            rq->end_io(rq);
+            pthread_mutex_lock(&l->lock);
+        } else {
+            rq->done = 1;
+            pthread_cond_broadcast(&l->done);
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    return NULL;
+}
+
+int sched_init(struct nvm_sched *s, int tgt_fd, struct nvm_dev_info *info,
+                            uint32_t nr_luns, int depth, int wr_max)
+{
+    struct sched_worker *w;
+    uint32_t i;
+    int j;
+
+    memset(s, 0, sizeof(*s));
+    s->tgt_fd = tgt_fd;
+    s->info = info;
+    s->nr_luns = nr_luns;
+    s->depth = depth;
+    s->wr_max = (wr_max < depth) ? wr_max : depth;
+    s->wr_expire = SCHED_WR_EXPIRE_MS * 1000000ULL;
+
+    s->luns = calloc(nr_luns, sizeof(struct nvm_sched_lun));
+    s->workers = calloc((size_t) nr_luns * depth, sizeof(pthread_t));
+    s->wargs = calloc((size_t) nr_luns * depth, sizeof(struct sched_worker));
+    if (!s->luns || !s->workers || !s->wargs) {
+        printf("Could not allocate scheduler memory.\n");
+        goto err;
+    }
+
+    for (i = 0; i < nr_luns; i++) {
+        pthread_mutex_init(&s->luns[i].lock, NULL);
+        pthread_cond_init(&s->luns[i].work, NULL);
+        pthread_cond_init(&s->luns[i].done, NULL);
+        s->luns[i].wr_blks = calloc(s->wr_max, sizeof(uint32_t));
+        if (!s->luns[i].wr_blks) {
+            printf("Could not allocate scheduler memory.\n");
+            goto err;
+        }
+    }
+
+    for (i = 0; i < nr_luns; i++) {
+        for (j = 0; j < depth; j++) {
+            w = (struct sched_worker *) s->wargs + s->nr_workers;
+            w->s = s;
+            w->lun = i;
+            if (pthread_create(&s->workers[s->nr_workers], NULL,
+                                                        sched_worker, w)) {
+                printf("Could not start scheduler thread.\n");
+                goto err;
+            }
+            s->nr_workers++;
+        }
+    }
+
+    return 0;
+
+err:
+    sched_free(s);
+    return -1;
+}
+
+void sched_free(struct nvm_sched *s)
+{
+    uint32_t i;
+    int j;
+
+    if (s->luns) {
+        for (i = 0; i < s->nr_luns; i++) {
+            pthread_mutex_lock(&s->luns[i].lock);
+            s->luns[i].stop = 1;
+            pthread_cond_broadcast(&s->luns[i].work);
+            pthread_mutex_unlock(&s->luns[i].lock);
+        }
+    }
+
+    for (j = 0; j < s->nr_workers; j++)
+        pthread_join(s->workers[j], NULL);
+
+    if (s->luns) {
+        for (i = 0; i < s->nr_luns; i++) {
+            pthread_mutex_destroy(&s->luns[i].lock);
+            pthread_cond_destroy(&s->luns[i].work);
+            pthread_cond_destroy(&s->luns[i].done);
+            free(s->luns[i].wr_blks);
+        }
+    }
+
+    free(s->luns);
+    free(s->workers);
+    free(s->wargs);
+    s->luns = NULL;
+    s->workers = NULL;
+    s->wargs = NULL;
+    s->nr_workers = 0;
+}
+
+int sched_submit(struct nvm_sched *s, struct nvm_sched_req *rq)
+{
+    struct nvm_sched_lun *l;
+
+    if (rq->lun >= s->nr_luns) {
+        printf("LUN %u out of range (%u LUNs).\n", rq->lun, s->nr_luns);
+        return -1;
+    }
+    l = &s->luns[rq->lun];
+
+    rq->done = 0;
+    rq->ret = 0;
+    rq->deadline = now_ns() + s->wr_expire;
+
+    pthread_mutex_lock(&l->lock);
+    if (rq->dir == WRITE)
+        sched_enqueue(&l->wq_head, &l->wq_tail, rq);
+    else
+        sched_enqueue(&l->rq_head, &l->rq_tail, rq);
+    pthread_cond_signal(&l->work);
+    pthread_mutex_unlock(&l->lock);
+
+    return 0;
+}
+
+/* Wait for a request submitted without end_io */
+int sched_wait(struct nvm_sched *s, struct nvm_sched_req *rq)
+{
+    struct nvm_sched_lun *l = &s->luns[rq->lun];
+
+    pthread_mutex_lock(&l->lock);
+    while (!rq->done)
+        pthread_cond_wait(&l->done, &l->lock);
+    pthread_mutex_unlock(&l->lock);
+
+    return rq->ret;
+}
+
+int sched_io(struct nvm_sched *s, uint32_t lun, uint8_t direction, char *buf,
+                                    uint32_t blk_id, int pg, int nr_pages)
+{
+    struct nvm_sched_req rq;
+
+    memset(&rq, 0, sizeof(rq));
+    rq.lun = lun;
+    rq.dir = direction;
+    rq.buf = buf;
+    rq.blk_id = blk_id;
+    rq.pg = pg;
+    rq.nr_pages = nr_pages;
+
+    if (sched_submit(s, &rq))
+        return -1;
+
+    return sched_wait(s, &rq);
+}
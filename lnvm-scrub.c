@@ -0,0 +1,363 @@
+/*  Background scrubber for lnvm-manager.
+
+    Walks every block that has pages recorded in a checksum table (or a
+    single block given by the user), reads it with I/Os as large as the
+    device accepts (max_sec_io), SCRUB_DEPTH of them in flight through the
+    I/O scheduler, and checks every page against its stored CRC32C, or
+    against the pattern written by 'lnvm write' when there is no table.
+    Checksum errors are counted per page in the table, so pages with a
+    rising error count show up across scrub passes.
+
+    Reads are paced by a token bucket. Every SCRUB_SAMPLE_MS the scrubber
+    looks at the latency of the foreground I/O on the target, as summed
+    by every process in its stats file (see lnvm-stats.c). When it rises
+    well above the lowest latency seen, the rate is halved; it grows back
+    slowly once the latency settles or the foreground goes idle.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <argp.h>
+#include <string.h>
+#include <time.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include <linux/types.h>
+#include "lnvm-manager.h"
+
+struct scrub_throttle {
+    double max_rate;        /* bytes per second, 0 = unlimited */
+    double rate;
+    double tokens;
+    double burst;
+    double last;
+    int tgt_fd;
+    double sample;          /* time of the next foreground sample */
+    uint64_t fg_ios;        /* foreground I/O count and time at the last */
+    uint64_t fg_ns;
+    double base_lat;        /* lowest foreground latency seen */
+    uint8_t verbose;
+};
+
+struct scrub_stats {
+    uint32_t blocks;
+    uint64_t pages;
+    uint64_t bytes;
+    uint32_t csum_errs;
+    uint32_t io_errs;
+    uint32_t rising;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void throttle_init(struct scrub_throttle *th, int tgt_fd,
+                            uint32_t mbps, size_t io_size, uint8_t verbose)
+{
+    memset(th, 0, sizeof(*th));
+    th->max_rate = (double) mbps * 1024 * 1024;
+    th->rate = th->max_rate;
+    th->burst = io_size;
+    th->tokens = io_size;
+    th->last = now_sec();
+    th->tgt_fd = tgt_fd;
+    th->sample = th->last + SCRUB_SAMPLE_MS / 1e3;
+    th->verbose = verbose;
+
+    /* Our own reads do not count as foreground */
+    stats_background(tgt_fd);
+    stats_fg(tgt_fd, &th->fg_ios, &th->fg_ns);
+}
+
+static void throttle_wait(struct scrub_throttle *th, size_t bytes)
+{
+    double now, wait;
+
+    if (!th->max_rate)
+        return;
+
+    now = now_sec();
+    th->tokens += (now - th->last) * th->rate;
+    if (th->tokens > th->burst)
+        th->tokens = th->burst;
+    th->last = now;
+
+    if (th->tokens < bytes) {
+        wait = (bytes - th->tokens) / th->rate;
+        usleep(wait * 1e6);
+        th->last += wait;
+        th->tokens = bytes;
+    }
+    th->tokens -= bytes;
+}
+
+static void throttle_update(struct scrub_throttle *th, size_t io_size)
+{
+    double old = th->rate, now = now_sec(), lat = 0;
+    uint64_t ios, ns;
+
+    if (!th->max_rate || now < th->sample)
+        return;
+    th->sample = now + SCRUB_SAMPLE_MS / 1e3;
+
+    if (stats_fg(th->tgt_fd, &ios, &ns))
+        return;
+
+    if (ios > th->fg_ios) {
+        lat = (double) (ns - th->fg_ns) / (ios - th->fg_ios) / 1e9;
+        if (!th->base_lat || lat < th->base_lat)
+            th->base_lat = lat;
+    }
+    th->fg_ios = ios;
+    th->fg_ns = ns;
+
+    if (lat && lat > th->base_lat * 2) {
+        th->rate /= 2;
+        if (th->rate < th->max_rate / 64)
+            th->rate = th->max_rate / 64;
+    } else if ((!lat || lat < th->base_lat * 1.5) &&
+                                                th->rate < th->max_rate) {
+        /* Latency settled, or no foreground I/O at all */
+        th->rate += th->max_rate / 16;
+        if (th->rate > th->max_rate)
+            th->rate = th->max_rate;
+    }
+
+    th->burst = (th->rate / 10 > io_size) ? th->rate / 10 : io_size;
+
+    if (th->verbose && th->rate != old && lat)
+        printf("  Scrub rate %.1f MB/s (foreground latency %.0f us, "
+                "base %.0f us)\n", th->rate / (1024 * 1024), lat * 1e6,
+                th->base_lat * 1e6);
+    else if (th->verbose && th->rate != old)
+        printf("  Scrub rate %.1f MB/s (no foreground I/O)\n",
+                                                th->rate / (1024 * 1024));
+}
+
+static void scrub_check(struct nvm_dev_info *info, struct nvm_csum *cs,
+        char *buf, uint32_t blk_id, int pg, int nr_pages,
+        struct scrub_stats *st)
+{
+    int ret, i;
+
+    if (cs->fd >= 0) {
+        ret = csum_verify(cs, blk_id, pg, nr_pages, buf);
+        if (ret > 0)
+            st->csum_errs += ret;
+        return;
+    }
+
+    for (i = 0; i < nr_pages; i++) {
+        if (pattern_check(buf + (size_t) i * info->pln_pg_size, info, blk_id,
+                                                                    pg + i)) {
+            printf("  Pattern mismatch in block %u page %d\n", blk_id, pg + i);
+            st->csum_errs++;
+        }
+    }
+}
+
+/* Pages of a completed read: check them, or find the ones that fail */
+static void scrub_done(int tgt_fd, struct nvm_dev_info *info,
+        struct nvm_csum *cs, struct nvm_sched_req *rq, struct scrub_stats *st)
+{
+    int i;
+
+    if (rq->ret == 0) {
+        scrub_check(info, cs, rq->buf, rq->blk_id, rq->pg, rq->nr_pages, st);
+    } else {
+        for (i = 0; i < rq->nr_pages; i++) {
+            char *pbuf = rq->buf + (size_t) i * info->pln_pg_size;
+
+            if (lnvm_page_io(tgt_fd, info, READ, pbuf, rq->blk_id,
+                                                            rq->pg + i, 1)) {
+                printf("  Read error in block %u page %d\n", rq->blk_id,
+                                                                rq->pg + i);
+                st->io_errs++;
+                continue;
+            }
+            scrub_check(info, cs, pbuf, rq->blk_id, rq->pg + i, 1, st);
+        }
+    }
+
+    st->pages += rq->nr_pages;
+    st->bytes += (size_t) rq->nr_pages * info->pln_pg_size;
+}
+
+static int scrub_block(int tgt_fd, struct nvm_dev_info *info,
+        struct nvm_sched *s, struct nvm_csum *cs, struct nvm_csum_ent *ent,
+        char *buf, int chunk, uint32_t blk_id, struct scrub_throttle *th,
+        struct scrub_stats *st)
+{
+    struct nvm_sched_req rq[SCRUB_DEPTH], *r;
+    size_t io_size = (size_t) chunk * info->pln_pg_size;
+    uint16_t *errs = NULL;
+    int first = 0, last = info->pg_per_blk - 1;
+    int pg, n, i, head = 0, inflight = 0, ret = 0;
+
+    if (cs->fd >= 0) {
+        if (csum_load(cs, blk_id, ent) <= 0)
+            return 0;
+
+        while (!(ent[first].flags & CSUM_VALID))
+            first++;
+        while (!(ent[last].flags & CSUM_VALID))
+            last--;
+
+        errs = malloc(info->pg_per_blk * sizeof(uint16_t));
+        if (!errs)
+            return -1;
+        for (i = 0; i < info->pg_per_blk; i++)
+            errs[i] = ent[i].errs;
+    }
+
+    /* Keep SCRUB_DEPTH reads in flight, check them in order */
+    for (pg = first; pg <= last || inflight; ) {
+        while (pg <= last && inflight < SCRUB_DEPTH) {
+            n = (last + 1 - pg < chunk) ? last + 1 - pg : chunk;
+
+            throttle_wait(th, (size_t) n * info->pln_pg_size);
+
+            i = (head + inflight) % SCRUB_DEPTH;
+            r = &rq[i];
+            memset(r, 0, sizeof(*r));
+            r->dir = READ;
+            r->buf = buf + i * io_size;
+            r->blk_id = blk_id;
+            r->pg = pg;
+            r->nr_pages = n;
+            if (sched_submit(s, r)) {
+                ret = -1;
+                goto out;
+            }
+            inflight++;
+            pg += n;
+        }
+
+        r = &rq[head];
+        sched_wait(s, r);
+        head = (head + 1) % SCRUB_DEPTH;
+        inflight--;
+
+        scrub_done(tgt_fd, info, cs, r, st);
+        throttle_update(th, io_size);
+    }
+    st->blocks++;
+
+    if (!errs)
+        return 0;
+
+    if (csum_load(cs, blk_id, ent) > 0) {
+        for (i = first; i <= last; i++) {
+            if (ent[i].errs <= errs[i] || ent[i].errs < 2)
+                continue;
+            printf("  Block %u page %d: %u checksum errors (rising)\n",
+                                                    blk_id, i, ent[i].errs);
+            st->rising++;
+        }
+    }
+
+out:
+    while (inflight--) {
+        sched_wait(s, &rq[head]);
+        head = (head + 1) % SCRUB_DEPTH;
+    }
+    free(errs);
+
+    return ret;
+}
+
+void lnvm_scrub(struct arguments *args)
+{
+    struct nvm_dev_info info;
+    struct nvm_csum cs = { .fd = -1 };
+    struct nvm_csum_ent *ent = NULL;
+    struct scrub_throttle th;
+    struct scrub_stats st;
+    struct nvm_sched s;
+    char *buf = NULL;
+    uint32_t blk, nr_blks;
+    int tgt_fd, chunk, ret;
+    double start;
+
+    printf("\n### LNVM SCRUB ###\n");
+
+    ret = get_dev_info(args->scrub_tgt, &info);
+    if (ret) {
+        printf("nvm_dev_info error. Failed to get device info.\n");
+        return;
+    }
+
+    tgt_fd = nvm_be->target_open(args->scrub_tgt, 0x0);
+    if (tgt_fd < 0) {
+        printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
+                                                            args->scrub_tgt);
+        return;
+    }
+    qos_bind(tgt_fd, args->scrub_tgt);
+
+    if (args->scrub_flag & IOARGC) {
+        if (csum_open(&cs, args->scrub_csum, &info))
+            goto close;
+        ent = malloc(info.pg_per_blk * sizeof(struct nvm_csum_ent));
+        if (!ent)
+            goto close;
+    }
+
+    /* As large as the device takes in one command */
+    chunk = max_io_pages(&info);
+    if (chunk > info.pg_per_blk)
+        chunk = info.pg_per_blk;
+
+    ret = posix_memalign((void **)&buf, info.sec_size,
+                            (size_t) SCRUB_DEPTH * chunk * info.pln_pg_size);
+    if (ret) {
+        printf("Could not allocate read aligned memory (%d,%d)\n",
+                                            info.sec_size, info.pln_pg_size);
+        goto close;
+    }
+
+    if (sched_init(&s, tgt_fd, &info, 1, SCRUB_DEPTH, 1))
+        goto close;
+
+    throttle_init(&th, tgt_fd, (args->scrub_flag & IOARGR) ?
+                            args->scrub_rate : SCRUB_DEFAULT_RATE,
+                            (size_t) chunk * info.pln_pg_size,
+                            args->scrub_flag & IOARGV);
+    memset(&st, 0, sizeof(st));
+    start = now_sec();
+
+    if (args->scrub_flag & IOARGB) {
+        blk = args->scrub_blkid;
+        nr_blks = blk + 1;
+    } else {
+        blk = 0;
+        nr_blks = csum_nr_blocks(&cs);
+    }
+
+    for (; blk < nr_blks; blk++) {
+        if (scrub_block(tgt_fd, &info, &s, &cs, ent, buf, chunk, blk, &th,
+                                                                        &st))
+            break;
+    }
+    sched_free(&s);
+
+    printf("\n Scrubbed %u block(s), %lu pages (%lu bytes) in %.1f s.\n",
+            st.blocks, (unsigned long) st.pages, (unsigned long) st.bytes,
+            now_sec() - start);
+    printf(" Checksum errors: %u\n", st.csum_errs);
+    printf(" Read errors: %u\n", st.io_errs);
+    printf(" Pages with rising error count: %u\n", st.rising);
+    printf("\n");
+
+close:
+    free(buf);
+    free(ent);
+    csum_close(&cs);
+    nvm_be->target_close(tgt_fd);
+}
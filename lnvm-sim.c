@@ -0,0 +1,540 @@
+/*  Simulated OpenChannel device for lnvm-manager.
+
+    Lets every command run without an OpenChannel SSD. The device
+    (SIM_DEV_NAME) has a configurable geometry and comes with one target
+    (SIM_TGT_NAME) over all of its LUNs; 'new' and 'rm' manage more
+    targets for the life of the process. Data lives in a sparse file
+    given with 'file=', so it survives between invocations, or in memory.
+    The block allocation map is kept after the data, in the same file.
+
+    Timing follows a simple NAND model: a plane page read costs 'rd' us,
+    a plane page program 'prog' us and a block erase (on put) 'ers' us.
+    A LUN performs one operation at a time: every operation is queued
+    behind the ones already issued to its LUN, while LUNs work in
+    parallel. Configuration is a comma separated list of key=value:
+
+        ch      channels                    (1)
+        luns    LUNs per channel            (4)
+        pln     planes                      (2)
+        blks    blocks per LUN              (128)
+        pgs     pages per block             (PGS_PER_BLK)
+        sec     sector size in bytes        (4096)
+        secpg   sectors per page            (4)
+        maxsec  max sectors per I/O         (64)
+        rd, prog, ers   latencies in us, 0 disables the model
+        file    backing file (default: memory)
+
+    Addresses are decoded as page_ppa() lays them out: block b starts at
+    b * pages per block * plane page size, and LUN l owns the blocks
+    [l * blks, (l + 1) * blks).
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct sim_lun {
+    pthread_mutex_t lock;
+    uint64_t busy_until;        /* ns, end of the last queued operation */
+    uint32_t next;              /* allocation cursor */
+    uint8_t *used;              /* one byte per block, in sim.map */
+};
+
+struct sim_tgt {
+    char name[DISK_NAME_LEN];
+    char type[NVM_TTYPE_NAME_MAX];
+    uint32_t lun_begin;
+    uint32_t lun_end;
+    int used;
+};
+
+static struct {
+    uint32_t nr_ch;
+    uint32_t luns_per_ch;
+    uint32_t nr_luns;
+    uint32_t nr_planes;
+    uint32_t blks_per_lun;
+    uint32_t pg_per_blk;
+    uint32_t sec_size;
+    uint32_t sec_per_pg;
+    uint32_t max_sec_io;
+    uint64_t rd_ns;
+    uint64_t prog_ns;
+    uint64_t ers_ns;
+    size_t pln_pg_size;
+    size_t blk_bytes;
+    size_t size;
+    size_t map_off;
+    size_t map_len;
+    uint8_t *map;
+    int fd;
+    uint32_t rr;
+    struct sim_lun *luns;
+    struct sim_tgt tgts[SIM_MAX_TGTS];
+    pthread_mutex_t lock;
+} sim = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Queue an operation of 'cost' ns on a LUN and wait for it to complete */
+static void sim_busy(struct sim_lun *l, uint64_t cost)
+{
+    struct timespec ts;
+    uint64_t now, end;
+
+    if (!cost)
+        return;
+
+    pthread_mutex_lock(&l->lock);
+    now = now_ns();
+    end = ((l->busy_until > now) ? l->busy_until : now) + cost;
+    l->busy_until = end;
+    pthread_mutex_unlock(&l->lock);
+
+    ts.tv_sec = end / 1000000000ULL;
+    ts.tv_nsec = end % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int sim_parse(const char *conf, char **file)
+{
+    char *str, *tok, *save, *val;
+    uint64_t v;
+    int ret = 0;
+
+    str = strdup(conf);
+    if (!str)
+        return -1;
+
+    for (tok = strtok_r(str, ",", &save); tok;
+                                        tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+        v = strtoull(val, NULL, 10);
+
+        if (strcmp(tok, "file") == 0) {
+            free(*file);
+            *file = strdup(val);
+        } else if (strcmp(tok, "ch") == 0)
+            sim.nr_ch = v;
+        else if (strcmp(tok, "luns") == 0)
+            sim.luns_per_ch = v;
+        else if (strcmp(tok, "pln") == 0)
+            sim.nr_planes = v;
+        else if (strcmp(tok, "blks") == 0)
+            sim.blks_per_lun = v;
+        else if (strcmp(tok, "pgs") == 0)
+            sim.pg_per_blk = v;
+        else if (strcmp(tok, "sec") == 0)
+            sim.sec_size = v;
+        else if (strcmp(tok, "secpg") == 0)
+            sim.sec_per_pg = v;
+        else if (strcmp(tok, "maxsec") == 0)
+            sim.max_sec_io = v;
+        else if (strcmp(tok, "rd") == 0)
+            sim.rd_ns = v * 1000;
+        else if (strcmp(tok, "prog") == 0)
+            sim.prog_ns = v * 1000;
+        else if (strcmp(tok, "ers") == 0)
+            sim.ers_ns = v * 1000;
+        else {
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret)
+        printf("Simulated device: bad setting '%s'.\n", tok);
+    free(str);
+
+    return ret;
+}
+
+int sim_init(const char *conf)
+{
+    char *file = NULL;
+    struct stat st;
+    size_t pg_size;
+    uint32_t i;
+
+    sim.nr_ch = 1;
+    sim.luns_per_ch = 4;
+    sim.nr_planes = 2;
+    sim.blks_per_lun = 128;
+    sim.pg_per_blk = PGS_PER_BLK;
+    sim.sec_size = 4096;
+    sim.sec_per_pg = 4;
+    sim.max_sec_io = 64;
+    sim.rd_ns = SIM_READ_US * 1000ULL;
+    sim.prog_ns = SIM_PROG_US * 1000ULL;
+    sim.ers_ns = SIM_ERASE_US * 1000ULL;
+
+    if (sim_parse(conf, &file))
+        goto err;
+
+    if (!sim.nr_ch || !sim.luns_per_ch || !sim.nr_planes ||
+                !sim.blks_per_lun || !sim.pg_per_blk || sim.pg_per_blk > 65535
+                || !sim.sec_size || !sim.sec_per_pg || !sim.max_sec_io) {
+        printf("Simulated device: invalid geometry.\n");
+        goto err;
+    }
+
+    sim.nr_luns = sim.nr_ch * sim.luns_per_ch;
+    sim.pln_pg_size = (size_t) sim.sec_size * sim.sec_per_pg * sim.nr_planes;
+    sim.blk_bytes = sim.pln_pg_size * sim.pg_per_blk;
+    sim.size = sim.blk_bytes * sim.blks_per_lun * sim.nr_luns;
+    pg_size = sysconf(_SC_PAGESIZE);
+    sim.map_off = (sim.size + pg_size - 1) / pg_size * pg_size;
+    sim.map_len = (size_t) sim.nr_luns * sim.blks_per_lun;
+
+    sim.fd = (file) ? open(file, O_RDWR | O_CREAT, 0644) :
+                      memfd_create(SIM_DEV_NAME, 0);
+    if (sim.fd < 0) {
+        printf("Simulated device: could not open backing store %s.\n",
+                                                    (file) ? file : "(memory)");
+        goto err;
+    }
+    if (fstat(sim.fd, &st) || ((size_t) st.st_size < sim.map_off +
+                sim.map_len && ftruncate(sim.fd, sim.map_off + sim.map_len))) {
+        printf("Simulated device: could not size backing store to %zu "
+                                    "bytes.\n", sim.map_off + sim.map_len);
+        goto err;
+    }
+
+    sim.map = mmap(NULL, sim.map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                        sim.fd, sim.map_off);
+    if (sim.map == MAP_FAILED) {
+        printf("Simulated device: could not map the block table.\n");
+        sim.map = NULL;
+        goto err;
+    }
+
+    sim.luns = calloc(sim.nr_luns, sizeof(struct sim_lun));
+    if (!sim.luns)
+        goto err;
+    for (i = 0; i < sim.nr_luns; i++) {
+        pthread_mutex_init(&sim.luns[i].lock, NULL);
+        sim.luns[i].used = sim.map + (size_t) i * sim.blks_per_lun;
+    }
+
+    strcpy(sim.tgts[0].name, SIM_TGT_NAME);
+    strcpy(sim.tgts[0].type, "rrpc");
+    sim.tgts[0].lun_begin = 0;
+    sim.tgts[0].lun_end = sim.nr_luns - 1;
+    sim.tgts[0].used = 1;
+
+    free(file);
+    return 0;
+
+err:
+    free(file);
+    return -1;
+}
+
+static struct sim_tgt *sim_find_tgt(const char *name)
+{
+    int i;
+
+    for (i = 0; i < SIM_MAX_TGTS; i++)
+        if (sim.tgts[i].used && strcmp(sim.tgts[i].name, name) == 0)
+            return &sim.tgts[i];
+
+    return NULL;
+}
+
+static int sim_get_info(struct nvm_ioctl_info *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->version[0] = 1;
+    c->tgtsize = 1;
+    strcpy(c->tgts[0].target.tgtname, "rrpc");
+    c->tgts[0].version[0] = 1;
+
+    return 0;
+}
+
+static int sim_get_devices(struct nvm_ioctl_get_devices *devs)
+{
+    memset(devs, 0, sizeof(*devs));
+    devs->nr_devices = 1;
+    strcpy(devs->info[0].dev, SIM_DEV_NAME);
+    strcpy(devs->info[0].bmname, "gennvm");
+    devs->info[0].bmversion[1] = 1;
+
+    return 0;
+}
+
+static int sim_get_device_info(struct nvm_ioctl_dev_info *info)
+{
+    struct nvm_ioctl_dev_prop *prop = &info->prop;
+
+    if (strcmp(info->dev, SIM_DEV_NAME))
+        return -1;
+
+    strcpy(info->bmname, "gennvm");
+    memset(info->bmversion, 0, sizeof(info->bmversion));
+    info->bmversion[1] = 1;
+    info->flags = 0;
+    memset(prop, 0, sizeof(*prop));
+    prop->page_size = sim.sec_size * sim.sec_per_pg;
+    prop->sec_size = sim.sec_size;
+    prop->sec_per_page = sim.sec_per_pg;
+    prop->nr_planes = sim.nr_planes;
+    prop->nr_luns = sim.nr_luns;
+    prop->nr_channels = sim.nr_ch;
+    prop->plane_mode = (sim.nr_planes > 1);
+    prop->max_sec_io = sim.max_sec_io;
+
+    return 0;
+}
+
+static int sim_create_target(struct nvm_ioctl_tgt_create *c)
+{
+    int i, ret = -1;
+
+    if (strcmp(c->target.dev, SIM_DEV_NAME) ||
+                                    c->conf.s.lun_begin > c->conf.s.lun_end ||
+                                    c->conf.s.lun_end >= sim.nr_luns)
+        return -1;
+
+    pthread_mutex_lock(&sim.lock);
+    if (sim_find_tgt(c->target.tgtname))
+        goto out;
+
+    for (i = 0; i < SIM_MAX_TGTS; i++) {
+        if (sim.tgts[i].used)
+            continue;
+        snprintf(sim.tgts[i].name, DISK_NAME_LEN, "%s", c->target.tgtname);
+        snprintf(sim.tgts[i].type, NVM_TTYPE_NAME_MAX, "%s",
+                                                        c->target.tgttype);
+        sim.tgts[i].lun_begin = c->conf.s.lun_begin;
+        sim.tgts[i].lun_end = c->conf.s.lun_end;
+        sim.tgts[i].used = 1;
+        ret = 0;
+        break;
+    }
+out:
+    pthread_mutex_unlock(&sim.lock);
+
+    return ret;
+}
+
+static int sim_remove_target(struct nvm_ioctl_tgt_remove *c)
+{
+    struct sim_tgt *t;
+
+    pthread_mutex_lock(&sim.lock);
+    t = sim_find_tgt(c->tgtname);
+    if (t)
+        t->used = 0;
+    pthread_mutex_unlock(&sim.lock);
+
+    return (t) ? 0 : -1;
+}
+
+static int sim_get_target_info(struct nvm_ioctl_tgt_info *tgt)
+{
+    struct sim_tgt *t;
+
+    pthread_mutex_lock(&sim.lock);
+    t = sim_find_tgt(tgt->target.tgtname);
+    if (t) {
+        strcpy(tgt->target.dev, SIM_DEV_NAME);
+        strcpy(tgt->target.tgttype, t->type);
+        memset(tgt->version, 0, sizeof(tgt->version));
+        tgt->version[0] = 1;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return (t) ? 0 : -1;
+}
+
+static int sim_target_open(const char *name, int flags)
+{
+    struct sim_tgt *t;
+
+    pthread_mutex_lock(&sim.lock);
+    t = sim_find_tgt(name);
+    pthread_mutex_unlock(&sim.lock);
+
+    return (t) ? dup(sim.fd) : -1;
+}
+
+static void sim_target_close(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+static int sim_alloc(uint32_t lun, NVM_VBLOCK *vblk)
+{
+    struct sim_lun *l = &sim.luns[lun];
+    uint32_t i, blk;
+    int ret = -1;
+
+    pthread_mutex_lock(&l->lock);
+    for (i = 0; i < sim.blks_per_lun; i++) {
+        blk = (l->next + i) % sim.blks_per_lun;
+        if (l->used[blk])
+            continue;
+        l->used[blk] = 1;
+        l->next = blk + 1;
+        vblk->id = (uint64_t) lun * sim.blks_per_lun + blk;
+        vblk->bppa = vblk->id * sim.blk_bytes / sim.sec_size;
+        vblk->vlun_id = lun;
+        vblk->nppas = sim.blk_bytes / sim.sec_size;
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    return ret;
+}
+
+static int sim_get_block(int fd, uint32_t lun, NVM_VBLOCK *vblk)
+{
+    uint32_t i, start;
+
+    if (vblk->flags & NVM_PROV_SPEC_LUN)
+        return (lun < sim.nr_luns) ? sim_alloc(lun, vblk) : -1;
+
+    start = __atomic_fetch_add(&sim.rr, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < sim.nr_luns; i++)
+        if (sim_alloc((start + i) % sim.nr_luns, vblk) == 0)
+            return 0;
+
+    return -1;
+}
+
+/* Put erases the block: its pages read back as zeroes */
+static int sim_put_block(int fd, NVM_VBLOCK *vblk)
+{
+    struct sim_lun *l;
+    uint32_t lun, blk;
+
+    if (vblk->id >= (uint64_t) sim.nr_luns * sim.blks_per_lun)
+        return -1;
+    lun = vblk->id / sim.blks_per_lun;
+    blk = vblk->id % sim.blks_per_lun;
+    l = &sim.luns[lun];
+
+    pthread_mutex_lock(&l->lock);
+    if (!l->used[blk]) {
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+    l->used[blk] = 0;
+    pthread_mutex_unlock(&l->lock);
+
+    fallocate(sim.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                    vblk->id * sim.blk_bytes, sim.blk_bytes);
+    sim_busy(l, sim.ers_ns);
+
+    return 0;
+}
+
+static int sim_lun_of(size_t len, off_t off)
+{
+    if (off < 0 || !len || (size_t) off + len > sim.size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (off / sim.blk_bytes) / sim.blks_per_lun;
+}
+
+static ssize_t sim_pread(int fd, void *buf, size_t len, off_t off)
+{
+    int lun = sim_lun_of(len, off);
+    ssize_t ret;
+
+    if (lun < 0)
+        return -1;
+
+    ret = pread(fd, buf, len, off);
+    sim_busy(&sim.luns[lun], sim.rd_ns *
+                        ((len + sim.pln_pg_size - 1) / sim.pln_pg_size));
+
+    return ret;
+}
+
+static ssize_t sim_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    int lun = sim_lun_of(len, off);
+    ssize_t ret;
+
+    if (lun < 0)
+        return -1;
+
+    ret = pwrite(fd, buf, len, off);
+    sim_busy(&sim.luns[lun], sim.prog_ns *
+                        ((len + sim.pln_pg_size - 1) / sim.pln_pg_size));
+
+    return ret;
+}
+
+static uint32_t sim_pg_per_blk(const char *dev)
+{
+    return (strcmp(dev, SIM_DEV_NAME) == 0) ? sim.pg_per_blk : 0;
+}
+
+static int sim_get_targets(struct nvm_ioctl_tgt_info *tgts, int max)
+{
+    int i, nr = 0;
+
+    pthread_mutex_lock(&sim.lock);
+    for (i = 0; i < SIM_MAX_TGTS && nr < max; i++) {
+        if (!sim.tgts[i].used)
+            continue;
+        memset(&tgts[nr], 0, sizeof(tgts[nr]));
+        strcpy(tgts[nr].target.tgtname, sim.tgts[i].name);
+        strcpy(tgts[nr].target.dev, SIM_DEV_NAME);
+        strcpy(tgts[nr].target.tgttype, sim.tgts[i].type);
+        tgts[nr].version[0] = 1;
+        nr++;
+    }
+    pthread_mutex_unlock(&sim.lock);
+
+    return nr;
+}
+
+struct nvm_backend sim_backend = {
+    .name               = "sim",
+    .get_info           = sim_get_info,
+    .get_devices        = sim_get_devices,
+    .get_device_info    = sim_get_device_info,
+    .create_target      = sim_create_target,
+    .remove_target      = sim_remove_target,
+    .get_target_info    = sim_get_target_info,
+    .target_open        = sim_target_open,
+    .target_close       = sim_target_close,
+    .get_block          = sim_get_block,
+    .put_block          = sim_put_block,
+    .pread              = sim_pread,
+    .pwrite             = sim_pwrite,
+    .pg_per_blk         = sim_pg_per_blk,
+    .get_targets        = sim_get_targets,
+};
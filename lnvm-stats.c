@@ -0,0 +1,548 @@
+/*  Device traffic accounting for lnvm-manager.
+
+    Every target keeps a set of counters:
+
+        host    bytes the user asked to write (pages, records)
+        prog    bytes programmed on the device
+        pad     bytes of padding programmed to fill partial pages
+        copy    bytes programmed by block copies
+        read    bytes read from the device
+        gets    blocks allocated
+        puts    blocks freed
+
+    and the write amplification factor is prog / host. 'prog', 'read',
+    'gets' and 'puts' are counted below every command: stats_wrap() puts
+    a layer over the device backend that counts them on each target fd.
+    'host', 'pad' and 'copy' are added by the I/O paths that know what
+    the bytes are.
+
+    The counters of a target live in a small file (LNVM_STATS, default
+    /var/lib/lnvm/<target>.stats) mapped shared by every process using
+    it, and are updated with atomic adds. They add up across runs and
+    concurrent processes, and a long-running user sees them move live.
+    The directory is created if missing. When the file still cannot be
+    opened, a warning is printed once and the counters last for the
+    process.
+
+    The file also sums the time of every page read and write issued on
+    the target, except on fds marked with stats_background(). Scrub
+    watches it to back off when foreground I/O slows down. It holds the
+    QoS token buckets of the target too, so every process limited by
+    lnvm-qos.c draws from the same ones.
+
+    Next to it, <target>.puts counts the puts of every block of the
+    target (4 bytes per block id). Indexes kept per block, like the one
+    of 'write -z', compare it with the count they saw to know the block
+    has been erased since, whichever command put it. When the file
+    cannot be opened the count is unknown, not 0, and those indexes
+    refuse to work.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct stats_tgt {
+    char name[DISK_NAME_LEN];
+    struct nvm_stats *st;
+    int puts_fd;                /* <target>.puts, -1 until opened */
+};
+
+static const char *stats_names[STATS_NR] = {
+    "host", "prog", "pad", "copy", "read", "gets", "puts"
+};
+
+static struct stats_tgt stats_tgts[STATS_MAX_TGTS];
+static int stats_nr_tgts;
+static struct nvm_stats *stats_fd[STATS_MAX_FDS];
+static uint8_t stats_bg[STATS_MAX_FDS];
+static int stats_warned;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nvm_backend *stats_real;
+static struct nvm_backend stats_backend;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *stats_dir(void)
+{
+    const char *dir = getenv("LNVM_STATS");
+
+    return (dir && *dir) ? dir : STATS_DEFAULT_DIR;
+}
+
+/* Map the counters of a target, NULL if it has none and create is 0 */
+static struct nvm_stats *stats_map(const char *tgt, int create)
+{
+    char path[PATH_MAX];
+    struct nvm_stats *st;
+    struct stat sb;
+    uint32_t magic = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s.stats", stats_dir(), tgt);
+    fd = open(path, O_RDWR | ((create) ? O_CREAT : 0), 0644);
+    if (fd < 0 && create && errno == ENOENT && !mkdir(stats_dir(), 0755))
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &sb) || (sb.st_size < sizeof(*st) &&
+                                        ftruncate(fd, sizeof(*st)))) {
+        close(fd);
+        return NULL;
+    }
+
+    st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st == MAP_FAILED)
+        return NULL;
+
+    /* A new file: the first process to get here stamps it */
+    if (__atomic_compare_exchange_n(&st->magic, &magic, STATS_MAGIC, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        st->since = time(NULL);
+    else if (magic != STATS_MAGIC) {
+        fprintf(stderr, "%s is not a stats file.\n", path);
+        munmap(st, sizeof(*st));
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return st;
+}
+
+static struct nvm_stats *stats_lookup(const char *tgt, int create)
+{
+    struct nvm_stats *st = NULL;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < stats_nr_tgts; i++) {
+        if (strcmp(stats_tgts[i].name, tgt) == 0) {
+            st = stats_tgts[i].st;
+            goto out;
+        }
+    }
+
+    if (stats_nr_tgts == STATS_MAX_TGTS || strlen(tgt) >= DISK_NAME_LEN)
+        goto out;
+
+    st = stats_map(tgt, create);
+    if (!st && create) {
+        if (!stats_warned) {
+            fprintf(stderr, "Cannot keep counters in %s: %s. They will only "
+                    "last for this process.\n", stats_dir(), strerror(errno));
+            stats_warned = 1;
+        }
+        st = calloc(1, sizeof(*st));
+        if (!st)
+            goto out;
+        st->magic = STATS_MAGIC;
+        st->since = time(NULL);
+    }
+    if (st) {
+        strcpy(stats_tgts[stats_nr_tgts].name, tgt);
+        stats_tgts[stats_nr_tgts].puts_fd = -1;
+        stats_tgts[stats_nr_tgts++].st = st;
+    }
+out:
+    pthread_mutex_unlock(&stats_lock);
+    return st;
+}
+
+void stats_add(int tgt_fd, int ctr, uint64_t n)
+{
+    struct nvm_stats *st;
+
+    if (tgt_fd < 0 || tgt_fd >= STATS_MAX_FDS)
+        return;
+    st = stats_fd[tgt_fd];
+    if (st)
+        __atomic_fetch_add(&st->ctr[ctr], n, __ATOMIC_RELAXED);
+}
+
+/* Leave the I/O of an fd out of the foreground time */
+void stats_background(int tgt_fd)
+{
+    if (tgt_fd >= 0 && tgt_fd < STATS_MAX_FDS)
+        stats_bg[tgt_fd] = 1;
+}
+
+static void stats_fg_add(int tgt_fd, uint64_t start)
+{
+    struct nvm_stats *st = stats_fd[tgt_fd];
+
+    __atomic_fetch_add(&st->fg_ns, now_ns() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->fg_ios, 1, __ATOMIC_RELAXED);
+}
+
+/* Foreground I/O count and time of the target of an fd, 0 on success */
+int stats_fg(int tgt_fd, uint64_t *ios, uint64_t *ns)
+{
+    struct nvm_stats *st;
+
+    if (tgt_fd < 0 || tgt_fd >= STATS_MAX_FDS || !stats_fd[tgt_fd])
+        return -1;
+    st = stats_fd[tgt_fd];
+
+    *ios = __atomic_load_n(&st->fg_ios, __ATOMIC_RELAXED);
+    *ns = __atomic_load_n(&st->fg_ns, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Counters of a target, 0 on success */
+int stats_get(const char *tgt, struct nvm_stats *out)
+{
+    struct nvm_stats *st = stats_lookup(tgt, 0);
+    int i;
+
+    if (!st)
+        return -1;
+
+    out->magic = st->magic;
+    out->since = st->since;
+    for (i = 0; i < STATS_NR; i++)
+        out->ctr[i] = __atomic_load_n(&st->ctr[i], __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int stats_reset(const char *tgt)
+{
+    struct nvm_stats *st = stats_lookup(tgt, 0);
+    int i;
+
+    if (!st)
+        return -1;
+
+    for (i = 0; i < STATS_NR; i++)
+        __atomic_store_n(&st->ctr[i], 0, __ATOMIC_RELAXED);
+    st->since = time(NULL);
+
+    return 0;
+}
+
+/* The puts file of the target of an fd, -1 if it cannot be opened */
+static int stats_puts_fd(int tgt_fd)
+{
+    char path[PATH_MAX];
+    struct stats_tgt *t;
+    int i, fd = -1;
+
+    if (tgt_fd < 0 || tgt_fd >= STATS_MAX_FDS || !stats_fd[tgt_fd])
+        return -1;
+
+    pthread_mutex_lock(&stats_lock);
+    for (i = 0; i < stats_nr_tgts; i++) {
+        t = &stats_tgts[i];
+        if (t->st != stats_fd[tgt_fd])
+            continue;
+        if (t->puts_fd < 0) {
+            snprintf(path, sizeof(path), "%s/%s.puts", stats_dir(), t->name);
+            t->puts_fd = open(path, O_RDWR | O_CREAT, 0644);
+        }
+        fd = t->puts_fd;
+        break;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    return fd;
+}
+
+/* Times a block of the target of an fd has been put, -1 when the count
+ * cannot be read */
+int stats_blk_puts(int tgt_fd, uint64_t blk_id, uint32_t *puts)
+{
+    int fd = stats_puts_fd(tgt_fd);
+    ssize_t ret;
+
+    *puts = 0;
+    if (fd < 0)
+        return -1;
+
+    /* Past the end of the file: never put */
+    ret = pread(fd, puts, sizeof(*puts), blk_id * sizeof(*puts));
+    if (ret != 0 && ret != sizeof(*puts))
+        return -1;
+
+    return 0;
+}
+
+static void stats_blk_put(int tgt_fd, uint64_t blk_id)
+{
+    int fd = stats_puts_fd(tgt_fd);
+    uint32_t puts;
+
+    if (fd < 0 || stats_blk_puts(tgt_fd, blk_id, &puts))
+        return;
+
+    /* Only the owner of a block puts it: no concurrent update */
+    puts++;
+    if (pwrite(fd, &puts, sizeof(puts),
+                            blk_id * sizeof(puts)) != sizeof(puts))
+        fprintf(stderr, "Could not count the put of block %lu.\n",
+                                                    (unsigned long) blk_id);
+}
+
+/* QoS buckets of a target, in its stats file when it has one */
+struct nvm_qos_bucket *stats_qos(const char *tgt)
+{
+    struct nvm_stats *st = stats_lookup(tgt, 1);
+
+    return (st) ? &st->qos : NULL;
+}
+
+double stats_waf(struct nvm_stats *st)
+{
+    return (st->ctr[STATS_HOST]) ?
+            (double) st->ctr[STATS_PROG] / st->ctr[STATS_HOST] : 0;
+}
+
+static int stats_target_open(const char *tgt, int flags)
+{
+    int fd = stats_real->target_open(tgt, flags);
+
+    if (fd >= 0 && fd < STATS_MAX_FDS)
+        stats_fd[fd] = stats_lookup(tgt, 1);
+
+    return fd;
+}
+
+static void stats_target_close(int fd)
+{
+    if (fd >= 0 && fd < STATS_MAX_FDS) {
+        stats_fd[fd] = NULL;
+        stats_bg[fd] = 0;
+    }
+    qos_unbind(fd);
+    cache_unbind(fd);
+
+    stats_real->target_close(fd);
+}
+
+static int stats_get_block(int fd, uint32_t lun, NVM_VBLOCK *vblk)
+{
+    int ret = stats_real->get_block(fd, lun, vblk);
+
+    if (!ret)
+        stats_add(fd, STATS_GETS, 1);
+
+    return ret;
+}
+
+static int stats_put_block(int fd, NVM_VBLOCK *vblk)
+{
+    int ret = stats_real->put_block(fd, vblk);
+
+    if (!ret) {
+        stats_add(fd, STATS_PUTS, 1);
+        stats_blk_put(fd, vblk->id);
+    }
+
+    return ret;
+}
+
+/* Foreground I/O is timed, 0 if the fd has no counters or is background */
+static uint64_t stats_fg_start(int fd)
+{
+    if (fd < 0 || fd >= STATS_MAX_FDS || !stats_fd[fd] || stats_bg[fd])
+        return 0;
+
+    return now_ns();
+}
+
+static ssize_t stats_pread(int fd, void *buf, size_t len, off_t off)
+{
+    uint64_t start = stats_fg_start(fd);
+    ssize_t ret = stats_real->pread(fd, buf, len, off);
+
+    if (ret > 0)
+        stats_add(fd, STATS_READ, ret);
+    if (start)
+        stats_fg_add(fd, start);
+
+    return ret;
+}
+
+static ssize_t stats_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    uint64_t start = stats_fg_start(fd);
+    ssize_t ret = stats_real->pwrite(fd, buf, len, off);
+
+    if (ret > 0)
+        stats_add(fd, STATS_PROG, ret);
+    if (start)
+        stats_fg_add(fd, start);
+
+    return ret;
+}
+
+/* Count the traffic of the selected backend */
+void stats_wrap(void)
+{
+    if (nvm_be == &stats_backend)
+        return;
+
+    stats_real = nvm_be;
+    stats_backend = *nvm_be;
+    stats_backend.target_open = stats_target_open;
+    stats_backend.target_close = stats_target_close;
+    stats_backend.get_block = stats_get_block;
+    stats_backend.put_block = stats_put_block;
+    stats_backend.pread = stats_pread;
+    stats_backend.pwrite = stats_pwrite;
+    nvm_be = &stats_backend;
+}
+
+/* Targets with a stats file */
+static int stats_list(char (*names)[DISK_NAME_LEN], int max)
+{
+    struct dirent *de;
+    DIR *dir;
+    size_t len;
+    int nr = 0;
+
+    dir = opendir(stats_dir());
+    if (!dir)
+        return 0;
+
+    while ((de = readdir(dir)) && nr < max) {
+        len = strlen(de->d_name);
+        if (len <= 6 || len - 6 >= DISK_NAME_LEN ||
+                                strcmp(de->d_name + len - 6, ".stats"))
+            continue;
+        memcpy(names[nr], de->d_name, len - 6);
+        names[nr++][len - 6] = '\0';
+    }
+    closedir(dir);
+
+    return nr;
+}
+
+static void stats_print(const char *tgt, struct nvm_stats *st, uint8_t fmt,
+                                                                    int first)
+{
+    char since[32];
+    time_t t = st->since;
+    int i;
+
+    strftime(since, sizeof(since), "%Y-%m-%d %H:%M:%S", localtime(&t));
+
+    if (fmt == FMT_JSON) {
+        printf("%s{\"target\":", (first) ? "" : ",");
+        json_str(tgt);
+        for (i = 0; i < STATS_NR; i++)
+            printf(",\"%s\":%lu", stats_names[i],
+                                            (unsigned long) st->ctr[i]);
+        printf(",\"waf\":%.3f,\"since\":%lu}", stats_waf(st),
+                                                (unsigned long) st->since);
+        return;
+    }
+
+    if (fmt == FMT_CSV) {
+        csv_str(tgt);
+        for (i = 0; i < STATS_NR; i++)
+            printf(",%lu", (unsigned long) st->ctr[i]);
+        printf(",%.3f,%lu\n", stats_waf(st), (unsigned long) st->since);
+        return;
+    }
+
+    printf(" %-12s %10.1f %10.1f %9.1f %9.1f %10.1f %7lu %7lu %6.2f  %s\n",
+            tgt, st->ctr[STATS_HOST] / 1048576.0,
+            st->ctr[STATS_PROG] / 1048576.0, st->ctr[STATS_PAD] / 1048576.0,
+            st->ctr[STATS_COPY] / 1048576.0, st->ctr[STATS_READ] / 1048576.0,
+            (unsigned long) st->ctr[STATS_GETS],
+            (unsigned long) st->ctr[STATS_PUTS], stats_waf(st), since);
+}
+
+static void stats_show(char (*names)[DISK_NAME_LEN], int nr, uint8_t fmt,
+                                                                int header)
+{
+    struct nvm_stats st;
+    int i, n = 0;
+
+    if (fmt == FMT_JSON)
+        printf("{\"targets\":[");
+    else if (fmt == FMT_CSV && header)
+        printf("target,host,prog,pad,copy,read,gets,puts,waf,since\n");
+    else
+        printf("\n %-12s %10s %10s %9s %9s %10s %7s %7s %6s  %s\n", "target",
+                "host MB", "prog MB", "pad MB", "copy MB", "read MB", "gets",
+                "puts", "WAF", "since");
+
+    for (i = 0; i < nr; i++)
+        if (stats_get(names[i], &st) == 0)
+            stats_print(names[i], &st, fmt, !n++);
+
+    if (fmt == FMT_JSON)
+        printf("]}\n");
+    fflush(stdout);
+}
+
+void lnvm_stats(struct arguments *args)
+{
+    char (*names)[DISK_NAME_LEN];
+    int nr;
+
+    names = malloc(STATS_MAX_TGTS * DISK_NAME_LEN);
+    if (!names) {
+        printf("Could not allocate memory.\n");
+        return;
+    }
+
+    if (args->stats_tgt[0]) {
+        strcpy(names[0], args->stats_tgt);
+        nr = 1;
+        if (!stats_lookup(args->stats_tgt, 0)) {
+            printf("No counters for target %s in %s.\n", args->stats_tgt,
+                                                                stats_dir());
+            goto out;
+        }
+    } else {
+        nr = stats_list(names, STATS_MAX_TGTS);
+        if (!nr) {
+            printf("No counters in %s.\n", stats_dir());
+            goto out;
+        }
+    }
+
+    if (args->stats_reset) {
+        stats_reset(args->stats_tgt);
+        printf("\n Counters of %s reset.\n\n", args->stats_tgt);
+        goto out;
+    }
+
+    if (args->out_fmt == FMT_HUMAN)
+        printf("\n### LNVM STATS ###\n");
+
+    stats_show(names, nr, args->out_fmt, 1);
+    /* Long-running users update the counters under us */
+    while (args->stats_interval) {
+        sleep(args->stats_interval);
+        stats_show(names, nr, args->out_fmt, 0);
+    }
+    if (args->out_fmt == FMT_HUMAN)
+        printf("\n");
+
+out:
+    free(names);
+}
@@ -0,0 +1,429 @@
+/*  I/O autotuning for lnvm-manager.
+
+    'lnvm tune' probes a target to find how it wants to be driven. The
+    kernel does not report the LUN range of a target, so it first finds
+    the LUNs the target allocates from, by taking a block on each LUN of
+    the device and putting it back. Then it runs three short sweeps, each on freshly
+    allocated blocks of those LUNs:
+
+        size    plane pages per request, up to max_sec_io, on one LUN
+        depth   requests in flight on one LUN, at the size found
+        luns    LUNs driven at once, at the size and depth found
+
+    Every point writes and reads back TUNE_PROBE_PAGES pages per thread,
+    best of TUNE_REPS runs. The value kept is the knee of each curve: the
+    smallest one within TUNE_KNEE percent of the best throughput of the
+    sweep. Past it, latency keeps growing for little bandwidth.
+
+    The result is saved as one line per device in the profile (LNVM_TUNE,
+    default /etc/lnvm/tune.conf):
+
+        # device  settings
+        nvme0n1   io_pages=4 depth=2 luns=8
+
+    get_dev_info() loads it for every command: 'write' and 'read' issue
+    io_pages pages per request, 'copy' runs 'depth' requests per LUN on
+    at most 'luns' copies at once, and read-ahead uses 'depth' workers.
+    The profile only changes how I/O is issued, never where pages are:
+    a 'pg_per_blk' setting written by older versions is ignored.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include "lnvm-manager.h"
+
+struct tune_thr {
+    int tgt_fd;
+    struct nvm_dev_info *info;
+    NVM_VBLOCK vblk;
+    uint8_t dir;
+    int pages;
+    int nr_pages;
+    char *buf;
+    uint64_t lat_ns;
+    uint64_t nr_ios;
+    pthread_t thread;
+    int ret;
+};
+
+struct tune_point {
+    int val;
+    double mbps;
+    double lat_us;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *tune_path(void)
+{
+    const char *path = getenv("LNVM_TUNE");
+
+    return (path && *path) ? path : TUNE_DEFAULT_CONF;
+}
+
+/* Apply the profile of a device, if any, to the defaults in info */
+void tune_load(const char *dev, struct nvm_dev_info *info)
+{
+    char line[256], *tok, *save;
+    uint32_t v;
+    FILE *fp;
+    int lineno = 0;
+
+    fp = fopen(tune_path(), "r");
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        tok = strchr(line, '#');
+        if (tok)
+            *tok = '\0';
+
+        tok = strtok_r(line, " \t\n", &save);
+        if (!tok || strcmp(tok, dev))
+            continue;
+
+        while ((tok = strtok_r(NULL, " \t\n", &save))) {
+            if (sscanf(tok, "pg_per_blk=%u", &v) == 1) {
+                /* Addressing comes from the device alone */
+                continue;
+            } else if (sscanf(tok, "io_pages=%u", &v) == 1) {
+                info->io_pages = v;
+            } else if (sscanf(tok, "depth=%u", &v) == 1) {
+                info->io_depth = v;
+            } else if (sscanf(tok, "luns=%u", &v) == 1) {
+                info->io_luns = v;
+            } else {
+                printf("Tune profile line %d: unknown setting '%s'.\n",
+                                                                lineno, tok);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/* Replace the line of a device in the profile, keep the others */
+static int tune_save(const char *dev, struct nvm_dev_info *info)
+{
+    const char *path = tune_path();
+    char line[256], name[DISK_NAME_LEN], tmp[256];
+    FILE *in, *out;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if (!out) {
+        printf("Could not write %s.\n", tmp);
+        return -1;
+    }
+
+    in = fopen(path, "r");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            if (sscanf(line, "%31s", name) == 1 && strcmp(name, dev) == 0)
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    } else {
+        fprintf(out, "# device  settings (written by 'lnvm tune')\n");
+    }
+
+    fprintf(out, "%-9s io_pages=%u depth=%u luns=%u\n", dev, info->io_pages,
+                                        info->io_depth, info->io_luns);
+
+    if (fclose(out) || rename(tmp, path)) {
+        printf("Could not write %s.\n", path);
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int tune_get(int tgt_fd, uint32_t lun, NVM_VBLOCK *vblk)
+{
+    memset(vblk, 0, sizeof(*vblk));
+    vblk->flags |= NVM_PROV_SPEC_LUN;
+    vblk->owner_id = 101;
+
+    return nvm_be->get_block(tgt_fd, lun, vblk);
+}
+
+/* The LUNs a target allocates from: those of the device it gives a block
+ * on, which is put back at once. */
+static int tune_luns(int tgt_fd, uint32_t dev_luns, uint32_t *luns)
+{
+    NVM_VBLOCK vblk;
+    uint32_t lun;
+    int nr = 0;
+
+    for (lun = 0; lun < dev_luns; lun++) {
+        if (tune_get(tgt_fd, lun, &vblk))
+            continue;
+        nvm_be->put_block(tgt_fd, &vblk);
+        luns[nr++] = lun;
+    }
+
+    return nr;
+}
+
+static void *tune_worker(void *arg)
+{
+    struct tune_thr *thr = arg;
+    uint64_t t;
+    int pg, n;
+
+    for (pg = 0; pg < thr->nr_pages; pg += n) {
+        n = (thr->nr_pages - pg < thr->pages) ? thr->nr_pages - pg :
+                                                                thr->pages;
+        t = now_ns();
+        if (lnvm_page_io(thr->tgt_fd, thr->info, thr->dir, thr->buf,
+                                                    thr->vblk.id, pg, n)) {
+            thr->ret = -1;
+            break;
+        }
+        thr->lat_ns += now_ns() - t;
+        thr->nr_ios++;
+    }
+
+    return NULL;
+}
+
+/* One pass of nr threads, returns the time it took in ns, 0 on error */
+static uint64_t tune_pass(struct tune_thr *thr, int nr, uint8_t dir)
+{
+    uint64_t t;
+    int i, n, ret = 0;
+
+    t = now_ns();
+    for (n = 0; n < nr; n++) {
+        thr[n].dir = dir;
+        thr[n].ret = 0;
+        if (pthread_create(&thr[n].thread, NULL, tune_worker, &thr[n]))
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(thr[i].thread, NULL);
+        ret |= thr[i].ret;
+    }
+    t = now_ns() - t;
+
+    return (n < nr || ret) ? 0 : t;
+}
+
+/* Write and read back 'depth' blocks on each of the first 'luns' LUNs of
+ * the target with requests of 'pages' pages. Returns -1 if the blocks
+ * could not be allocated. */
+static int tune_probe(int tgt_fd, struct nvm_dev_info *info, uint32_t *lun,
+                        int pages, int depth, int luns, int val,
+                        struct tune_point *pt)
+{
+    struct tune_thr *thr;
+    int nr = depth * luns;
+    int probe = (info->pg_per_blk < TUNE_PROBE_PAGES) ? info->pg_per_blk :
+                                                            TUNE_PROBE_PAGES;
+    size_t bytes = (size_t) 2 * nr * probe * info->pln_pg_size;
+    uint64_t t_wr, t_rd, lat, ios;
+    int i, n, rep, ret = 0;
+    char *bufs;
+    double mbps;
+
+    thr = calloc(nr, sizeof(*thr));
+    if (!thr || posix_memalign((void **)&bufs, info->sec_size,
+                                (size_t) nr * pages * info->pln_pg_size)) {
+        printf("Could not allocate aligned memory (%d,%d)\n", info->sec_size,
+                                                        info->pln_pg_size);
+        free(thr);
+        return -1;
+    }
+    memset(bufs, 0x5a, (size_t) nr * pages * info->pln_pg_size);
+
+    pt->val = val;
+    pt->mbps = 0;
+    pt->lat_us = 0;
+
+    for (rep = 0; rep < TUNE_REPS && !ret; rep++) {
+        for (n = 0; n < nr; n++) {
+            memset(&thr[n], 0, sizeof(thr[n]));
+            thr[n].tgt_fd = tgt_fd;
+            thr[n].info = info;
+            thr[n].pages = pages;
+            thr[n].nr_pages = probe;
+            thr[n].buf = bufs + (size_t) n * pages * info->pln_pg_size;
+            if (tune_get(tgt_fd, lun[n % luns], &thr[n].vblk))
+                break;
+        }
+
+        if (n == nr) {
+            t_wr = tune_pass(thr, nr, WRITE);
+            t_rd = (t_wr) ? tune_pass(thr, nr, READ) : 0;
+            if (!t_rd) {
+                printf("  Page I/O failed (%d pages, depth %d, %d LUNs).\n",
+                                                        pages, depth, luns);
+                ret = -1;
+            }
+        } else {
+            ret = -1;
+        }
+
+        while (n--)
+            nvm_be->put_block(tgt_fd, &thr[n].vblk);
+        if (ret)
+            break;
+
+        for (i = 0, lat = 0, ios = 0; i < nr; i++) {
+            lat += thr[i].lat_ns;
+            ios += thr[i].nr_ios;
+        }
+        mbps = bytes / ((t_wr + t_rd) / 1e9) / 1048576;
+        if (mbps > pt->mbps) {
+            pt->mbps = mbps;
+            pt->lat_us = (ios) ? lat / 1e3 / ios : 0;
+        }
+    }
+    free(bufs);
+    free(thr);
+
+    return ret;
+}
+
+/* 1, 2, 4... up to max, max included */
+static int tune_next(int val, int max)
+{
+    if (val >= max)
+        return 0;
+
+    return (val * 2 < max) ? val * 2 : max;
+}
+
+/* The smallest value within TUNE_KNEE percent of the best throughput */
+static int tune_knee(const char *what, struct tune_point *pts, int nr)
+{
+    double best = 0;
+    int i, knee = -1;
+
+    for (i = 0; i < nr; i++)
+        if (pts[i].mbps > best)
+            best = pts[i].mbps;
+
+    printf("\n %8s %10s %12s\n", what, "MB/s", "latency(us)");
+    for (i = 0; i < nr; i++) {
+        printf(" %8d %10.1f %12.1f", pts[i].val, pts[i].mbps, pts[i].lat_us);
+        if (knee < 0 && pts[i].mbps * 100 >= best * (100 - TUNE_KNEE)) {
+            knee = i;
+            printf("  <- knee");
+        }
+        printf("\n");
+    }
+
+    return pts[(knee < 0) ? 0 : knee].val;
+}
+
+void lnvm_tune(struct arguments *args)
+{
+    struct tune_point pts[TUNE_MAX_POINTS];
+    struct nvm_ioctl_tgt_info tgt;
+    struct nvm_ioctl_dev_info dev;
+    struct nvm_dev_info info;
+    uint32_t *luns = NULL;
+    int tgt_fd, nr, v, max, nr_luns;
+
+    printf("\n### LNVM TUNE ###\n");
+
+    memset(&tgt, 0, sizeof(tgt));
+    strcpy(tgt.target.tgtname, args->tune_tgt);
+    memset(&dev, 0, sizeof(dev));
+    if (nvm_be->get_target_info(&tgt)) {
+        printf("nvm_get_target_info error. Failed to get target info.\n");
+        return;
+    }
+    strcpy(dev.dev, tgt.target.dev);
+    if (nvm_be->get_device_info(&dev) || get_dev_info(args->tune_tgt, &info)) {
+        printf("nvm_dev_info error. Failed to get device info.\n");
+        return;
+    }
+
+    tgt_fd = nvm_be->target_open(args->tune_tgt, 0x0);
+    if (tgt_fd < 0) {
+        printf("nvm_target_open error. Failed to open LightNVM target %s.\n",
+                                                            args->tune_tgt);
+        return;
+    }
+
+    luns = malloc(dev.prop.nr_luns * sizeof(uint32_t));
+    if (!luns) {
+        printf("Could not allocate memory.\n");
+        goto close;
+    }
+    nr_luns = tune_luns(tgt_fd, dev.prop.nr_luns, luns);
+    if (!nr_luns) {
+        printf("nvm_get_block error. 'dmesg' for further info.\n");
+        goto close;
+    }
+
+    printf(" Device %s: %u channel(s), %u LUN(s), %u plane(s)\n", dev.dev,
+            dev.prop.nr_channels, dev.prop.nr_luns, dev.prop.nr_planes);
+    printf(" Target %s: %d LUN(s) found, from LUN %u\n", args->tune_tgt,
+                                                            nr_luns, luns[0]);
+    printf(" Plane page: %u bytes, %u pages per block, max_sec_io: %u "
+            "(%d pages)\n", info.pln_pg_size, info.pg_per_blk,
+            info.max_sec_io, max_io_pages(&info));
+
+    max = (max_io_pages(&info) < TUNE_PROBE_PAGES) ? max_io_pages(&info) :
+                                                            TUNE_PROBE_PAGES;
+    for (nr = 0, v = 1; v && nr < TUNE_MAX_POINTS; v = tune_next(v, max))
+        if (tune_probe(tgt_fd, &info, luns, v, 1, 1, v, &pts[nr++]))
+            goto fail;
+    info.io_pages = tune_knee("pages", pts, nr);
+
+    for (nr = 0, v = 1; v && nr < TUNE_MAX_POINTS;
+                                        v = tune_next(v, TUNE_MAX_DEPTH))
+        if (tune_probe(tgt_fd, &info, luns, info.io_pages, v, 1, v,
+                                                                &pts[nr++]))
+            goto fail;
+    info.io_depth = tune_knee("depth", pts, nr);
+
+    max = TUNE_MAX_THREADS / info.io_depth;
+    if (max > nr_luns)
+        max = nr_luns;
+    for (nr = 0, v = 1; v && nr < TUNE_MAX_POINTS; v = tune_next(v, max)) {
+        /* A LUN may run out of free blocks */
+        if (tune_probe(tgt_fd, &info, luns, info.io_pages, info.io_depth, v,
+                                                            v, &pts[nr])) {
+            if (!nr)
+                goto fail;
+            printf("  Stopping the LUN sweep at %d LUN(s).\n", pts[nr-1].val);
+            break;
+        }
+        nr++;
+    }
+    info.io_luns = tune_knee("luns", pts, nr);
+
+    printf("\n Profile for %s: io_pages=%u depth=%u luns=%u\n", dev.dev,
+                                info.io_pages, info.io_depth, info.io_luns);
+
+    if (args->tune_dry)
+        printf(" Dry run, %s not updated.\n", tune_path());
+    else if (tune_save(dev.dev, &info) == 0)
+        printf(" Saved to %s.\n", tune_path());
+    printf("\n");
+    goto close;
+
+fail:
+    printf("\n Probe failed, %s not updated.\n\n", tune_path());
+close:
+    free(luns);
+    nvm_be->target_close(tgt_fd);
+}
@@ -0,0 +1,399 @@
+/*  Write coalescing buffer for lnvm-manager.
+
+    The device programs whole plane pages only. Small records are staged
+    in a page-sized buffer of the open block and packed back to back; the
+    page is programmed when it is full, when the oldest staged record has
+    waited 'timeout_ms', or on wbuf_sync(). Each record gets its address
+    (block, page, offset, length) back from wbuf_append().
+
+    Records never span pages: a record that does not fit in what is left
+    of the current page goes to the next one. When the block is full, the
+    buffer moves on to a block from its pool, if it has one.
+
+    With '-k FILE', 'append' keeps its state in a checkpoint (see
+    lnvm-ckpt.c) and a later run without '-b' continues where it
+    stopped, even after a crash.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <argp.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/lightnvm.h>
+#include <liblightnvm.h>
+#include <linux/types.h>
+#include "lnvm-manager.h"
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Program the staged page, padding the unused tail. Lock must be held. */
+static int wbuf_flush(struct nvm_wbuf *wb)
+{
+    uint32_t size = wb->info->pln_pg_size;
+    uint32_t fill = wb->fill, recs = wb->page_recs;
+    int pg = wb->next_pg;
+
+    if (!wb->fill)
+        return 0;
+
+    memset(wb->page + wb->fill, 0, size - wb->fill);
+
+    if (lnvm_page_io(wb->tgt_fd, wb->info, WRITE, wb->page, wb->blk_id,
+                                                                    pg, 1)) {
+        fprintf(stderr, "  Could not perform IO on page %d.\n", pg);
+        return -1;
+    }
+
+    /* Programmed: never again, whatever fails below */
+    stats_add(wb->tgt_fd, STATS_HOST, fill);
+    stats_add(wb->tgt_fd, STATS_PAD, size - fill);
+    wb->pad_bytes += size - fill;
+    wb->next_pg++;
+    wb->fill = 0;
+    wb->page_recs = 0;
+
+    if (page_cache)
+        cache_inval(page_cache, wb->tgt_fd, wb->blk_id, pg, 1);
+
+    if (wb->cs && csum_store(wb->cs, wb->blk_id, pg, 1, wb->page))
+        return -1;
+
+    /* Logged once programmed: after a crash in between, a resumed run
+     * finds the page programmed and skips it */
+    return ckpt_log(wb->ck, CKPT_OP_PROG, wb->blk_id, wb->lun, pg, recs,
+                                                                    fill);
+}
+
+static void *wbuf_timer(void *arg)
+{
+    struct nvm_wbuf *wb = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&wb->lock);
+    while (!wb->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (wb->timeout_ms / 2 + 1) * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wb->cond, &wb->lock, &ts);
+
+        if (wb->fill && now_ms() - wb->first >= wb->timeout_ms)
+            wbuf_flush(wb);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return NULL;
+}
+
+int wbuf_init(struct nvm_wbuf *wb, int tgt_fd, struct nvm_dev_info *info,
+                    uint32_t blk_id, int start_pg, uint32_t timeout_ms)
+{
+    int ret;
+
+    memset(wb, 0, sizeof(*wb));
+    wb->tgt_fd = tgt_fd;
+    wb->info = info;
+    wb->blk_id = blk_id;
+    wb->next_pg = start_pg;
+    wb->timeout_ms = timeout_ms;
+
+    ret = posix_memalign((void **)&wb->page, info->sec_size,
+                                                        info->pln_pg_size);
+    if (ret) {
+        fprintf(stderr, "Could not allocate write aligned memory (%d,%d)\n",
+                                        info->sec_size, info->pln_pg_size);
+        return -1;
+    }
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->cond, NULL);
+
+    if (timeout_ms && pthread_create(&wb->timer, NULL, wbuf_timer, wb)) {
+        fprintf(stderr, "Could not start write buffer timer.\n");
+        free(wb->page);
+        return -1;
+    }
+
+    return 0;
+}
+
+int wbuf_append(struct nvm_wbuf *wb, const void *data, uint32_t len,
+                                                struct nvm_rec_addr *addr)
+{
+    NVM_VBLOCK vblk;
+    int ret = 0;
+
+    if (!len || len > wb->info->pln_pg_size) {
+        fprintf(stderr, "Record of %u bytes does not fit in a page "
+                        "(%u bytes).\n", len, wb->info->pln_pg_size);
+        return -1;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+
+    if (wb->fill + len > wb->info->pln_pg_size) {
+        ret = wbuf_flush(wb);
+        if (ret)
+            goto out;
+    }
+
+    if (wb->next_pg >= wb->info->pg_per_blk) {
+        if (!wb->pool) {
+            fprintf(stderr, "Block %u is full.\n", wb->blk_id);
+            ret = -ENOSPC;
+            goto out;
+        }
+        ret = pool_get(wb->pool, wb->lun, &vblk);
+        if (ret)
+            goto out;
+        ret = ckpt_log(wb->ck, CKPT_OP_OPEN, vblk.id, wb->lun, 0, 0, 0);
+        if (ret)
+            goto out;
+        wb->blk_id = vblk.id;
+        wb->next_pg = 0;
+        wb->nr_blks++;
+    }
+
+    if (!wb->fill)
+        wb->first = now_ms();
+
+    memcpy(wb->page + wb->fill, data, len);
+
+    addr->blk_id = wb->blk_id;
+    addr->pg = wb->next_pg;
+    addr->off = wb->fill;
+    addr->len = len;
+
+    wb->fill += len;
+    wb->page_recs++;
+    wb->host_bytes += len;
+    wb->nr_recs++;
+
+    if (wb->fill == wb->info->pln_pg_size)
+        ret = wbuf_flush(wb);
+
+out:
+    pthread_mutex_unlock(&wb->lock);
+    return ret;
+}
+
+int wbuf_sync(struct nvm_wbuf *wb)
+{
+    int ret;
+
+    pthread_mutex_lock(&wb->lock);
+    ret = wbuf_flush(wb);
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret;
+}
+
+void wbuf_free(struct nvm_wbuf *wb)
+{
+    if (wb->timeout_ms) {
+        pthread_mutex_lock(&wb->lock);
+        wb->stop = 1;
+        pthread_cond_signal(&wb->cond);
+        pthread_mutex_unlock(&wb->lock);
+        pthread_join(wb->timer, NULL);
+    }
+
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->cond);
+    free(wb->page);
+}
+
+/* Whether page pg of a block was programmed. An erased page fails to read
+ * or reads back as one repeated byte; a programmed page of the writer does
+ * too only if all its records are that byte. */
+static int wbuf_programmed(int tgt_fd, struct nvm_dev_info *info,
+                                                    uint32_t blk_id, int pg)
+{
+    char *page;
+    uint32_t i;
+    int ret = 0;
+
+    if (posix_memalign((void **)&page, info->sec_size, info->pln_pg_size)) {
+        fprintf(stderr, "Could not allocate read aligned memory (%d,%d)\n",
+                                        info->sec_size, info->pln_pg_size);
+        return -1;
+    }
+
+    if (lnvm_page_io(tgt_fd, info, READ, page, blk_id, pg, 1) == 0) {
+        for (i = 1; i < info->pln_pg_size && page[i] == page[0]; i++);
+        ret = (i < info->pln_pg_size);
+    }
+
+    free(page);
+    return ret;
+}
+
+void lnvm_append(struct arguments *args)
+{
+    struct nvm_dev_info info;
+    struct nvm_csum cs = { .fd = -1 };
+    struct nvm_ckpt ck = { .fd = -1 };
+    struct nvm_ckpt_blk open;
+    struct nvm_rec_addr addr;
+    struct nvm_pool pool;
+    struct nvm_wbuf wb;
+    NVM_VBLOCK vblk;
+    FILE *in = stdin;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int tgt_fd;
+    int ret;
+
+    ret = get_dev_info(args->app_tgt, &info);
+    if (ret) {
+        fprintf(stderr, "nvm_dev_info error. Failed to get device info.\n");
+        return;
+    }
+
+    if (args->app_pgstart >= info.pg_per_blk) {
+        fprintf(stderr, " IO out of bounds (last page in the block %d: %d)\n",
+                                        args->app_blkid, info.pg_per_blk - 1);
+        return;
+    }
+
+    tgt_fd = nvm_be->target_open(args->app_tgt, 0x0);
+    if (tgt_fd < 0) {
+        fprintf(stderr, "nvm_target_open error. Failed to open LightNVM "
+                                            "target %s.\n", args->app_tgt);
+        return;
+    }
+    qos_bind(tgt_fd, args->app_tgt);
+    cache_bind(tgt_fd, args->app_tgt, &info);
+
+    if (args->app_csum && csum_open(&cs, args->app_csum, &info))
+        goto close;
+
+    if (args->app_file) {
+        in = fopen(args->app_file, "r");
+        if (!in) {
+            fprintf(stderr, "Could not open %s.\n", args->app_file);
+            goto close;
+        }
+    }
+
+    if (args->app_ckpt) {
+        if (ckpt_open(&ck, args->app_ckpt, &info))
+            goto close_in;
+
+        /* Blocks a crashed run had pooled were never written */
+        ret = ckpt_release(&ck, tgt_fd);
+        if (ret && (args->app_flag & IOARGV))
+            fprintf(stderr, " %d pooled block(s) of the last run put back.\n",
+                                                                        ret);
+
+        if (!(args->app_flag & IOARGB) && ckpt_resume(&ck, &open) == 0) {
+            args->app_blkid = open.id;
+            args->app_lun = open.lun;
+            args->app_pgstart = open.next_pg;
+            args->app_flag |= IOARGB;
+
+            /* Programmed by a run that died before logging it */
+            if (open.next_pg < info.pg_per_blk) {
+                ret = wbuf_programmed(tgt_fd, &info, open.id, open.next_pg);
+                if (ret < 0)
+                    goto free_ckpt;
+                args->app_pgstart += ret;
+            }
+            if (args->app_flag & IOARGV)
+                fprintf(stderr, " Resuming block %u page %u (checkpoint "
+                        "%lu, %u log record(s) replayed).\n",
+                        args->app_blkid, args->app_pgstart,
+                        (unsigned long) ck.cur->gen - 1, ck.replayed);
+        } else if (!(args->app_flag & (IOARGB | IOARGL))) {
+            fprintf(stderr, "Checkpoint %s has no open block, use 'b' or "
+                                                "'l'.\n", args->app_ckpt);
+            goto free_ckpt;
+        }
+    }
+
+    if (args->app_flag & IOARGL) {
+        if (pool_init(&pool, tgt_fd, args->app_lun, args->app_lun, POOL_LOW,
+                                                POOL_HIGH, (args->app_ckpt) ?
+                                                                &ck : NULL))
+            goto free_ckpt;
+
+        /* Without a block, start on a fresh one */
+        if (!(args->app_flag & IOARGB)) {
+            if (pool_get(&pool, args->app_lun, &vblk))
+                goto free_pool;
+            args->app_blkid = vblk.id;
+            args->app_pgstart = 0;
+        }
+    }
+
+    if (wbuf_init(&wb, tgt_fd, &info, args->app_blkid, args->app_pgstart,
+                                                        args->app_timeout))
+        goto free_pool;
+    if (cs.fd >= 0)
+        wb.cs = &cs;
+    if (args->app_ckpt) {
+        wb.ck = &ck;
+        if (ckpt_log(&ck, CKPT_OP_OPEN, args->app_blkid, args->app_lun,
+                                                args->app_pgstart, 0, 0)) {
+            wbuf_free(&wb);
+            goto free_pool;
+        }
+    }
+    if (args->app_flag & IOARGL) {
+        wb.pool = &pool;
+        wb.lun = args->app_lun;
+        /* The first block came from the pool too */
+        if (!(args->app_flag & IOARGB))
+            wb.nr_blks = 1;
+    }
+
+    /* One record per input line. The address map goes to stdout as
+     * 'block page offset length' */
+    while ((len = getline(&line, &cap, in)) > 0) {
+        ret = wbuf_append(&wb, line, len, &addr);
+        if (ret)
+            break;
+        printf("%u %u %u %u\n", addr.blk_id, addr.pg, addr.off, addr.len);
+    }
+
+    if (wbuf_sync(&wb) == 0 && (args->app_flag & IOARGV)) {
+        fprintf(stderr, "\n ### LNVM APPEND ###\n");
+        fprintf(stderr, " %lu record(s), %lu bytes packed (%lu bytes of "
+                "padding). Last page: block %u page %d.\n",
+                (unsigned long) wb.nr_recs, (unsigned long) wb.host_bytes,
+                (unsigned long) wb.pad_bytes, wb.blk_id, wb.next_pg - 1);
+        if (wb.host_bytes)
+            fprintf(stderr, " Write amplification: %.2f\n",
+                    (double) (wb.host_bytes + wb.pad_bytes) / wb.host_bytes);
+        if (wb.pool)
+            fprintf(stderr, " %u block(s) taken from LUN %u (%lu allocation "
+                    "stall(s)).\n", wb.nr_blks, wb.lun,
+                    (unsigned long) pool.stalls);
+    }
+
+    wbuf_free(&wb);
+    free(line);
+free_pool:
+    if (args->app_flag & IOARGL)
+        pool_free(&pool);
+free_ckpt:
+    if (args->app_ckpt)
+        ckpt_close(&ck);
+close_in:
+    if (in != stdin)
+        fclose(in);
+close:
+    csum_close(&cs);
+    nvm_be->target_close(tgt_fd);
+}